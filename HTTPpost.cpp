@@ -24,6 +24,8 @@ using namespace std;
 char CloudHost_name[256];
 char CloudHost_serverpath[256]; 
 unsigned int CloudHost_port;
+struct sockaddr_in CloudHost_addr;	// resolved once (hhtpPOST_connect)
+bool CloudHost_resolved= false;
 int h_errno;
 
 void upload_system_error(const char *msg);
@@ -33,6 +35,7 @@ void hhtpPOST_init(const char *hostname, const char *path, unsigned int port)
 	snprintf(CloudHost_name, sizeof(CloudHost_name), "%s", hostname);
 	snprintf(CloudHost_serverpath, sizeof(CloudHost_serverpath), "%s", path);
 	CloudHost_port= port;
+	CloudHost_resolved= false;
 }
 
 
@@ -157,6 +160,101 @@ int hhtpPOST_upload(char *phtml, size_t szhtml, double *elapsed, char **xmlcode_
 }
 
 
+// ------------------------------------------------------------------------------------------------
+// NON-BLOCKING UPLOAD
+// hhtpPOST_connect -> hhtpPOST_send (socket writable) -> hhtpPOST_receive (socket readable)
+// ------------------------------------------------------------------------------------------------
+
+// Start connecting to the cloud server
+// returns the socket (connection in progress: wait for it to be writable), -1 on error
+// The host name is resolved on the first call only
+int hhtpPOST_connect(void)
+{
+	if(!CloudHost_resolved)
+	{
+		struct hostent *hptr;
+		if((hptr = gethostbyname(CloudHost_name)) == NULL || hptr->h_addrtype != AF_INET || hptr->h_addr_list[0] == NULL) 
+		{
+			fprintf(stderr, "\n[ERROR] gethostbyname error for host: %s: %s", CloudHost_name, hstrerror(h_errno));
+			fflush(stderr);
+			return -1;
+		}
+		bzero(&CloudHost_addr, sizeof(CloudHost_addr));
+		CloudHost_addr.sin_family = AF_INET;
+		CloudHost_addr.sin_port = htons(CloudHost_port);
+		memcpy(&CloudHost_addr.sin_addr, hptr->h_addr_list[0], sizeof(CloudHost_addr.sin_addr));
+		CloudHost_resolved= true;
+	}
+	int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(sockfd == -1)
+	{
+		upload_system_error("socket");
+		return -1;
+	}
+	if(connect(sockfd, (struct sockaddr *) &CloudHost_addr, sizeof(CloudHost_addr)) != 0 && errno != EINPROGRESS)
+	{
+		upload_system_error("sockect error - no connection");
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+// Socket writable: send what is left of the message
+// returns 1 when the whole message is sent, 0 when the socket is full (wait until writable), -1 on error
+int hhtpPOST_send(int sockfd, const char *phtml, size_t szhtml, size_t *sent)
+{
+	if(*sent == 0)
+	{
+		// first time writable: outcome of connect
+		int err= 0;
+		socklen_t len= sizeof(err);
+		if(getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+		{
+			if(err) errno= err;
+			upload_system_error("sockect error - no connection");
+			return -1;
+		}
+	}
+	while(*sent < szhtml)
+	{
+		ssize_t n= write(sockfd, &phtml[*sent], szhtml - *sent);
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if(errno == EINTR) continue;
+			upload_system_error("send");
+			return -1;
+		}
+		*sent += n;
+	}
+	return 1;
+}
+
+// Socket readable: read the response (HTTP/1.0: the server closes when done)
+// returns 1 when the response is complete, 0 when more is to come (wait until readable), -1 on error
+// xmlcode_ptr points to the xml part of the response
+int hhtpPOST_receive(int sockfd, char *phtml, size_t max, size_t *received, char **xmlcode_ptr)
+{
+	for(;;)
+	{
+		if(*received + 1 >= max) break;
+		ssize_t n= read(sockfd, &phtml[*received], max - 1 - *received);
+		if(n > 0) { *received += n; continue; }
+		if(n == 0) break;
+		if(errno == EINTR) continue;
+		if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+		phtml[*received]='\0';
+		upload_system_error("receive");
+		return -1;
+	}
+	phtml[*received]='\0';
+	if(*received == 0) return -1;
+	char *xml= strstr(phtml, "<?xml");
+	if(xmlcode_ptr) *xmlcode_ptr= xml;
+	return 1;
+}
+
 // ------------------------------------------------------------------------------------------------
 // ------------------------------------------------------------------------------------------------
 // ------------------------------------------------------------------------------------------------
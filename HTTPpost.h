@@ -9,5 +9,9 @@
 void hhtpPOST_init(const char *, const char *, unsigned int );
 int hhtpPOST_upload(char *, size_t, double *, char ** );
 size_t hhtpPOST_header(const char*, char *, size_t , size_t *, size_t );
+// non-blocking upload, driven by the caller's event loop
+int hhtpPOST_connect(void);
+int hhtpPOST_send(int , const char *, size_t , size_t *);
+int hhtpPOST_receive(int , char *, size_t , size_t *, char ** );
 
 /* END OF FILE */
\ No newline at end of file
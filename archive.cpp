@@ -0,0 +1,537 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * Archive of every image of a long time-lapse
+ *
+ * Images are appended to large segment files, each with a compact binary index (time, offset, size,
+ * sequence number). Readers map the indexes, find images by time with binary searches, map the
+ * segment of the image and export ranges as MJPEG AVI files
+ **************************************************************************************************
+*/
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "archive.h"
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+	const char *p= (const char *) data;
+	for(size_t done= 0; done < size; )
+	{
+		ssize_t r= write(fd, p + done, size - done);
+		if(r == -1 && errno == EINTR) continue;
+		if(r <= 0) return false;
+		done+= (size_t) r;
+	}
+	return true;
+}
+
+// Segment names (no extension) of 'dir', oldest first
+static std::vector<std::string> segment_names(const std::string &dir)
+{
+	std::vector<std::string> names;
+	DIR *d= opendir(dir.c_str());
+	if(!d) return names;
+	struct dirent *e;
+	while((e= readdir(d)) != 0)
+	{
+		size_t len= strlen(e->d_name);
+		if(len > 4 && strcmp(&e->d_name[len - 4], ".idx") == 0) names.push_back(std::string(e->d_name, len - 4));
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+ArchiveWriter::ArchiveWriter(const char *d, int w, int h)
+{
+	dir= d;
+	if(dir.empty() || dir[dir.size() - 1] != '/') dir+= "/";
+	width= w;
+	height= h;
+	segment_bytes= (uint64_t) ARCHIVE_SEGMENT_MB << 20;
+	segment_seconds= ARCHIVE_ROTATE_H * 3600L;
+	retain_bytes= 0;
+	retain_seconds= 0;
+	frames= 0;
+	segments= 0;
+	removed= 0;
+	errors= 0;
+	data_fd= -1;
+	index_fd= -1;
+	data_size= 0;
+	segment_start_us= 0;
+}
+
+ArchiveWriter::~ArchiveWriter(void)
+{
+	Close();
+}
+
+// The directory is made when missing. Segments are started by the first image
+int ArchiveWriter::Open(void)
+{
+	if(mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+	{
+		perror(("ERROR: cannot make " + dir).c_str());
+		return -1;
+	}
+	struct stat st;
+	if(stat(dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))
+	{
+		fprintf(stdout, "\nERROR: %s is not a directory", dir.c_str());
+		return -1;
+	}
+	Retain();
+	return 0;
+}
+
+// Current segment closed and a new one started, named after the capture time of its first image
+int ArchiveWriter::Rotate(int64_t wallclock_us)
+{
+	Close();
+	char str[64];
+	time_t t= (time_t) (wallclock_us / 1000000);
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	size_t len= strftime(str, sizeof(str), "%Y%m%d-%H%M%S", &tm);
+	snprintf(&str[len], sizeof(str) - len, "-%03d", (int) (wallclock_us / 1000 % 1000));
+	name= dir + str;
+	// O_EXCL: a segment is never appended to by a second run (the clock went back): skipped instead
+	data_fd= open((name + ".mjpg").c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+	if(data_fd != -1) index_fd= open((name + ".idx").c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+	ArchiveIndexHeader h;
+	h.magic= ARCHIVE_MAGIC;
+	h.version= ARCHIVE_VERSION;
+	h.width= (uint32_t) width;
+	h.height= (uint32_t) height;
+	if(data_fd == -1 || index_fd == -1 || !write_all(index_fd, &h, sizeof(h)))
+	{
+		perror(("ERROR: archive segment " + name).c_str());
+		if(data_fd != -1) unlink((name + ".mjpg").c_str());
+		if(index_fd != -1) unlink((name + ".idx").c_str());
+		Close();
+		return -1;
+	}
+	data_size= 0;
+	segment_start_us= wallclock_us;
+	segments++;
+	Retain();
+	return 0;
+}
+
+// Image appended to the current segment, then its record to the index
+int ArchiveWriter::Append(const void *jpeg, size_t size, unsigned long sequence, int64_t timestamp_us, int64_t wallclock_us)
+{
+	if(data_fd == -1 || (data_size > 0 && data_size + size > segment_bytes) ||
+		(segment_seconds > 0 && wallclock_us - segment_start_us >= (int64_t) segment_seconds * 1000000))
+	{
+		if(Rotate(wallclock_us) != 0)
+		{
+			errors++;
+			return -1;
+		}
+	}
+	ArchiveRecord rec;
+	rec.wallclock_us= wallclock_us;
+	rec.timestamp_us= timestamp_us;
+	rec.offset= data_size;
+	rec.size= (uint32_t) size;
+	rec.sequence= (uint32_t) sequence;
+	if(!write_all(data_fd, jpeg, size))
+	{
+		// the tail of a partial write is not indexed and is skipped by the next image
+		struct stat st;
+		if(fstat(data_fd, &st) == 0) data_size= (uint64_t) st.st_size;
+		errors++;
+		return -1;
+	}
+	data_size+= size;
+	if(!write_all(index_fd, &rec, sizeof(rec)))
+	{
+		// the index may end with part of a record: readers ignore it. Next images in a new segment
+		Close();
+		errors++;
+		return -1;
+	}
+	frames++;
+	return 0;
+}
+
+// Data of the segment on the card before the next segment is started
+void ArchiveWriter::Close(void)
+{
+	if(data_fd != -1)
+	{
+		fdatasync(data_fd);
+		close(data_fd);
+	}
+	if(index_fd != -1)
+	{
+		fdatasync(index_fd);
+		close(index_fd);
+	}
+	data_fd= -1;
+	index_fd= -1;
+}
+
+// Oldest segments removed while over the limits, with room for a whole new segment. The current
+// segment is kept
+void ArchiveWriter::Retain(void)
+{
+	if(retain_bytes == 0 && retain_seconds == 0) return;
+	std::vector<std::string> names= segment_names(dir);
+	std::vector<uint64_t> sizes(names.size(), 0);
+	std::vector<time_t> times(names.size(), 0);
+	uint64_t total= 0;
+	for(size_t i=0; i<names.size(); i++)
+	{
+		struct stat st;
+		if(stat((dir + names[i] + ".idx").c_str(), &st) == 0) sizes[i]+= (uint64_t) st.st_size;
+		// last image appended
+		if(stat((dir + names[i] + ".mjpg").c_str(), &st) == 0)
+		{
+			sizes[i]+= (uint64_t) st.st_size;
+			times[i]= st.st_mtime;
+		}
+		total+= sizes[i];
+	}
+	time_t now= time(0);
+	for(size_t i=0; i<names.size(); i++)
+	{
+		if(dir + names[i] == name) break;
+		bool too_large= retain_bytes > 0 && total + segment_bytes > retain_bytes;
+		bool too_old= retain_seconds > 0 && now - times[i] > retain_seconds;
+		if(!too_large && !too_old) break;
+		// index first: a reader never finds an index without its data
+		unlink((dir + names[i] + ".idx").c_str());
+		unlink((dir + names[i] + ".mjpg").c_str());
+		total-= sizes[i];
+		removed++;
+	}
+}
+
+void ArchiveWriter::PrintStats(FILE *fp)
+{
+	fprintf(fp, "\nArchive %s: %lu images, %lu segments started, %lu removed, %lu errors", dir.c_str(), frames, segments, removed, errors);
+}
+
+ArchiveReader::ArchiveReader(void)
+{
+	width= 0;
+	height= 0;
+	total= 0;
+	mapped= -1;
+	data_map= 0;
+	data_map_size= 0;
+}
+
+ArchiveReader::~ArchiveReader(void)
+{
+	Close();
+}
+
+void ArchiveReader::Close(void)
+{
+	if(data_map) munmap((void *) data_map, data_map_size);
+	data_map= 0;
+	mapped= -1;
+	for(size_t i=0; i<segments.size(); i++)
+	{
+		if(segments[i].index_map) munmap(segments[i].index_map, segments[i].index_size);
+		if(segments[i].data_fd != -1) close(segments[i].data_fd);
+	}
+	segments.clear();
+	total= 0;
+}
+
+// Indexes of the segments in 'dir' mapped. Segments with no images (or not ours) are skipped
+int ArchiveReader::Open(const char *d)
+{
+	Close();
+	std::string dir= d;
+	if(dir.empty() || dir[dir.size() - 1] != '/') dir+= "/";
+	std::vector<std::string> names= segment_names(dir);
+	for(size_t i=0; i<names.size(); i++)
+	{
+		Segment s;
+		s.name= names[i];
+		s.index_map= 0;
+		s.index_size= 0;
+		s.records= 0;
+		s.count= 0;
+		s.first= total;
+		s.data_fd= -1;
+		s.data_size= 0;
+		int fd= open((dir + names[i] + ".idx").c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if(fd == -1) continue;
+		if(fstat(fd, &st) == 0 && (size_t) st.st_size > sizeof(ArchiveIndexHeader))
+		{
+			s.index_size= (size_t) st.st_size;
+			void *p= mmap(0, s.index_size, PROT_READ, MAP_SHARED, fd, 0);
+			s.index_map= p == MAP_FAILED ? 0 : p;
+		}
+		close(fd);
+		if(!s.index_map) continue;
+		const ArchiveIndexHeader *h= (const ArchiveIndexHeader *) s.index_map;
+		s.data_fd= open((dir + names[i] + ".mjpg").c_str(), O_RDONLY | O_CLOEXEC);
+		if(h->magic != ARCHIVE_MAGIC || h->version != ARCHIVE_VERSION || s.data_fd == -1 || fstat(s.data_fd, &st) == -1)
+		{
+			munmap(s.index_map, s.index_size);
+			if(s.data_fd != -1) close(s.data_fd);
+			continue;
+		}
+		s.data_size= (uint64_t) st.st_size;
+		s.records= (const ArchiveRecord *) (h + 1);
+		// records of images all in the data file (the segment may be being written)
+		s.count= (long) ((s.index_size - sizeof(ArchiveIndexHeader)) / sizeof(ArchiveRecord));
+		while(s.count > 0 && s.records[s.count - 1].offset + s.records[s.count - 1].size > s.data_size) s.count--;
+		if(s.count == 0)
+		{
+			munmap(s.index_map, s.index_size);
+			close(s.data_fd);
+			continue;
+		}
+		width= (int) h->width;
+		height= (int) h->height;
+		total+= s.count;
+		segments.push_back(s);
+	}
+	if(segments.empty())
+	{
+		fprintf(stdout, "\nERROR: no archive images in %s", dir.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+long ArchiveReader::Count(void)
+{
+	return total;
+}
+
+// Number of the first image taken at or after wallclock_us, Count() when none
+long ArchiveReader::Seek(int64_t wallclock_us)
+{
+	// first segment whose last image is not older than wallclock_us
+	size_t lo= 0, hi= segments.size();
+	while(lo < hi)
+	{
+		size_t mid= (lo + hi) / 2;
+		const Segment &s= segments[mid];
+		if(s.records[s.count - 1].wallclock_us < wallclock_us) lo= mid + 1;
+		else hi= mid;
+	}
+	if(lo == segments.size()) return total;
+	const Segment &s= segments[lo];
+	long a= 0, b= s.count;
+	while(a < b)
+	{
+		long mid= (a + b) / 2;
+		if(s.records[mid].wallclock_us < wallclock_us) a= mid + 1;
+		else b= mid;
+	}
+	return s.first + a;
+}
+
+// Data of segment 'k' mapped, in place of the one mapped before
+int ArchiveReader::Map(size_t k)
+{
+	if(mapped == (int) k) return 0;
+	if(data_map) munmap((void *) data_map, data_map_size);
+	data_map= 0;
+	mapped= -1;
+	data_map_size= (size_t) segments[k].data_size;
+	void *p= mmap(0, data_map_size, PROT_READ, MAP_SHARED, segments[k].data_fd, 0);
+	if(p == MAP_FAILED)
+	{
+		perror(("ERROR: archive segment mapping " + segments[k].name).c_str());
+		return -1;
+	}
+	madvise(p, data_map_size, MADV_SEQUENTIAL);
+	data_map= (const uint8_t *) p;
+	mapped= (int) k;
+	return 0;
+}
+
+int ArchiveReader::Get(long n, ArchiveFrame *f)
+{
+	if(n < 0 || n >= total) return -1;
+	// segment of image n: last one with first <= n
+	size_t lo= 0, hi= segments.size();
+	while(hi - lo > 1)
+	{
+		size_t mid= (lo + hi) / 2;
+		if(segments[mid].first <= n) lo= mid;
+		else hi= mid;
+	}
+	if(Map(lo) != 0) return -1;
+	const ArchiveRecord *r= &segments[lo].records[n - segments[lo].first];
+	f->data= data_map + r->offset;
+	f->size= r->size;
+	f->wallclock_us= r->wallclock_us;
+	f->timestamp_us= r->timestamp_us;
+	f->sequence= r->sequence;
+	return 0;
+}
+
+static void print_time(FILE *fp, int64_t wallclock_us)
+{
+	char str[32];
+	time_t t= (time_t) (wallclock_us / 1000000);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	strftime(str, sizeof(str), "%Y%m%d-%H%M%S", &tm);
+	fprintf(fp, "%s", str);
+}
+
+void ArchiveReader::PrintInfo(FILE *fp)
+{
+	uint64_t bytes= 0;
+	for(size_t i=0; i<segments.size(); i++)
+	{
+		const Segment &s= segments[i];
+		fprintf(fp, "%s: %6ld images %8.1f MB  ", s.name.c_str(), s.count, s.data_size / 1048576.0);
+		print_time(fp, s.records[0].wallclock_us);
+		fprintf(fp, " to ");
+		print_time(fp, s.records[s.count - 1].wallclock_us);
+		fprintf(fp, "\n");
+		bytes+= s.data_size;
+	}
+	fprintf(fp, "%u segments, %ld images %dx%d, %.1f MB\n", (unsigned int) segments.size(), total, width, height, bytes / 1048576.0);
+}
+
+// AVI (RIFF) writing: chunks are 'fourcc, size, data', padded to an even size
+static void put32(std::vector<uint8_t> *b, uint32_t v)
+{
+	for(int i=0; i<4; i++) b->push_back((uint8_t) (v >> (8 * i)));
+}
+
+static void put16(std::vector<uint8_t> *b, uint16_t v)
+{
+	b->push_back((uint8_t) v);
+	b->push_back((uint8_t) (v >> 8));
+}
+
+static void putcc(std::vector<uint8_t> *b, const char *cc)
+{
+	b->insert(b->end(), cc, cc + 4);
+}
+
+static void set32(std::vector<uint8_t> *b, size_t at, uint32_t v)
+{
+	for(int i=0; i<4; i++) (*b)[at + i]= (uint8_t) (v >> (8 * i));
+}
+
+// Plain AVI 1.0 with an idx1 index, which every player takes: up to 2 GB (sizes are 32 bits). A range
+// that goes over is cut short
+#define AVI_MAX_BYTES	((uint64_t) 0x7F000000)
+
+long archive_export_avi(ArchiveReader *archive, long from, long to, int fps, int step, const char *path)
+{
+	if(from < 0) from= 0;
+	if(to > archive->Count()) to= archive->Count();
+	if(fps < 1) fps= 1;
+	if(step < 1) step= 1;
+	if(from >= to)
+	{
+		fprintf(stdout, "\nERROR: no images in the range");
+		return -1;
+	}
+	FILE *fp= fopen(path, "wb");
+	if(!fp)
+	{
+		perror(path);
+		return -1;
+	}
+	// headers, sizes and frame counts set at the end
+	std::vector<uint8_t> h;
+	putcc(&h, "RIFF"); put32(&h, 0); putcc(&h, "AVI ");
+	putcc(&h, "LIST"); size_t hdrl= h.size(); put32(&h, 0); putcc(&h, "hdrl");
+	putcc(&h, "avih"); put32(&h, 56);
+	put32(&h, 1000000 / fps);			// microseconds per frame
+	put32(&h, 0);						// max bytes per second
+	put32(&h, 0);						// padding granularity
+	put32(&h, 0x10);					// AVIF_HASINDEX
+	size_t avih_frames= h.size(); put32(&h, 0);
+	put32(&h, 0);						// initial frames
+	put32(&h, 1);						// streams
+	size_t avih_buffer= h.size(); put32(&h, 0);
+	put32(&h, archive->width); put32(&h, archive->height);
+	put32(&h, 0); put32(&h, 0); put32(&h, 0); put32(&h, 0);
+	putcc(&h, "LIST"); size_t strl= h.size(); put32(&h, 0); putcc(&h, "strl");
+	putcc(&h, "strh"); put32(&h, 56);
+	putcc(&h, "vids"); putcc(&h, "MJPG");
+	put32(&h, 0);						// flags
+	put16(&h, 0); put16(&h, 0);			// priority, language
+	put32(&h, 0);						// initial frames
+	put32(&h, 1); put32(&h, fps);		// scale, rate
+	put32(&h, 0);						// start
+	size_t strh_length= h.size(); put32(&h, 0);
+	size_t strh_buffer= h.size(); put32(&h, 0);
+	put32(&h, 0xFFFFFFFF);				// quality
+	put32(&h, 0);						// sample size
+	put16(&h, 0); put16(&h, 0); put16(&h, archive->width); put16(&h, archive->height);
+	putcc(&h, "strf"); put32(&h, 40);	// BITMAPINFOHEADER
+	put32(&h, 40); put32(&h, archive->width); put32(&h, archive->height);
+	put16(&h, 1); put16(&h, 24);
+	putcc(&h, "MJPG");
+	put32(&h, archive->width * archive->height * 3);
+	put32(&h, 0); put32(&h, 0); put32(&h, 0); put32(&h, 0);
+	set32(&h, strl, (uint32_t) (h.size() - strl - 4));
+	set32(&h, hdrl, (uint32_t) (h.size() - hdrl - 4));
+	putcc(&h, "LIST"); size_t movi= h.size(); put32(&h, 0); putcc(&h, "movi");
+	fwrite(&h[0], 1, h.size(), fp);
+
+	std::vector<uint8_t> idx;
+	putcc(&idx, "idx1"); put32(&idx, 0);
+	uint64_t movi_size= 4;
+	uint32_t max_size= 0;
+	long frames= 0;
+	ArchiveFrame f;
+	for(long n= from; n < to; n+= step)
+	{
+		if(archive->Get(n, &f) != 0) break;
+		uint64_t chunk= 8 + f.size + (f.size & 1);
+		if(h.size() + movi_size + chunk + idx.size() + 16 > AVI_MAX_BYTES)
+		{
+			fprintf(stdout, "\nAVI file is limited to 2 GB: %ld images written", frames);
+			break;
+		}
+		uint8_t ch[8]= {'0', '0', 'd', 'c'};
+		for(int i=0; i<4; i++) ch[4 + i]= (uint8_t) (f.size >> (8 * i));
+		fwrite(ch, 1, sizeof(ch), fp);
+		fwrite(f.data, 1, f.size, fp);
+		if(f.size & 1) fputc(0, fp);
+		// offsets from the 'movi' fourcc
+		putcc(&idx, "00dc"); put32(&idx, 0x10); put32(&idx, (uint32_t) movi_size); put32(&idx, (uint32_t) f.size);
+		movi_size+= chunk;
+		if(f.size > max_size) max_size= (uint32_t) f.size;
+		frames++;
+	}
+	set32(&idx, 4, (uint32_t) (idx.size() - 8));
+	fwrite(&idx[0], 1, idx.size(), fp);
+	set32(&h, 4, (uint32_t) (h.size() - 12 + movi_size + idx.size()));
+	set32(&h, movi, (uint32_t) movi_size);
+	set32(&h, avih_frames, (uint32_t) frames);
+	set32(&h, avih_buffer, max_size + 8);
+	set32(&h, strh_length, (uint32_t) frames);
+	set32(&h, strh_buffer, max_size + 8);
+	rewind(fp);
+	fwrite(&h[0], 1, h.size(), fp);
+	if(fclose(fp) != 0)
+	{
+		perror(path);
+		return -1;
+	}
+	return frames;
+}
+
+/* END OF FILE */
@@ -0,0 +1,127 @@
+#ifndef ARCHIVE_HEADER_FILLE_H
+#define ARCHIVE_HEADER_FILLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Archive of every image of a long time-lapse (option archive=DIR)
+// Images are appended to segment files instead of being files of their own: a directory of a few
+// large files for the filesystem and the backups, whatever the number of images
+//	YYYYMMDD-HHMMSS-mmm.mjpg	JPEG images one after another (also a tlcam replay file)
+//	YYYYMMDD-HHMMSS-mmm.idx		ArchiveIndexHeader, then one ArchiveRecord per image
+// Names are the UTC capture time of the first image, so name order is time order. A record is
+// appended after its image: a segment cut short (power loss) has records for whole images only
+// A new segment is started when the current one would go over segment_bytes or is older than
+// segment_seconds. Whole segments, oldest first, are removed to keep the archive under retain_bytes
+// and images younger than retain_seconds (0: no limit)
+#define ARCHIVE_MAGIC		0x58444941	// "AIDX"
+#define ARCHIVE_VERSION		1
+#define ARCHIVE_SEGMENT_MB	256
+#define ARCHIVE_ROTATE_H	24
+
+struct ArchiveIndexHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+};
+
+struct ArchiveRecord
+{
+	int64_t wallclock_us;	// capture time, CLOCK_REALTIME
+	int64_t timestamp_us;	// capture time, CLOCK_MONOTONIC
+	uint64_t offset;		// of the JPEG image in the .mjpg file
+	uint32_t size;
+	uint32_t sequence;		// capture sequence number of the source
+};
+
+// Writer side (tlcam). One writing thread
+class ArchiveWriter
+{
+	public:
+		ArchiveWriter(const char *dir, int width, int height);
+		~ArchiveWriter(void);
+		int Open(void);
+		int Append(const void *jpeg, size_t size, unsigned long sequence, int64_t timestamp_us, int64_t wallclock_us);
+		void Close(void);
+		void PrintStats(FILE *);
+		// limits, set before Open
+		uint64_t segment_bytes;
+		long segment_seconds;
+		uint64_t retain_bytes;
+		long retain_seconds;
+		unsigned long frames;
+		unsigned long segments;		// started
+		unsigned long removed;		// segments removed (retention)
+		unsigned long errors;
+	private:
+		int Rotate(int64_t wallclock_us);
+		void Retain(void);
+		std::string dir;
+		std::string name;			// current segment, no extension
+		int width;
+		int height;
+		int data_fd;
+		int index_fd;
+		uint64_t data_size;
+		int64_t segment_start_us;
+};
+
+// Image of the archive. data points into the mapping of its segment, good until the reader maps
+// another segment (next Get of an image in another segment) or is closed
+struct ArchiveFrame
+{
+	const uint8_t *data;
+	size_t size;
+	int64_t wallclock_us;
+	int64_t timestamp_us;
+	unsigned long sequence;
+};
+
+// Reader side: the segments of the directory when Open is called
+// Images are numbered 0 ... Count()-1 in time order. Seek finds an image by time with two binary
+// searches (segment, then record). Indexes are mapped for all the segments, image data for one
+// segment at a time
+class ArchiveReader
+{
+	public:
+		ArchiveReader(void);
+		~ArchiveReader(void);
+		int Open(const char *dir);
+		long Count(void);
+		long Seek(int64_t wallclock_us);
+		int Get(long n, ArchiveFrame *);
+		void PrintInfo(FILE *);
+		int width;
+		int height;
+	private:
+		struct Segment
+		{
+			std::string name;
+			const ArchiveRecord *records;
+			void *index_map;
+			size_t index_size;
+			long count;				// records of whole images
+			long first;				// number of its first image in the archive
+			int data_fd;
+			uint64_t data_size;
+		};
+		int Map(size_t);
+		void Close(void);
+		std::vector<Segment> segments;
+		long total;
+		int mapped;					// segment with its data mapped (-1: none)
+		const uint8_t *data_map;
+		size_t data_map_size;
+};
+
+// Images from..to-1 of the archive into an AVI file (MJPEG, the JPEG images as they are) played at
+// 'fps', one image every 'step'. Returns the number of images written, -1 on failure
+long archive_export_avi(ArchiveReader *, long from, long to, int fps, int step, const char *path);
+
+#endif
+/* END OF FILE */
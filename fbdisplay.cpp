@@ -0,0 +1,193 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * Framebuffer display
+ *
+ * Images are drawn on a display thread into the hidden half of a double height virtual framebuffer
+ * and shown by panning to it, so the screen never shows a half drawn image (tearing) and the
+ * capture loop only pays for copying the image
+ **************************************************************************************************
+*/
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "fbdisplay.h"
+
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC	_IOW('F', 0x20, __u32)
+#endif
+
+FBDisplay::FBDisplay(void)
+{
+	memset(&vinfo, 0, sizeof(vinfo));
+	memset(&finfo, 0, sizeof(finfo));
+	nbuffers= 0;
+	vsync= false;
+	posted= 0;
+	shown= 0;
+	dropped= 0;
+	fd= -1;
+	fbp= 0;
+	fb_size= 0;
+	back= 0;
+	for(int i=0; i<3; i++) images[i].size= 0;
+	filling= &images[0];
+	pending= &images[1];
+	drawing= &images[2];
+	ready= false;
+	render= 0;
+	render_ctx= 0;
+	quit= false;
+	running= false;
+}
+
+FBDisplay::~FBDisplay(void)
+{
+	Stop();
+	if(fbp) munmap(fbp, fb_size);
+	if(fd != -1)
+	{
+		// back to the resolution and the panning found at start
+		if(nbuffers == 2) ioctl(fd, FBIOPUT_VSCREENINFO, &vinfo_orig);
+		close(fd);
+	}
+}
+
+// Framebuffer device set for double buffering when the driver can, mapped and cleared (black)
+int FBDisplay::Open(const char *device)
+{
+	fd= open(device, O_RDWR);
+	if(fd == -1)
+	{
+		perror("ERROR: cannot open framebuffer device");
+		return -1;
+	}
+	if(ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) == -1)
+	{
+		perror("ERROR reading variable information");
+		return -1;
+	}
+	vinfo_orig= vinfo;
+	// virtual framebuffer two screens high
+	struct fb_var_screeninfo v= vinfo;
+	v.xres_virtual= vinfo.xres;
+	v.yres_virtual= vinfo.yres * 2;
+	v.xoffset= 0;
+	v.yoffset= 0;
+	if(ioctl(fd, FBIOPUT_VSCREENINFO, &v) == 0) ioctl(fd, FBIOGET_VSCREENINFO, &vinfo);
+	if(ioctl(fd, FBIOGET_FSCREENINFO, &finfo) == -1)
+	{
+		perror("ERROR reading fixed information");
+		return -1;
+	}
+	nbuffers= vinfo.yres_virtual >= vinfo.yres * 2 && finfo.ypanstep > 0 ? 2 : 1;
+	fb_size= (size_t) finfo.line_length * vinfo.yres * nbuffers;
+	fbp= (char *) mmap(0, fb_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(fbp == MAP_FAILED)
+	{
+		fbp= 0;
+		perror("ERROR: failed to map framebuffer device to memory");
+		return -1;
+	}
+	// black bars around images smaller than the screen
+	memset(fbp, 0, fb_size);
+	if(nbuffers == 2)
+	{
+		vinfo.xoffset= 0;
+		vinfo.yoffset= 0;
+		if(ioctl(fd, FBIOPAN_DISPLAY, &vinfo) == -1) nbuffers= 1;
+	}
+	__u32 crtc= 0;
+	vsync= ioctl(fd, FBIO_WAITFORVSYNC, &crtc) == 0;
+	back= nbuffers == 2 ? 1 : 0;
+	return 0;
+}
+
+int FBDisplay::Start(RenderFunc func, void *ctx)
+{
+	if(running || !fbp) return -1;
+	render= func;
+	render_ctx= ctx;
+	quit= false;
+	running= true;
+	thread= std::thread(display_main, this);
+	return 0;
+}
+
+// The image is copied: the caller keeps its buffer. One posting thread (the capture loop)
+void FBDisplay::Post(const void *image, size_t size, uint32_t pixelformat, int width, int height)
+{
+	if(!running) return;
+	posted++;
+	// 'filling' belongs to the posting thread
+	if(filling->data.size() < size) filling->data.resize(size);
+	memcpy(&filling->data[0], image, size);
+	filling->size= size;
+	filling->pixelformat= pixelformat;
+	filling->width= width;
+	filling->height= height;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::swap(filling, pending);
+		if(ready) dropped++;
+		ready= true;
+	}
+	cv.notify_one();
+}
+
+void FBDisplay::Stop(void)
+{
+	if(!running) return;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		quit= true;
+	}
+	cv.notify_one();
+	thread.join();
+	running= false;
+}
+
+// Hidden buffer on screen, from the next vertical sync
+void FBDisplay::Flip(void)
+{
+	if(nbuffers == 2)
+	{
+		vinfo.yoffset= back * vinfo.yres;
+		ioctl(fd, FBIOPAN_DISPLAY, &vinfo);
+		back^= 1;
+	}
+	// the buffer just hidden is not drawn again until the screen has stopped reading it
+	__u32 crtc= 0;
+	if(vsync) ioctl(fd, FBIO_WAITFORVSYNC, &crtc);
+}
+
+void FBDisplay::display_main(FBDisplay *d)
+{
+	for(;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(d->mtx);
+			d->cv.wait(lock, [d] { return d->ready || d->quit; });
+			if(d->quit) break;
+			std::swap(d->pending, d->drawing);
+			d->ready= false;
+		}
+		FBSurface fb;
+		fb.ptr= d->fbp + (size_t) d->back * d->vinfo.yres * d->finfo.line_length;
+		fb.vinfo= &d->vinfo;
+		fb.stride= d->finfo.line_length;
+		d->render(d->drawing, &fb, d->render_ctx);
+		d->Flip();
+		d->shown++;
+	}
+}
+
+void FBDisplay::PrintStats(FILE *fp)
+{
+	fprintf(fp, "\nDisplay: %s%s, %lu images, %lu shown, %lu dropped (display busy)", nbuffers == 2 ? "double buffered" : "single buffer",
+		vsync ? ", vsync" : "", posted.load(), shown.load(), dropped.load());
+}
+
+/* END OF FILE */
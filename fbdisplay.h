@@ -0,0 +1,82 @@
+#ifndef FBDISPLAY_HEADER_FILLE_H
+#define FBDISPLAY_HEADER_FILLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/fb.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+// Framebuffer memory an image is drawn into (the hidden buffer when double buffered)
+struct FBSurface
+{
+	char *ptr;							// top-left pixel
+	struct fb_var_screeninfo *vinfo;	// visible resolution and pixel format
+	size_t stride;						// bytes from one row to the next (line_length)
+};
+
+// Image handed to the display: a copy of the captured YUYV frame or JPEG image
+struct DisplayImage
+{
+	std::vector<uint8_t> data;
+	size_t size;
+	uint32_t pixelformat;	// V4L2_PIX_FMT_
+	int width;
+	int height;
+};
+
+// Draws 'image' into 'fb'. Called on the display thread
+typedef void (*RenderFunc)(DisplayImage *image, FBSurface *fb, void *ctx);
+
+// Framebuffer output on a thread of its own
+// The virtual framebuffer is set to twice the screen height: images are drawn into the hidden half,
+// which is then shown with FBIOPAN_DISPLAY and a wait for the vertical sync (when the driver has it)
+// Drivers that cannot pan get one buffer, drawn while it is shown
+// Post copies the image and returns: the display shows the latest image posted and images posted
+// while it is drawing are replaced by newer ones (dropped), so capture never waits for the display
+class FBDisplay
+{
+	public:
+		FBDisplay(void);
+		~FBDisplay(void);
+		int Open(const char *device);
+		int Start(RenderFunc, void *ctx);
+		void Post(const void *image, size_t size, uint32_t pixelformat, int width, int height);
+		void Stop(void);
+		void PrintStats(FILE *);
+		struct fb_var_screeninfo vinfo;
+		struct fb_fix_screeninfo finfo;
+		int nbuffers;			// 2: double buffered (pan), 1: drawn on screen
+		bool vsync;				// FBIO_WAITFORVSYNC works
+		std::atomic<unsigned long> posted;
+		std::atomic<unsigned long> shown;
+		std::atomic<unsigned long> dropped;	// replaced by a newer image before being drawn
+	private:
+		static void display_main(FBDisplay *);
+		void Flip(void);
+		int fd;
+		char *fbp;
+		size_t fb_size;
+		struct fb_var_screeninfo vinfo_orig;	// restored on exit
+		int back;				// buffer being drawn
+		// latest image: filled by Post, swapped with 'pending' and then with 'drawing'
+		DisplayImage images[3];
+		DisplayImage *filling;
+		DisplayImage *pending;
+		DisplayImage *drawing;
+		bool ready;				// 'pending' holds an image not drawn yet
+		RenderFunc render;
+		void *render_ctx;
+		std::thread thread;
+		std::mutex mtx;
+		std::condition_variable cv;
+		bool quit;
+		bool running;
+};
+
+#endif
+/* END OF FILE */
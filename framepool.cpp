@@ -0,0 +1,124 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * Frame buffer pool
+ *
+ * JPEG images and decoded images live in slabs allocated once for the working mode instead of being
+ * malloc'ed frame after frame. Buffers are reference counted so that several stages can hold the
+ * same image at the same time
+ **************************************************************************************************
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "framepool.h"
+
+FramePool::FramePool(const char *n, size_t sz, int count)
+{
+	name= n;
+	slab_size= sz;
+	nslabs= count < 1 ? 1 : count;
+	in_use= 0;
+	high_water= 0;
+	fallbacks= 0;
+	memory= (unsigned char *) malloc(slab_size * nslabs);
+	if(!memory)
+	{
+		fprintf(stdout, "\nWARNING: %s pool, cannot allocate %d x %lu bytes", name, nslabs, (unsigned long) slab_size);
+		nslabs= 0;
+	}
+	buffers= new PoolBuffer[nslabs > 0 ? nslabs : 1];
+	// last slab first so that slab 0 is handed out first
+	for(int i= nslabs - 1; i >= 0; i--)
+	{
+		PoolBuffer *b= &buffers[i];
+		b->refs= 0;
+		b->pool= this;
+		b->slab= i;
+		b->ptr= memory + slab_size * i;
+		b->size= slab_size;
+		b->used= 0;
+		b->heap= 0;
+		free_slabs.push_back(i);
+	}
+}
+
+FramePool::~FramePool(void)
+{
+	if(in_use > 0) fprintf(stdout, "\nWARNING: %s pool destroyed with %d buffers in use", name, in_use.load());
+	delete [] buffers;
+	if(memory) free(memory);
+}
+
+// Buffer of at least 'size' bytes with one reference
+PoolBuffer *FramePool::Get(size_t size)
+{
+	PoolBuffer *b= 0;
+	if(size <= slab_size)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if(!free_slabs.empty())
+		{
+			b= &buffers[free_slabs.back()];
+			free_slabs.pop_back();
+		}
+	}
+	if(!b)
+	{
+		// exhausted or too small: heap
+		unsigned char *heap= (unsigned char *) malloc(size);
+		if(!heap) return 0;
+		b= new PoolBuffer;
+		b->pool= this;
+		b->slab= -1;
+		b->ptr= heap;
+		b->size= size;
+		b->heap= heap;
+		fallbacks++;
+	}
+	b->refs= 1;
+	b->used= 0;
+	int n= ++in_use;
+	int hw= high_water.load();
+	while(n > hw && !high_water.compare_exchange_weak(hw, n));
+	return b;
+}
+
+void FramePool::Acquire(PoolBuffer *b)
+{
+	b->refs++;
+}
+
+void FramePool::Release(PoolBuffer *b)
+{
+	if(--b->refs > 0) return;
+	in_use--;
+	if(b->heap) free(b->heap);
+	b->heap= 0;
+	if(b->slab < 0)
+	{
+		delete b;
+		return;
+	}
+	b->ptr= memory + slab_size * b->slab;
+	b->size= slab_size;
+	std::lock_guard<std::mutex> lock(mtx);
+	free_slabs.push_back(b->slab);
+}
+
+// The image outgrew the buffer and was moved to 'heap' (malloc), which the buffer now owns.
+// The slab stays with the buffer until it is released
+void FramePool::Replace(PoolBuffer *b, unsigned char *heap, size_t size)
+{
+	if(b->heap) free(b->heap);
+	b->heap= heap;
+	b->ptr= heap;
+	b->size= size;
+	fallbacks++;
+}
+
+void FramePool::PrintStats(FILE *fp)
+{
+	fprintf(fp, "\n\t%-8s pool %d x %lu KB, %d max in use, %lu from heap", name, nslabs, (unsigned long) (slab_size / 1024), high_water.load(), fallbacks.load());
+}
+
+/* END OF FILE */
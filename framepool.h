@@ -0,0 +1,52 @@
+#ifndef FRAMEPOOL_HEADER_FILLE_H
+#define FRAMEPOOL_HEADER_FILLE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+class FramePool;
+
+// Image buffer handed out by a FramePool. Reference counted: every holder (encoder, display, disk,
+// upload) calls FramePool::Acquire / Release and the buffer goes back to the pool with the last Release
+struct PoolBuffer
+{
+	std::atomic<int> refs;
+	FramePool *pool;
+	int slab;				// slab index, -1 for a buffer from the heap (pool exhausted)
+	unsigned char *ptr;
+	size_t size;			// bytes available at ptr
+	size_t used;			// image bytes
+	unsigned char *heap;	// heap memory in use instead of the slab (malloc), 0 if none
+};
+
+// Pool of fixed size image buffers (slabs) allocated once, at start-up, from the working mode
+// Get never fails: when every slab is in use, or a larger buffer is needed, the buffer comes from
+// the heap and is counted in 'fallbacks'
+class FramePool
+{
+	public:
+		FramePool(const char *name, size_t slab_size, int nslabs);
+		~FramePool(void);
+		PoolBuffer *Get(size_t size);
+		void Acquire(PoolBuffer *);
+		void Release(PoolBuffer *);
+		void Replace(PoolBuffer *, unsigned char *heap, size_t size);
+		void PrintStats(FILE *);
+		const char *name;
+		size_t slab_size;
+		int nslabs;
+		std::atomic<int> in_use;
+		std::atomic<int> high_water;
+		std::atomic<unsigned long> fallbacks;
+	private:
+		unsigned char *memory;
+		PoolBuffer *buffers;
+		std::vector<int> free_slabs;
+		std::mutex mtx;
+};
+
+#endif
+/* END OF FILE */
@@ -0,0 +1,71 @@
+#ifndef FRAMESOURCE_HEADER_FILLE_H
+#define FRAMESOURCE_HEADER_FILLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct
+{
+	int width;
+	int height;
+} CaptureResolution;
+
+// Frame handle borrowed from FrameSource::CaptureImage
+// The image is at ptr and is valid until the frame is released (FrameSource::ReleaseFrame)
+// Capture time and sequence number come from the driver (v4l2_buffer) and go with the frame to the
+// outputs, so the age of an image when it is stored can be measured and a time-lapse played back 
+// with its real timing
+struct Frame
+{
+	int index;
+	void *ptr;
+	size_t length;
+	unsigned long sequence;	// frame counter of the source
+	int64_t timestamp_us;	// capture time, CLOCK_MONOTONIC
+	int64_t wallclock_us;	// capture time, CLOCK_REALTIME
+	unsigned int dropped;	// frames lost by the source since the previous frame (sequence gap)
+};
+
+// Longest wait of CaptureImage for a frame by default
+#define FRAME_WAIT_MS	2000
+
+// Current time of 'clock' in microseconds
+inline int64_t clock_us(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Source of captured images
+// Implemented by the V4L camera (V4L_device) and by the file player (ReplaySource) so that
+// the capture loop can run with no video device
+class FrameSource
+{
+	public:
+		virtual ~FrameSource(void) {}
+		virtual int SetWorkingMode(CaptureResolution , char* ) = 0;
+		virtual void* AllocateBuffer(int nbuffers) = 0;
+		// 0 with a frame, 1 when no frame came within timeout_ms (0: no wait), -1 on error
+		virtual int CaptureImage(Frame *, int timeout_ms= FRAME_WAIT_MS) = 0;
+		virtual void AcquireFrame(Frame *) = 0;
+		virtual void ReleaseFrame(Frame *) = 0;
+		// Event loop support: descriptor that gets readable when a frame is ready (-1 if none) and 
+		// the call to collect the frame without blocking so that next CaptureImage does not wait
+		virtual int PollFd(void) { return -1; }
+		virtual int FrameReady(void) { return 0; }
+		int dev; // file descriptor. -1 when the source failed to open
+		// Working mode
+		struct
+		{
+			int width;
+			int height;
+			int field;
+			int pixel_size;
+			unsigned int pixelformat;
+		} wkm;
+};
+
+#endif
+/* END OF FILE */
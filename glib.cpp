@@ -38,6 +38,18 @@ int termios_init()
 	term_ctrl = fcntl(STDIN_FILENO, F_GETFL, 0);
 	return 0;
 }
+// Keyboard in raw mode for the whole run: echo off, canonical mode off, non-blocking
+// so that stdin can be watched by the event loop instead of calling kbhit every frame
+int termios_raw()
+{
+	struct termios newtio= term_flags;
+	newtio.c_lflag &= ~(ECHO | ICANON );  
+	newtio.c_cc[VMIN]= 0;
+	newtio.c_cc[VTIME]= 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &newtio);
+	fcntl(STDIN_FILENO, F_SETFL, term_ctrl | O_NONBLOCK);
+	return 0;
+}
 int termios_restore()
 {
 	tcsetattr(STDIN_FILENO, TCSANOW, &term_flags);
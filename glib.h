@@ -5,6 +5,7 @@
 bool isNumber(char *);
 double CPUtemperature(void);
 int termios_init();
+int termios_raw();
 int termios_restore();
 int kbhit(void);
 
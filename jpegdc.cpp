@@ -0,0 +1,430 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * JPEG brightness map from the DC coefficients
+ *
+ * A full decode of a frame (Huffman, dequantization, IDCT, upsampling, color conversion) costs far
+ * too much to look at every MJPEG frame on a Pi Zero. Here the Huffman data is parsed and all but 
+ * the luma DC coefficients are dropped, which gives an 80x60 map of a VGA frame
+ * Every Huffman code still has to be read: the time goes into skipping AC coefficients, so every AC
+ * code (up to 16 bits) and its value bits are skipped with one or two table lookups
+ **************************************************************************************************
+*/
+#include <string.h>
+
+#include "jpegdc.h"
+
+// Huffman tables of the JPEG standard (K.3), used by cameras whose MJPEG frames have no DHT segment
+static const uint8_t std_dc_luminance_bits[16]= {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t std_dc_luminance_vals[12]= {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b
+};
+static const uint8_t std_dc_chrominance_bits[16]= {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t std_dc_chrominance_vals[12]= {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b
+};
+static const uint8_t std_ac_luminance_bits[16]= {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 125};
+static const uint8_t std_ac_luminance_vals[162]= {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+static const uint8_t std_ac_chrominance_bits[16]= {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 119};
+static const uint8_t std_ac_chrominance_vals[162]= {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+#define LUT_BITS	9
+#define SKIP_BITS	12
+
+// Bit reader of the entropy coded data. Stuffed bytes (FF 00) are taken out. At a marker it stops
+// and feeds zeros
+struct BitReader
+{
+	const uint8_t *p;
+	const uint8_t *end;
+	uint64_t buf;	// bits from the most significant one
+	int nbits;
+	bool marker;
+
+	void Start(const uint8_t *data, const uint8_t *e)
+	{
+		p= data;
+		end= e;
+		buf= 0;
+		nbits= 0;
+		marker= false;
+	}
+	void Fill(void)
+	{
+		// 8 bytes with no FF at once (little endian host)
+		if(!marker && p + 8 <= end)
+		{
+			uint64_t w;
+			memcpy(&w, p, 8);
+			uint64_t x= ~w;
+			if(((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) == 0)
+			{
+				int nbytes= (64 - nbits) >> 3;
+				int rest= (64 - nbits) & 7;
+				buf|= (__builtin_bswap64(w) >> nbits) & ~((1ULL << rest) - 1);
+				p+= nbytes;
+				nbits+= nbytes * 8;
+				return;
+			}
+		}
+		while(nbits <= 56)
+		{
+			unsigned int c= 0;
+			if(!marker && p < end)
+			{
+				c= *p;
+				if(c == 0xFF)
+				{
+					unsigned int next= p + 1 < end ? p[1] : 0xD9;
+					if(next == 0x00) p+= 2;
+					else if(next == 0xFF) { p++; continue; } // fill byte
+					else { marker= true; c= 0; }
+				}
+				else p++;
+			}
+			buf|= (uint64_t) c << (56 - nbits);
+			nbits+= 8;
+		}
+	}
+	unsigned int Peek(int n) { return (unsigned int) (buf >> (64 - n)); }
+	void Skip(int n) { buf<<= n; nbits-= n; }
+	// restart marker: bits left in the interval are dropped
+	bool Restart(void)
+	{
+		buf= 0;
+		nbits= 0;
+		marker= false;
+		while(p + 1 < end && p[0] == 0xFF && p[1] == 0xFF) p++;
+		if(p + 1 >= end || p[0] != 0xFF || p[1] < 0xD0 || p[1] > 0xD7) return false;
+		p+= 2;
+		return true;
+	}
+};
+
+
+// Symbol of the next Huffman code, -1 if there is none (corrupt data)
+static inline int decode_symbol(BitReader *br, const JPEGHuffmanTable *h)
+{
+	if(br->nbits < 32) br->Fill();
+	unsigned int e= h->lut[br->Peek(LUT_BITS)];
+	if(e)
+	{
+		br->Skip(e >> 8);
+		return e & 0xFF;
+	}
+	for(int l=LUT_BITS+1; l<=16; l++)
+	{
+		int code= (int) br->Peek(l);
+		if(code <= h->maxcode[l])
+		{
+			br->Skip(l);
+			return h->vals[code + h->valoffset[l]];
+		}
+	}
+	return -1;
+}
+
+// Signed value of the next 's' bits (F.2.2.1)
+static inline int receive_extend(BitReader *br, int s)
+{
+	if(s == 0) return 0;
+	if(br->nbits < s) br->Fill();
+	int v= (int) br->Peek(s);
+	br->Skip(s);
+	return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
+
+JPEGDCMap::JPEGDCMap(void)
+{
+	width= 0;
+	height= 0;
+	ncomp= 0;
+	image_width= 0;
+	image_height= 0;
+	restart_interval= 0;
+	memset(qdc, 0, sizeof(qdc));
+	for(int i=0; i<4; i++)
+	{
+		dc[i].defined= dc[i].built= false;
+		ac[i].defined= ac[i].built= false;
+	}
+}
+
+JPEGDCMap::~JPEGDCMap(void)
+{
+}
+
+// Canonical Huffman codes of BITS and HUFFVAL (C.2)
+void JPEGDCMap::BuildHuffman(JPEGHuffmanTable *h, const uint8_t *bits, const uint8_t *vals)
+{
+	int n= 0;
+	for(int l=0; l<16; l++) n+= bits[l];
+	if(n > 256) n= 256;
+	h->defined= true;
+	// same table as the previous frame
+	if(h->built && memcmp(h->bits, bits, 16) == 0 && memcmp(h->vals, vals, n) == 0) return;
+	memcpy(h->bits, bits, 16);
+	memcpy(h->vals, vals, n);
+	memset(h->lut, 0, sizeof(h->lut));
+	memset(h->skip, 0, sizeof(h->skip));
+	h->nsub= 0;
+	int code= 0, k= 0;
+	for(int l=1; l<=16; l++)
+	{
+		h->valoffset[l]= k - code;
+		for(int i=0; i<bits[l-1] && k<n; i++, k++, code++)
+		{
+			if(l <= LUT_BITS)
+			{
+				int fill= 1 << (LUT_BITS - l);
+				for(int j=0; j<fill; j++) h->lut[(code << (LUT_BITS - l)) | j]= (uint16_t) ((l << 8) | vals[k]);
+			}
+			// as an AC symbol: run / size. The value bits are skipped with the code, they need not
+			// be in the lookup
+			int r= vals[k] >> 4, s= vals[k] & 15;
+			uint16_t e= (uint16_t) (((l + s) << 8) | (s ? r + 1 : r == 15 ? 16 : 0));
+			if(l <= SKIP_BITS)
+			{
+				int fill= 1 << (SKIP_BITS - l);
+				for(int j=0; j<fill; j++) h->skip[(code << (SKIP_BITS - l)) | j]= e;
+			}
+			else
+			{
+				// longer code: in the subtable of its first 12 bits
+				uint16_t *prefix= &h->skip[code >> (l - SKIP_BITS)];
+				if(*prefix == 0 && h->nsub < 256)
+				{
+					memset(h->skip2[h->nsub], 0, sizeof(h->skip2[0]));
+					*prefix= (uint16_t) (0x8000 | h->nsub++);
+				}
+				if(*prefix & 0x8000)
+				{
+					int low= code & ((1 << (l - SKIP_BITS)) - 1);
+					int fill= 1 << (16 - l);
+					for(int j=0; j<fill; j++) h->skip2[*prefix & 0xFF][(low << (16 - l)) | j]= e;
+				}
+			}
+		}
+		h->maxcode[l]= bits[l-1] ? code - 1 : -1;
+		code<<= 1;
+	}
+	h->maxcode[17]= 0x7FFFFFFF;
+	h->built= true;
+}
+
+// Map of the image at 'jpeg'. 0 on success
+int JPEGDCMap::Decode(const uint8_t *jpeg, size_t length)
+{
+	const uint8_t *p= jpeg;
+	const uint8_t *end= jpeg + length;
+	if(length < 4 || p[0] != 0xFF || p[1] != 0xD8) return -1;
+	p+= 2;
+	ncomp= 0;
+	restart_interval= 0;
+	for(int i=0; i<4; i++)
+	{
+		dc[i].defined= false;
+		ac[i].defined= false;
+	}
+	while(p + 4 <= end)
+	{
+		if(p[0] != 0xFF) return -1;
+		uint8_t marker= p[1];
+		if(marker == 0xFF) { p++; continue; }
+		int len= (p[2] << 8) | p[3];
+		const uint8_t *seg= p + 4;
+		const uint8_t *next= p + 2 + len;
+		if(len < 2 || next > end) return -1;
+		switch(marker)
+		{
+			case 0xC0: // SOF0, SOF1: baseline / extended sequential, Huffman
+			case 0xC1:
+				if(len < 8 || seg[0] != 8) return -1;
+				image_height= (seg[1] << 8) | seg[2];
+				image_width= (seg[3] << 8) | seg[4];
+				ncomp= seg[5];
+				if(ncomp != 1 && ncomp != 3) return -1;
+				if(len < 8 + 3 * ncomp) return -1;
+				for(int c=0; c<ncomp; c++)
+				{
+					comp[c].id= seg[6 + 3*c];
+					comp[c].h= seg[7 + 3*c] >> 4;
+					comp[c].v= seg[7 + 3*c] & 15;
+					comp[c].tq= seg[8 + 3*c] & 3;
+					if(comp[c].h < 1 || comp[c].h > 4 || comp[c].v < 1 || comp[c].v > 4) return -1;
+				}
+				break;
+			case 0xC2: case 0xC3: case 0xC5: case 0xC6: case 0xC7: // progressive, lossless, hierarchical
+			case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF: // arithmetic
+				return -1;
+			case 0xC4: // DHT
+				for(const uint8_t *t= seg; t + 17 <= next; )
+				{
+					int tc= t[0] >> 4, th= t[0] & 3;
+					int n= 0;
+					for(int l=0; l<16; l++) n+= t[1 + l];
+					if(t + 17 + n > next) return -1;
+					BuildHuffman(tc ? &ac[th] : &dc[th], t + 1, t + 17);
+					t+= 17 + n;
+				}
+				break;
+			case 0xDB: // DQT: only the DC quantizer is needed
+				for(const uint8_t *t= seg; t < next; )
+				{
+					int pq= t[0] >> 4, tq= t[0] & 3;
+					if(t + 1 + (pq ? 128 : 64) > next) return -1;
+					qdc[tq]= pq ? (t[1] << 8) | t[2] : t[1];
+					t+= 1 + (pq ? 128 : 64);
+				}
+				break;
+			case 0xDD: // DRI
+				restart_interval= (seg[0] << 8) | seg[1];
+				break;
+			case 0xDA: // SOS
+			{
+				int ns= seg[0];
+				if(ncomp == 0 || ns != ncomp || len < 6 + 2 * ns) return -1;
+				for(int i=0; i<ns; i++)
+				{
+					int c= 0;
+					while(c < ncomp && comp[c].id != seg[1 + 2*i]) c++;
+					if(c == ncomp) return -1;
+					comp[c].td= seg[2 + 2*i] >> 4 & 3;
+					comp[c].ta= seg[2 + 2*i] & 3;
+				}
+				// MJPEG with no DHT: tables of the standard
+				if(!dc[0].defined) BuildHuffman(&dc[0], std_dc_luminance_bits, std_dc_luminance_vals);
+				if(!dc[1].defined) BuildHuffman(&dc[1], std_dc_chrominance_bits, std_dc_chrominance_vals);
+				if(!ac[0].defined) BuildHuffman(&ac[0], std_ac_luminance_bits, std_ac_luminance_vals);
+				if(!ac[1].defined) BuildHuffman(&ac[1], std_ac_chrominance_bits, std_ac_chrominance_vals);
+				return DecodeScan(next, end);
+			}
+			case 0xD9: // EOI
+				return -1;
+			default:
+				break;
+		}
+		p= next;
+	}
+	return -1;
+}
+
+// Entropy coded data of the one scan
+int JPEGDCMap::DecodeScan(const uint8_t *data, const uint8_t *end)
+{
+	int hmax= 1, vmax= 1;
+	for(int c=0; c<ncomp; c++)
+	{
+		if(comp[c].h > hmax) hmax= comp[c].h;
+		if(comp[c].v > vmax) vmax= comp[c].v;
+		comp[c].pred= 0;
+		if(!dc[comp[c].td].defined || !ac[comp[c].ta].defined) return -1;
+	}
+	// one component: one block per MCU. Interleaved: h x v blocks of each component per MCU
+	if(ncomp == 1) comp[0].h= comp[0].v= hmax= vmax= 1;
+	int mcux= (image_width + 8 * hmax - 1) / (8 * hmax);
+	int mcuy= (image_height + 8 * vmax - 1) / (8 * vmax);
+	width= (image_width * comp[0].h / hmax + 7) / 8;
+	height= (image_height * comp[0].v / vmax + 7) / 8;
+	map.resize(width * height);
+	int q= qdc[comp[0].tq];
+
+	BitReader br;
+	br.Start(data, end);
+	int todo= restart_interval;
+	for(int my=0; my<mcuy; my++)
+	{
+		for(int mx=0; mx<mcux; mx++)
+		{
+			if(restart_interval)
+			{
+				if(todo == 0)
+				{
+					if(!br.Restart()) return -1;
+					for(int c=0; c<ncomp; c++) comp[c].pred= 0;
+					todo= restart_interval;
+				}
+				todo--;
+			}
+			for(int c=0; c<ncomp; c++)
+			{
+				Component *cp= &comp[c];
+				const JPEGHuffmanTable *hdc= &dc[cp->td];
+				const JPEGHuffmanTable *hac= &ac[cp->ta];
+				for(int by=0; by<cp->v; by++)
+				{
+					for(int bx=0; bx<cp->h; bx++)
+					{
+						int s= decode_symbol(&br, hdc);
+						if(s < 0 || s > 15) return -1;
+						cp->pred+= receive_extend(&br, s);
+						// AC coefficients are skipped
+						for(int k=1; k<64; k++)
+						{
+							// code and value: up to 16 + 15 bits
+							if(br.nbits < 32) br.Fill();
+							unsigned int e= hac->skip[br.Peek(SKIP_BITS)];
+							if(e & 0x8000) e= hac->skip2[e & 0xFF][br.Peek(16) & 15];
+							if(e)
+							{
+								br.Skip(e >> 8);
+								if((e & 0xFF) == 0) break;
+								k+= (e & 0xFF) - 1;
+								continue;
+							}
+							int rs= decode_symbol(&br, hac);
+							if(rs < 0) return -1;
+							int r= rs >> 4;
+							s= rs & 15;
+							if(s)
+							{
+								k+= r;
+								if(br.nbits < s) br.Fill();
+								br.Skip(s);
+							}
+							else if(r == 15) k+= 15;
+							else break;
+						}
+						if(c == 0)
+						{
+							int x= mx * cp->h + bx;
+							int y= my * cp->v + by;
+							if(x < width && y < height)
+							{
+								// block mean, as the 1x1 IDCT of libjpeg
+								int v= ((cp->pred * q + 4) >> 3) + 128;
+								map[y * width + x]= (uint8_t) (v < 0 ? 0 : v > 255 ? 255 : v);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/* END OF FILE */
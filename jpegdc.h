@@ -0,0 +1,62 @@
+#ifndef JPEGDC_HEADER_FILLE_H
+#define JPEGDC_HEADER_FILLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Brightness map of a JPEG image read in the compressed domain
+// Only the entropy coded data is decoded: the DC coefficient of every luma block gives the mean of
+// its 8x8 pixels, the AC coefficients are skipped with no dequantization and no IDCT. Baseline 
+// Huffman JPEG (cameras: MJPEG, with or without Huffman tables), grayscale or 3 components 
+// in one interleaved scan. Other images (progressive, arithmetic coding) fail with -1
+// Not thread safe: one map per thread
+// Huffman table for decoding
+// Tables are only rebuilt when the DHT segment changes: most cameras send the same tables (or none)
+// in every frame
+struct JPEGHuffmanTable
+{
+	bool defined;			// by the image being decoded
+	bool built;				// from 'bits' and 'vals'
+	uint16_t lut[1 << 9];	// first 9 bits -> (length << 8) | symbol. 0: longer code
+	uint16_t skip[1 << 12];	// AC: first 12 bits -> (length of code and value << 8) | coefficients to
+							// skip (0 for EOB), whatever the value size. Codes of 13 to 16 bits:
+							// 0x8000 | subtable of the prefix. 0: no such code
+	uint16_t skip2[256][16];	// subtables: next 4 bits -> as in skip
+	int nsub;
+	int32_t maxcode[18];	// largest code of each length, -1 if none
+	int32_t valoffset[17];	// vals index of a code of each length: code + valoffset
+	uint8_t bits[16];
+	uint8_t vals[256];
+};
+
+class JPEGDCMap
+{
+	public:
+		JPEGDCMap(void);
+		~JPEGDCMap(void);
+		int Decode(const uint8_t *jpeg, size_t length);
+		int width;					// map: 8x8 luma blocks of the image
+		int height;
+		std::vector<uint8_t> map;	// mean luma of each block, row by row
+	private:
+		struct Component
+		{
+			int id;
+			int h, v;				// sampling factors
+			int tq;					// quantization table
+			int td, ta;				// Huffman tables: DC, AC
+			int pred;				// DC prediction
+		};
+		static void BuildHuffman(JPEGHuffmanTable *, const uint8_t *bits, const uint8_t *vals);
+		int DecodeScan(const uint8_t *data, const uint8_t *end);
+		JPEGHuffmanTable dc[4], ac[4];
+		uint16_t qdc[4];			// DC quantizer of each table
+		Component comp[4];
+		int ncomp;
+		int image_width, image_height;
+		int restart_interval;
+};
+
+#endif
+/* END OF FILE */
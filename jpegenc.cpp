@@ -0,0 +1,441 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * JPEG encoder for YUYV captures
+ *
+ * compressYUYVtoJPEG encodes a frame in one libjpeg pass. StripEncoder encodes horizontal strips of
+ * the frame on several cores and joins them with restart markers into one standard JPEG image
+ **************************************************************************************************
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "jpegenc.h"
+#include "yuyv.h"
+
+// MCU: 16x8 pixels with 2x1 luma sampling (4:2:2), 16x16 with 2x2 (4:2:0, jpeg_set_defaults)
+#define MCU_WIDTH	16
+#define MCU_HEIGHT(path)	((path) == yuyv_raw422 ? 8 : 16)
+
+//  _____________________
+// |                     |
+// |     JPEGBuffer      |
+// |_____________________|
+//
+JPEGBuffer::JPEGBuffer(void)
+{
+	ptr= 0;
+	size= 0;
+	used= 0;
+	owned= true;
+}
+
+JPEGBuffer::~JPEGBuffer(void)
+{
+	if(ptr && owned) free(ptr);
+}
+
+void JPEGBuffer::Wrap(uint8_t *mem, size_t sz)
+{
+	if(ptr && owned) free(ptr);
+	ptr= mem;
+	size= sz;
+	used= 0;
+	owned= false;
+}
+
+// At least 'sz' bytes. Content is kept
+bool JPEGBuffer::Reserve(size_t sz)
+{
+	if(sz <= size) return true;
+	uint8_t *p;
+	if(owned) p= (uint8_t *) realloc(ptr, sz);
+	else if((p= (uint8_t *) malloc(sz)) && ptr) memcpy(p, ptr, size);
+	if(!p) return false;
+	ptr= p;
+	size= sz;
+	owned= true;
+	return true;
+}
+
+uint8_t *JPEGBuffer::Detach(void)
+{
+	uint8_t *p= ptr;
+	ptr= 0;
+	size= 0;
+	used= 0;
+	owned= true;
+	return p;
+}
+
+// libjpeg destination manager writing into a JPEGBuffer
+// A wrapped buffer (pool slab) is used at its own size, an empty or owned one gets JPEGBUFFER_MIN
+#define JPEGBUFFER_MIN	(64 * 1024)
+struct JPEGBufferDest
+{
+	struct jpeg_destination_mgr pub;
+	JPEGBuffer *buffer;
+};
+
+static void buffer_init_destination(j_compress_ptr cinfo)
+{
+	JPEGBufferDest *dest= (JPEGBufferDest *) cinfo->dest;
+	if((dest->buffer->owned || !dest->buffer->size) && !dest->buffer->Reserve(JPEGBUFFER_MIN)) ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	dest->pub.next_output_byte= dest->buffer->ptr;
+	dest->pub.free_in_buffer= dest->buffer->size;
+}
+
+// buffer full: double it
+static boolean buffer_empty_output_buffer(j_compress_ptr cinfo)
+{
+	JPEGBufferDest *dest= (JPEGBufferDest *) cinfo->dest;
+	size_t used= dest->buffer->size;
+	if(!dest->buffer->Reserve(2 * used)) ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	dest->pub.next_output_byte= dest->buffer->ptr + used;
+	dest->pub.free_in_buffer= dest->buffer->size - used;
+	return TRUE;
+}
+
+static void buffer_term_destination(j_compress_ptr cinfo)
+{
+	JPEGBufferDest *dest= (JPEGBufferDest *) cinfo->dest;
+	dest->buffer->used= dest->buffer->size - dest->pub.free_in_buffer;
+}
+
+//  _____________________
+// |                     |
+// |     JPEGEncoder     |
+// |_____________________|
+//
+JPEGEncoder::JPEGEncoder(void)
+{
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	dest.pub.init_destination= buffer_init_destination;
+	dest.pub.empty_output_buffer= buffer_empty_output_buffer;
+	dest.pub.term_destination= buffer_term_destination;
+	dest.buffer= 0;
+	cinfo.dest= &dest.pub;
+	raw_width= 0;
+}
+
+JPEGEncoder::~JPEGEncoder(void)
+{
+	cinfo.dest= 0;
+	jpeg_destroy_compress(&cinfo);
+}
+
+//	converts rows y0 ... y0+rows-1 of a YUYV raw buffer to a JPEG image into 'out'
+//	restart_interval: MCUs between restart markers (0 for none)
+//	quality, optimize: see compressYUYVtoJPEG
+//	returns the size of the JPEG image
+int JPEGEncoder::Compress(const char *input, const int width, const int y0, const int rows, unsigned int restart_interval, YUYVpath path, int quality, bool optimize, JPEGBuffer *out)
+{
+	Setup(width, rows, restart_interval, quality, optimize, out);
+	if(path == yuyv_raw422) Raw(input, width, y0, rows);
+	else Scanlines(input, width, y0, rows);
+	return (int) out->used;
+}
+
+void JPEGEncoder::Setup(const int width, const int rows, unsigned int restart_interval, int quality, bool optimize, JPEGBuffer *out)
+{
+	dest.buffer= out;
+	out->used= 0;
+	cinfo.image_width = width;
+	cinfo.image_height = rows;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr; //libJPEG expects YUV 3bytes, 24bit
+
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	cinfo.optimize_coding= optimize ? TRUE : FALSE;
+	cinfo.restart_interval= restart_interval;
+}
+
+//	4:2:2 JPEG of width x rows from planes filled by the caller (see Raw)
+int JPEGEncoder::Begin(const int width, const int rows, int quality, bool optimize, JPEGBuffer *out)
+{
+	Setup(width, rows, 0, quality, optimize, out);
+	RawStart(width);
+	return 0;
+}
+
+int JPEGEncoder::End(void)
+{
+	jpeg_finish_compress(&cinfo);
+	return (int) dest.buffer->used;
+}
+
+//	input is in YUYV (YUV 422). output is JPEG binary.
+//		Each four bytes is two pixels.
+//		Each four bytes is two Y's, a Cb and a Cr.
+//		Each Y goes to one of the pixels, and the Cb and Cr belong to both pixels.
+//	code based on:
+//		http://stackoverflow.com/questions/17029136/weird-image-while-trying-to-compress-yuv-image-to-jpeg-using-libjpeg
+int JPEGEncoder::Scanlines(const char *input, const int width, const int y0, const int rows)
+{
+	//-------------------------------------
+	// START COMPRESS
+	jpeg_start_compress(&cinfo, TRUE);
+	const YUYVKernels *kernels= yuyv_kernels();
+	if(rowbuf.size() < (size_t) width * 3) rowbuf.resize(width * 3);
+	JSAMPROW row_pointer[1];
+	row_pointer[0] = &rowbuf[0];
+	while (cinfo.next_scanline < cinfo.image_height)
+	{
+		size_t offset = (size_t) (y0 + cinfo.next_scanline) * cinfo.image_width * 2; //offset to the correct row
+		//input strides by 4 bytes, output strides by 6 (2 pixels)
+		kernels->to_ycbcr((const uint8_t *) &input[offset], width / 2, &rowbuf[0]);
+		jpeg_write_scanlines(&cinfo, row_pointer, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	// FINISH COMPRESS
+	//-------------------------------------
+	return 0;
+}
+
+//	4:2:2 JPEG
+//	YUYV is split into Y, Cb and Cr planes (Y0 Cb Y1 Cr -> Y0 Y1, Cb, Cr) that go to libjpeg as raw
+//	data, one MCU row (8 lines) at a time. Plane rows are padded to whole MCUs by repeating the last
+//	pixel, and the last MCU row by repeating the last line
+int JPEGEncoder::Raw(const char *input, const int width, const int y0, const int rows)
+{
+	RawStart(width);
+	const YUYVKernels *kernels= yuyv_kernels();
+	int pairs= width / 2;
+	for(int y=0; y<rows; y+= DCTSIZE)
+	{
+		int lines= rows - y < DCTSIZE ? rows - y : DCTSIZE;
+		for(int r=0; r<lines; r++)
+		{
+			const uint8_t *src= (const uint8_t *) input + (size_t) (y0 + y + r) * width * 2;
+			kernels->to_planes(src, pairs, yrows[r], cbrows[r], crrows[r]);
+		}
+		WriteRows(lines);
+	}
+	jpeg_finish_compress(&cinfo);
+	return 0;
+}
+
+//	Raw data set up: sampling and plane rows of one MCU row
+void JPEGEncoder::RawStart(const int width)
+{
+	cinfo.raw_data_in= TRUE;
+	cinfo.comp_info[0].h_samp_factor= 2;
+	cinfo.comp_info[0].v_samp_factor= 1;
+	cinfo.comp_info[1].h_samp_factor= 1;
+	cinfo.comp_info[1].v_samp_factor= 1;
+	cinfo.comp_info[2].h_samp_factor= 1;
+	cinfo.comp_info[2].v_samp_factor= 1;
+
+	raw_width= width;
+	int ywidth= (width + MCU_WIDTH - 1) & ~(MCU_WIDTH - 1);
+	int cwidth= ywidth / 2;
+	size_t planes_sz= (size_t) (ywidth + 2 * cwidth) * DCTSIZE;
+	if(rowbuf.size() < planes_sz) rowbuf.resize(planes_sz);
+	for(int r=0; r<DCTSIZE; r++)
+	{
+		yrows[r]= &rowbuf[r * ywidth];
+		cbrows[r]= &rowbuf[DCTSIZE * ywidth + r * cwidth];
+		crrows[r]= &rowbuf[DCTSIZE * (ywidth + cwidth) + r * cwidth];
+	}
+	jpeg_start_compress(&cinfo, TRUE);
+}
+
+//	First 'lines' lines of the planes, padded, to libjpeg
+void JPEGEncoder::WriteRows(int lines)
+{
+	int ywidth= (raw_width + MCU_WIDTH - 1) & ~(MCU_WIDTH - 1);
+	int cwidth= ywidth / 2;
+	int pairs= raw_width / 2;
+	for(int r=0; r<lines; r++)
+	{
+		uint8_t *py= yrows[r], *pcb= cbrows[r], *pcr= crrows[r];
+		for(int x=2*pairs; x<ywidth; x++) py[x]= py[2*pairs-1];
+		for(int x=pairs; x<cwidth; x++) { pcb[x]= pcb[pairs-1]; pcr[x]= pcr[pairs-1]; }
+	}
+	for(int r=lines; r<DCTSIZE; r++)
+	{
+		memcpy(yrows[r], yrows[lines-1], ywidth);
+		memcpy(cbrows[r], cbrows[lines-1], cwidth);
+		memcpy(crrows[r], crrows[lines-1], cwidth);
+	}
+	JSAMPARRAY data[3]= {yrows, cbrows, crrows};
+	jpeg_write_raw_data(&cinfo, data, DCTSIZE);
+}
+
+JPEGEncoder *jpeg_thread_encoder(void)
+{
+	static thread_local JPEGEncoder encoder;
+	return &encoder;
+}
+
+int compressYUYVtoJPEG(char *input, const int width, const int height, JPEGBuffer *out, YUYVpath path, int quality, bool optimize)
+{
+	return jpeg_thread_encoder()->Compress(input, width, 0, height, 0, path, quality, optimize, out);
+}
+
+// Offset of the entropy coded data (after the SOS segment).
+// sof: offset of the SOF0 segment, where the image height is
+static int JPEGscan(const uint8_t *jpeg, int sz, int *sof)
+{
+	int p= 2; // SOI
+	*sof= -1;
+	while(p + 4 <= sz)
+	{
+		if(jpeg[p] != 0xFF) return -1;
+		uint8_t marker= jpeg[p+1];
+		int len= (jpeg[p+2] << 8) | jpeg[p+3];
+		if(marker == 0xC0) *sof= p;
+		if(marker == 0xDA) return *sof < 0 ? -1 : p + 2 + len;
+		p+= 2 + len;
+	}
+	return -1;
+}
+
+//  _____________________
+// |                     |
+// |    StripEncoder     |
+// |_____________________|
+//
+StripEncoder::StripEncoder(int n, YUYVpath p)
+{
+	nstrips= n < 1 ? 1 : n;
+	path= p;
+	input= 0;
+	width= 0;
+	restart_interval= 0;
+	quality= JPEG_QUALITY;
+	next= 0;
+	job= 0;
+	active= 0;
+	quit= false;
+	for(int i=1; i<nstrips; i++) workers.push_back(std::thread(worker_main, this));
+}
+
+StripEncoder::~StripEncoder(void)
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		quit= true;
+		start.notify_all();
+	}
+	for(size_t i=0; i<workers.size(); i++) workers[i].join();
+	for(size_t i=0; i<buffers.size(); i++) delete buffers[i];
+}
+
+// Encode strips of the current job until there are none left
+void StripEncoder::Work(void)
+{
+	size_t i;
+	while((i= next++) < strips.size())
+	{
+		Strip *s= &strips[i];
+		s->sz= jpeg_thread_encoder()->Compress(input, width, s->y0, s->rows, restart_interval, path, quality, false, s->jpeg);
+	}
+}
+
+void StripEncoder::worker_main(StripEncoder *e)
+{
+	unsigned long seen= 0;
+	for(;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(e->mtx);
+			while(!e->quit && e->job == seen) e->start.wait(lock);
+			if(e->quit) return;
+			seen= e->job;
+		}
+		e->Work();
+		std::lock_guard<std::mutex> lock(e->mtx);
+		if(--e->active == 0) e->done.notify_all();
+	}
+}
+
+int StripEncoder::Compress(char *in, const int w, const int h, JPEGBuffer *out, int q)
+{
+	std::lock_guard<std::mutex> serialize(busy);
+	out->used= 0;
+	// strips of whole MCU rows. Every strip is one restart interval (up to 65535 MCUs)
+	int mcu_height= MCU_HEIGHT(path);
+	int mcu_cols= (w + MCU_WIDTH - 1) / MCU_WIDTH;
+	int mcu_rows= (h + mcu_height - 1) / mcu_height;
+	int rows_per_strip= (mcu_rows + nstrips - 1) / nstrips;
+	unsigned int interval= (unsigned int) (mcu_cols * rows_per_strip);
+	if(nstrips == 1 || mcu_rows < 2 || interval > 0xFFFF) return compressYUYVtoJPEG(in, w, h, out, path, q);
+
+	strips.clear();
+	int strip_height= rows_per_strip * mcu_height;
+	for(int y= 0; y < h; y+= strip_height)
+	{
+		if(buffers.size() <= strips.size()) buffers.push_back(new JPEGBuffer);
+		Strip s;
+		s.y0= y;
+		s.rows= h - y < strip_height ? h - y : strip_height;
+		s.jpeg= buffers[strips.size()];
+		s.sz= 0;
+		s.data= 0;
+		strips.push_back(s);
+	}
+	input= in;
+	width= w;
+	restart_interval= interval;
+	quality= q;
+	next= 0;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		active= (int) workers.size();
+		job++;
+		start.notify_all();
+	}
+	Work();
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		while(active > 0) done.wait(lock);
+	}
+
+	// Join: headers of the first strip with the full image height, then the entropy coded data
+	// of every strip separated by RST0 ... RST7, then EOI
+	int sof, start0= JPEGscan(strips[0].jpeg->ptr, strips[0].sz, &sof);
+	size_t total= start0 + 2;
+	bool ok= start0 > 0;
+	for(size_t i=0; ok && i<strips.size(); i++)
+	{
+		int sof_i;
+		const uint8_t *jpeg= strips[i].jpeg->ptr;
+		int sz= strips[i].sz;
+		int data= JPEGscan(jpeg, sz, &sof_i);
+		ok= data > 0 && sz >= data + 2 && jpeg[sz - 2] == 0xFF && jpeg[sz - 1] == 0xD9;
+		total+= sz - 2 - data + (i > 0 ? 2 : 0);
+		strips[i].data= data;
+	}
+	if(!ok || !out->Reserve(total))
+	{
+		fprintf(stdout, "\nERROR: StripEncoder, JPEG strips cannot be joined");
+		return 0;
+	}
+	uint8_t *o= out->ptr;
+	memcpy(o, strips[0].jpeg->ptr, start0);
+	o[sof + 5]= (uint8_t) (h >> 8);
+	o[sof + 6]= (uint8_t) h;
+	size_t p= start0;
+	for(size_t i=0; i<strips.size(); i++)
+	{
+		if(i > 0)
+		{
+			o[p++]= 0xFF;
+			o[p++]= 0xD0 + ((i - 1) & 7);
+		}
+		size_t n= strips[i].sz - 2 - strips[i].data;
+		memcpy(&o[p], &strips[i].jpeg->ptr[strips[i].data], n);
+		p+= n;
+	}
+	o[p++]= 0xFF;
+	o[p++]= 0xD9;
+	out->used= p;
+	return (int) p;
+}
+
+/* END OF FILE */
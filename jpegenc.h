@@ -0,0 +1,122 @@
+#ifndef JPEGENC_HEADER_FILLE_H
+#define JPEGENC_HEADER_FILLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <jpeglib.h>
+
+#define JPEG_QUALITY	92
+
+// How YUYV is fed to libjpeg
+//	yuyv_raw422:		Y, Cb and Cr planes with the 4:2:2 sampling of the camera (jpeg_write_raw_data).
+//						No color conversion nor downsampling by libjpeg
+//	yuyv_scanlines420:	interleaved YCbCr scanlines, downsampled to 4:2:0 by libjpeg (smaller images)
+enum YUYVpath {yuyv_raw422, yuyv_scanlines420};
+
+// Output buffer of the encoders
+// libjpeg writes straight into it (custom destination manager). It grows when an image does not fit
+// and keeps its memory from one image to the next
+// Wrap makes it write into memory of somebody else (a pool slab): if the image does not fit, it is
+// moved to memory of its own (malloc) and 'owned' is set
+class JPEGBuffer
+{
+	public:
+		JPEGBuffer(void);
+		~JPEGBuffer(void);
+		void Wrap(uint8_t *, size_t);
+		bool Reserve(size_t);
+		uint8_t *Detach(void);	// the caller takes the memory (to be freed with free)
+		uint8_t *ptr;
+		size_t size;			// allocated
+		size_t used;			// JPEG image
+		bool owned;
+};
+
+// JPEG compressor kept from frame to frame (libjpeg objects, row buffers)
+// Not thread safe: one per thread, see jpeg_thread_encoder
+class JPEGEncoder
+{
+	public:
+		JPEGEncoder(void);
+		~JPEGEncoder(void);
+		int Compress(const char *input, const int width, const int y0, const int rows, unsigned int restart_interval, YUYVpath path, int quality, bool optimize, JPEGBuffer *out);
+		// 4:2:2 image fed by the caller one MCU row (DCTSIZE lines) at a time: the lines of the planes
+		// (yrows, cbrows, crrows) are filled and then written with WriteRows. End returns the image size
+		int Begin(const int width, const int rows, int quality, bool optimize, JPEGBuffer *out);
+		void WriteRows(int lines);
+		int End(void);
+		JSAMPROW yrows[DCTSIZE], cbrows[DCTSIZE], crrows[DCTSIZE];
+	private:
+		void Setup(const int width, const int rows, unsigned int restart_interval, int quality, bool optimize, JPEGBuffer *out);
+		int Scanlines(const char *input, const int width, const int y0, const int rows);
+		int Raw(const char *input, const int width, const int y0, const int rows);
+		void RawStart(const int width);
+		struct jpeg_compress_struct cinfo;
+		struct jpeg_error_mgr jerr;
+		struct
+		{
+			struct jpeg_destination_mgr pub;
+			JPEGBuffer *buffer;
+		} dest;
+		std::vector<uint8_t> rowbuf;	// scanline or MCU row of planes
+		int raw_width;					// pixels in the plane rows (before padding to whole MCUs)
+};
+
+// Encoder of the calling thread (created on first use)
+JPEGEncoder *jpeg_thread_encoder(void);
+
+// YUYV image to JPEG into 'out'. Thread safe
+//	quality: libjpeg quality 1 ... 100
+//	optimize: Huffman tables optimized for the image (an extra pass over the image, smaller file)
+int compressYUYVtoJPEG(char *input, const int width, const int height, JPEGBuffer *out, YUYVpath path= yuyv_raw422, int quality= JPEG_QUALITY, bool optimize= false);
+
+// Parallel JPEG encoder
+// The image is split into horizontal strips of whole MCU rows that are encoded at the same time on
+// a pool of threads (the calling thread encodes one of them). Every strip is one restart interval
+// so the strips are joined into a single baseline JPEG image by putting RSTn markers between them
+// Output goes to 'out' as compressYUYVtoJPEG does. One Compress at a time
+// Huffman tables are always the standard ones: the joined image has the tables of the first strip
+class StripEncoder
+{
+	public:
+		StripEncoder(int nstrips, YUYVpath path= yuyv_raw422);
+		~StripEncoder(void);
+		int Compress(char *input, const int width, const int height, JPEGBuffer *out, int quality= JPEG_QUALITY);
+		int nstrips;
+		YUYVpath path;
+	private:
+		struct Strip
+		{
+			int y0;
+			int rows;
+			JPEGBuffer *jpeg;
+			int sz;
+			int data;	// offset of the entropy coded data
+		};
+		void Work(void);
+		static void worker_main(StripEncoder *);
+		std::vector<std::thread> workers;
+		std::vector<Strip> strips;
+		std::vector<JPEGBuffer *> buffers;	// one per strip, kept from frame to frame
+		// current job
+		char *input;
+		int width;
+		unsigned int restart_interval;
+		int quality;
+		std::atomic<size_t> next;	// next strip to be encoded
+		unsigned long job;			// workers wait for a new job number
+		int active;					// workers still on the current job
+		bool quit;
+		std::mutex mtx;
+		std::condition_variable start;
+		std::condition_variable done;
+		std::mutex busy;
+};
+
+#endif
+/* END OF FILE */
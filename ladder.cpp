@@ -0,0 +1,152 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * Output ladder
+ *
+ * Full size image, preview (1/2) and thumbnail (1/4) encoded in one pass over the frame: the smaller
+ * rungs are box filtered from the lines of the larger one while they are still in the cache
+ **************************************************************************************************
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "ladder.h"
+#include "yuyv.h"
+
+// Mean of 2x2 pixels: 'n' outputs from two lines of 2n samples
+static void box2(const uint8_t *a, const uint8_t *b, int n, uint8_t *out)
+{
+	for(int i=0; i<n; i++, a+= 2, b+= 2) out[i]= (uint8_t) ((a[0] + a[1] + b[0] + b[1] + 2) >> 2);
+}
+
+LadderEncoder::LadderEncoder(void)
+{
+	dinfo.err= jpeg_std_error(&jerr);
+	jpeg_create_decompress(&dinfo);
+	for(int k=0; k<LADDER_RUNGS; k++)
+	{
+		width[k]= 0;
+		height[k]= 0;
+		line[k]= 0;
+		added[k]= 0;
+	}
+}
+
+LadderEncoder::~LadderEncoder(void)
+{
+	jpeg_destroy_decompress(&dinfo);
+}
+
+// Rungs 'top' ... LADDER_RUNGS-1, 'top' of width x height and every next one half of the previous one
+// (even width for the 4:2:2 pairs)
+void LadderEncoder::Begin(int top, const int w, const int h, const int *quality, bool optimize, JPEGBuffer **out)
+{
+	for(int k=top; k<LADDER_RUNGS; k++)
+	{
+		width[k]= k == top ? w : (width[k-1] / 2) & ~1;
+		height[k]= k == top ? h : height[k-1] / 2;
+		line[k]= 0;
+		added[k]= 0;
+		rungs[k].Begin(width[k], height[k], quality[k], optimize, out[k]);
+	}
+}
+
+// Line 'line[k]' of rung k filled: every second line, the last two are box filtered into the next rung
+void LadderEncoder::AddLine(int k)
+{
+	int l= line[k];
+	if(k + 1 < LADDER_RUNGS && (l & 1) && added[k+1] < height[k+1])
+	{
+		JPEGEncoder *src= &rungs[k];
+		JPEGEncoder *dst= &rungs[k+1];
+		int d= line[k+1];
+		box2(src->yrows[l-1], src->yrows[l], width[k+1], dst->yrows[d]);
+		box2(src->cbrows[l-1], src->cbrows[l], width[k+1] / 2, dst->cbrows[d]);
+		box2(src->crrows[l-1], src->crrows[l], width[k+1] / 2, dst->crrows[d]);
+		AddLine(k + 1);
+	}
+	added[k]++;
+	if(++line[k] == DCTSIZE)
+	{
+		rungs[k].WriteRows(DCTSIZE);
+		line[k]= 0;
+	}
+}
+
+void LadderEncoder::End(int top)
+{
+	for(int k=top; k<LADDER_RUNGS; k++)
+	{
+		if(line[k] > 0) rungs[k].WriteRows(line[k]);
+		rungs[k].End();
+	}
+}
+
+// All the rungs. Returns the size of the full image
+int LadderEncoder::CompressYUYV(const char *input, const int w, const int h, const int *quality, bool optimize, JPEGBuffer **out)
+{
+	if(w / 4 < 2 || h / 4 < 1) return -1;
+	Begin(0, w, h, quality, optimize, out);
+	const YUYVKernels *kernels= yuyv_kernels();
+	JPEGEncoder *full= &rungs[0];
+	for(int y=0; y<h; y++)
+	{
+		const uint8_t *src= (const uint8_t *) input + (size_t) y * w * 2;
+		kernels->to_planes(src, w / 2, full->yrows[line[0]], full->cbrows[line[0]], full->crrows[line[0]]);
+		AddLine(0);
+	}
+	End(0);
+	return (int) out[0]->used;
+}
+
+// Preview and thumbnail of a JPEG image (out[0] and quality[0] are not used). Returns the size of the
+// preview
+int LadderEncoder::CompressJPEG(const uint8_t *jpeg, size_t size, const int *quality, bool optimize, JPEGBuffer **out)
+{
+	jpeg_mem_src(&dinfo, (unsigned char *) jpeg, size);
+	if(jpeg_read_header(&dinfo, TRUE) != 1)
+	{
+		jpeg_abort_decompress(&dinfo);
+		return -1;
+	}
+	dinfo.scale_num= 4;
+	dinfo.scale_denom= 8;
+	dinfo.out_color_space= JCS_YCbCr;
+	jpeg_start_decompress(&dinfo);
+	int w= dinfo.output_width & ~1;
+	int h= dinfo.output_height;
+	if(w / 2 < 2 || h / 2 < 1)
+	{
+		jpeg_abort_decompress(&dinfo);
+		return -1;
+	}
+	if(rowbuf.size() < (size_t) dinfo.output_width * 3) rowbuf.resize((size_t) dinfo.output_width * 3);
+	Begin(1, w, h, quality, optimize, out);
+	JPEGEncoder *preview= &rungs[1];
+	JSAMPROW row= &rowbuf[0];
+	while(dinfo.output_scanline < dinfo.output_height)
+	{
+		jpeg_read_scanlines(&dinfo, &row, 1);
+		// Y Cb Cr pixels to 4:2:2 planes, chroma of a pair averaged
+		const uint8_t *p= &rowbuf[0];
+		uint8_t *py= preview->yrows[line[1]], *pcb= preview->cbrows[line[1]], *pcr= preview->crrows[line[1]];
+		for(int i=0; i<w/2; i++, p+= 6)
+		{
+			py[2*i]= p[0];
+			py[2*i+1]= p[3];
+			pcb[i]= (uint8_t) ((p[1] + p[4] + 1) >> 1);
+			pcr[i]= (uint8_t) ((p[2] + p[5] + 1) >> 1);
+		}
+		AddLine(1);
+	}
+	jpeg_finish_decompress(&dinfo);
+	End(1);
+	return (int) out[1]->used;
+}
+
+LadderEncoder *jpeg_thread_ladder(void)
+{
+	static thread_local LadderEncoder ladder;
+	return &ladder;
+}
+
+/* END OF FILE */
@@ -0,0 +1,47 @@
+#ifndef LADDER_HEADER_FILLE_H
+#define LADDER_HEADER_FILLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <jpeglib.h>
+#include "jpegenc.h"
+
+// Output ladder: the frame (full), a preview at 1/2 and a thumbnail at 1/4 of its size
+#define LADDER_RUNGS			3
+#define LADDER_PREVIEW_QUALITY	80
+#define LADDER_THUMB_QUALITY	70
+
+// Encodes the rungs of the ladder at the same time, from one read of the capture buffer
+// YUYV: every line is unpacked into 4:2:2 planes for the full image and box filtered (2x2 mean) into
+// the planes of the 1/2 rung, which are box filtered into the 1/4 rung. Each rung has a libjpeg
+// compressor of its own that takes its planes one MCU row at a time
+// JPEG (MJPEG): the image is decoded once at 1/2 (DCT scaling) into Y Cb Cr, which feeds the 1/2 rung
+// and, box filtered, the 1/4 rung. The full rung is the camera image itself
+// out[k], quality[k]: rung k (0 full, 1 preview, 2 thumbnail). Returns <0 on failure
+// Not thread safe: one per thread, see jpeg_thread_ladder
+class LadderEncoder
+{
+	public:
+		LadderEncoder(void);
+		~LadderEncoder(void);
+		int CompressYUYV(const char *input, const int width, const int height, const int *quality, bool optimize, JPEGBuffer **out);
+		int CompressJPEG(const uint8_t *jpeg, size_t size, const int *quality, bool optimize, JPEGBuffer **out);
+	private:
+		void Begin(int top, const int width, const int height, const int *quality, bool optimize, JPEGBuffer **out);
+		void AddLine(int k);
+		void End(int top);
+		JPEGEncoder rungs[LADDER_RUNGS];
+		int width[LADDER_RUNGS];
+		int height[LADDER_RUNGS];
+		int line[LADDER_RUNGS];		// line being filled in the MCU row of the rung
+		int added[LADDER_RUNGS];	// lines of the image written so far
+		struct jpeg_decompress_struct dinfo;
+		struct jpeg_error_mgr jerr;
+		std::vector<uint8_t> rowbuf;	// decoded Y Cb Cr line
+};
+
+// Ladder encoder of the calling thread (created on first use)
+LadderEncoder *jpeg_thread_ladder(void);
+
+#endif
+/* END OF FILE */
@@ -0,0 +1,214 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * Change detection
+ *
+ * Overnight most frames are the same scene. Frames with no change are not stored or uploaded, which
+ * also saves their JPEG compression. The detector reads a small part of the frame (a row of every
+ * 8x8 block, about 1/16 of a YUYV image) so that it costs far less than the work it saves
+ **************************************************************************************************
+*/
+#include <stdlib.h>
+#include <time.h>
+#include <linux/videodev2.h>
+
+#include "motion.h"
+
+// background: new grid weighs 1/2^MOTION_ALPHA, and 1/2^MOTION_ALPHA_CHANGED in changed cells so that
+// a passing object hardly leaves a trace while a lasting change (a parked car) is absorbed
+#define MOTION_ALPHA			4
+#define MOTION_ALPHA_CHANGED	6
+
+ChangeDetector::ChangeDetector(double t, int k, int d)
+{
+	threshold= t;
+	keep= k;
+	dark= d;
+	score= 0;
+	mean= 0;
+	under= 0;
+	over= 0;
+	frames= 0;
+	changed= 0;
+	dropped= 0;
+	dark_frames= 0;
+	sum_mean= 0;
+	sum_under= 0;
+	sum_over= 0;
+	sum_us= 0;
+	max_us= 0;
+	gw= 0;
+	gh= 0;
+	primed= false;
+	since_kept= 0;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&cinfo);
+}
+
+ChangeDetector::~ChangeDetector(void)
+{
+	jpeg_destroy_decompress(&cinfo);
+}
+
+// Luma grid of a YUYV image: mean of the middle row of each cell
+int ChangeDetector::LumaYUYV(const uint8_t *yuyv, int width, int height)
+{
+	int w= width / MOTION_BLOCK;
+	int h= height / MOTION_BLOCK;
+	if(w != gw || h != gh) primed= false;
+	gw= w;
+	gh= h;
+	grid.resize(gw * gh);
+	for(int cy=0; cy<gh; cy++)
+	{
+		const uint8_t *row= yuyv + (size_t) (cy * MOTION_BLOCK + MOTION_BLOCK / 2) * width * 2;
+		uint8_t *g= &grid[cy * gw];
+		for(int cx=0; cx<gw; cx++, row+= MOTION_BLOCK * 2)
+		{
+			int sum= 0;
+			for(int x=0; x<MOTION_BLOCK; x++) sum+= row[2*x];
+			g[cx]= (uint8_t) (sum / MOTION_BLOCK);
+		}
+	}
+	return 0;
+}
+
+// Luma grid of a JPEG image: DC coefficients of the luma blocks
+int ChangeDetector::LumaJPEG(const uint8_t *jpeg, size_t length)
+{
+	if(dcmap.Decode(jpeg, length) != 0) return LumaScaled(jpeg, length);
+	if(dcmap.width != gw || dcmap.height != gh) primed= false;
+	gw= dcmap.width;
+	gh= dcmap.height;
+	grid.assign(dcmap.map.begin(), dcmap.map.end());
+	return 0;
+}
+
+// Luma grid of a JPEG image by libjpeg: grayscale decode scaled 1/8, which only takes the DC of each block
+int ChangeDetector::LumaScaled(const uint8_t *jpeg, size_t length)
+{
+	jpeg_mem_src(&cinfo, (unsigned char *) jpeg, length);
+	if(jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) return -1;
+	cinfo.out_color_space= JCS_GRAYSCALE;
+	cinfo.scale_num= 1;
+	cinfo.scale_denom= MOTION_BLOCK;
+	cinfo.dct_method= JDCT_IFAST;
+	jpeg_start_decompress(&cinfo);
+	int w= cinfo.output_width;
+	int h= cinfo.output_height;
+	if(w != gw || h != gh) primed= false;
+	gw= w;
+	gh= h;
+	grid.resize(gw * gh);
+	while(cinfo.output_scanline < cinfo.output_height)
+	{
+		JSAMPROW row= &grid[cinfo.output_scanline * gw];
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	return 0;
+}
+
+// Mean luma and cells under and over exposed
+void ChangeDetector::Exposure(void)
+{
+	int cells= gw * gh;
+	if(cells == 0) return;
+	long sum= 0;
+	int n_under= 0, n_over= 0;
+	for(int i=0; i<cells; i++)
+	{
+		sum+= grid[i];
+		if(grid[i] < MOTION_DARK) n_under++;
+		else if(grid[i] > MOTION_BRIGHT) n_over++;
+	}
+	mean= (int) (sum / cells);
+	under= 100.0 * n_under / cells;
+	over= 100.0 * n_over / cells;
+	sum_mean+= mean;
+	sum_under+= under;
+	sum_over+= over;
+}
+
+// Percentage of cells changed against the background. The background moves towards the grid
+double ChangeDetector::Score(void)
+{
+	int cells= gw * gh;
+	if(cells == 0) return 100;
+	if(!primed)
+	{
+		background.resize(cells);
+		for(int i=0; i<cells; i++) background[i]= grid[i] << 4;
+		primed= true;
+		return 100;
+	}
+	// change of mean brightness
+	long sum_grid= 0, sum_back= 0;
+	for(int i=0; i<cells; i++)
+	{
+		sum_grid+= grid[i];
+		sum_back+= background[i];
+	}
+	int offset= (int) ((sum_grid * 16 - sum_back) / cells);
+	int n= 0;
+	for(int i=0; i<cells; i++)
+	{
+		int g= grid[i] << 4;
+		int d= g - background[i] - offset;
+		if(abs(d) > MOTION_PIXEL * 16)
+		{
+			n++;
+			background[i]+= (g - background[i]) >> MOTION_ALPHA_CHANGED;
+		}
+		else background[i]+= (g - background[i]) >> MOTION_ALPHA;
+	}
+	return 100.0 * n / cells;
+}
+
+// true if the frame is to be kept: not dark, and changed or one every 'keep' static frames
+bool ChangeDetector::Check(const void *ptr, size_t length, unsigned int pixelformat, int width, int height)
+{
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	int rc;
+	if(pixelformat == V4L2_PIX_FMT_YUYV) rc= LumaYUYV((const uint8_t *) ptr, width, height);
+	else rc= LumaJPEG((const uint8_t *) ptr, length);
+	if(rc == 0) Exposure();
+	// dark frames stay out of the background
+	bool is_dark= rc == 0 && mean < dark;
+	score= rc == 0 && !is_dark ? Score() : 100;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	long us= (t1.tv_sec - t0.tv_sec) * 1000000L + (t1.tv_nsec - t0.tv_nsec) / 1000;
+	sum_us+= us;
+	if(us > max_us) max_us= us;
+	frames++;
+	if(is_dark)
+	{
+		dark_frames++;
+		return false;
+	}
+	if(score >= threshold)
+	{
+		changed++;
+		since_kept= 0;
+		return true;
+	}
+	if(keep > 0 && ++since_kept >= keep)
+	{
+		since_kept= 0;
+		return true;
+	}
+	dropped++;
+	return false;
+}
+
+void ChangeDetector::PrintStats(FILE *fp)
+{
+	if(frames == 0) return;
+	if(threshold > 0)
+		fprintf(fp, "\nMotion: %lu frames, %lu changed (>= %.1f%% of %dx%d cells), %lu static not kept", frames, changed, threshold, gw, gh, dropped);
+	fprintf(fp, "\nExposure: mean luma %.0f, %.1f%% of the image dark, %.1f%% bright", sum_mean / frames, sum_under / frames, sum_over / frames);
+	if(dark > 0) fprintf(fp, ", %lu frames under luma %d not kept", dark_frames, dark);
+	fprintf(fp, "\nAnalysis: mean %.0f us max %ld us per frame", sum_us / frames, max_us);
+}
+
+/* END OF FILE */
@@ -0,0 +1,69 @@
+#ifndef MOTION_HEADER_FILLE_H
+#define MOTION_HEADER_FILLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <jpeglib.h>
+
+#include "jpegdc.h"
+
+#define MOTION_BLOCK	8	// one luma cell per 8x8 pixels
+#define MOTION_PIXEL	12	// cell luma difference to the background counted as a change
+#define MOTION_DARK		16	// exposure: cell under / over exposed
+#define MOTION_BRIGHT	235
+
+// Frame analysis of the capture loop: change detection (option motion=P) and exposure (option dark=N)
+// Each frame is reduced to a luma grid, one cell per MOTION_BLOCK x MOTION_BLOCK pixels: a row of 
+// every cell straight from the YUYV buffer, or the DC coefficients of the luma blocks of MJPEG 
+// (JPEGDCMap, or a 1/8 scaled libjpeg decode for JPEG it cannot read). The grid 
+// is scored against a background (running average of the grid, which absorbs slow light changes
+// and, more slowly, lasting changes of the scene)
+// as the percentage of cells that differ by more than MOTION_PIXEL once the change of mean brightness
+// (camera exposure) is taken out
+// Frames scoring below 'threshold' are static: only one every 'keep' is kept (0: none)
+// Frames with a mean luma below 'dark' (night) are not kept either
+// Not thread safe: called from the capture loop
+class ChangeDetector
+{
+	public:
+		ChangeDetector(double threshold, int keep, int dark= 0);
+		~ChangeDetector(void);
+		bool Check(const void *ptr, size_t length, unsigned int pixelformat, int width, int height);
+		int gw, gh;
+		std::vector<uint8_t> grid;
+		int LumaYUYV(const uint8_t *yuyv, int width, int height);
+		int LumaJPEG(const uint8_t *jpeg, size_t length);
+		int LumaScaled(const uint8_t *jpeg, size_t length);
+		void Exposure(void);
+		double Score(void);
+		void PrintStats(FILE *);
+		double threshold;		// % of cells
+		int keep;
+		int dark;				// mean luma
+		double score;			// last frame
+		// exposure of the last frame: mean luma, % of cells under MOTION_DARK, over MOTION_BRIGHT
+		int mean;
+		double under;
+		double over;
+		unsigned long frames;
+		unsigned long changed;
+		unsigned long dropped;	// static frames not kept
+		unsigned long dark_frames;
+		double sum_mean;
+		double sum_under;
+		double sum_over;
+		double sum_us;
+		long max_us;
+	private:
+		std::vector<uint16_t> background;	// luma x 16
+		bool primed;
+		JPEGDCMap dcmap;
+		int since_kept;
+		struct jpeg_decompress_struct cinfo;
+		struct jpeg_error_mgr jerr;
+};
+
+#endif
+/* END OF FILE */
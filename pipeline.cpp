@@ -0,0 +1,203 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * Capture pipeline
+ * 
+ * Capture, JPEG compression and the outputs (file, cloud, framebuffer) run on their own threads, 
+ * connected by bounded queues of frame handles (RingQueue). Each queue has a drop policy so that a 
+ * slow stage either drops frames or holds the previous stage back, as configured.
+ **************************************************************************************************
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+PipelineFrame *PipelineFrame_create(FrameSource *source, Frame *frame)
+{
+	PipelineFrame *f= new PipelineFrame;
+	f->refs= 1;
+	f->source= source;
+	f->frame= *frame;
+	f->buffer= 0;
+	f->jpeg= 0;
+	f->jpeg_sz= 0;
+	f->preview= 0;
+	f->thumb= 0;
+	f->seq= 0;
+	f->n= 0;
+	f->lateness_us= 0;
+	return f;
+}
+
+void PipelineFrame_acquire(PipelineFrame *f)
+{
+	f->refs++;
+}
+
+// Give the capture buffer back to the source as soon as nobody needs the raw image
+void PipelineFrame_releasecapture(PipelineFrame *f)
+{
+	if(f->frame.index >= 0 || f->frame.ptr) f->source->ReleaseFrame(&f->frame);
+	f->frame.index= -1;
+	f->frame.ptr= 0;
+}
+
+void PipelineFrame_release(PipelineFrame *f)
+{
+	if(--f->refs > 0) return;
+	PipelineFrame_releasecapture(f);
+	if(f->buffer) f->buffer->pool->Release(f->buffer);
+	if(f->preview) f->preview->pool->Release(f->preview);
+	if(f->thumb) f->thumb->pool->Release(f->thumb);
+	delete f;
+}
+
+Pipeline::Pipeline(void)
+{
+	queue= 0;
+	encode= 0;
+	encode_ctx= 0;
+	encoded= 0;
+	failed= 0;
+	nencoders= 0;
+	running= false;
+}
+
+Pipeline::~Pipeline(void)
+{
+	Stop();
+	for(size_t i=0; i<sinks.size(); i++)
+	{
+		delete sinks[i]->queue;
+		delete sinks[i];
+	}
+	if(queue) delete queue;
+}
+
+// Output stage with its own thread and input queue. To be called before Start
+int Pipeline::AddSink(const char *name, SinkFunc func, void *ctx, size_t depth, DropPolicy policy)
+{
+	if(running) return -1;
+	Sink *s= new Sink;
+	s->name= name;
+	s->func= func;
+	s->ctx= ctx;
+	s->done= 0;
+	s->queue= new FrameQueue(depth, policy, PipelineFrame_release);
+	sinks.push_back(s);
+	return 0;
+}
+
+int Pipeline::Start(int n, size_t depth, DropPolicy policy, EncodeFunc func, void *ctx)
+{
+	if(running) return -1;
+	encode= func;
+	encode_ctx= ctx;
+	queue= new FrameQueue(depth, policy, PipelineFrame_release);
+	for(size_t i=0; i<sinks.size(); i++) sinks[i]->thread= std::thread(sink_main, sinks[i]);
+	nencoders= n;
+	for(int i=0; i<n; i++) encoders.push_back(std::thread(encoder_main, this));
+	running= true;
+	return 0;
+}
+
+// Capture stage: hand a frame to the encoders. The pipeline takes over the caller's reference
+bool Pipeline::Submit(PipelineFrame *f)
+{
+	return queue->Push(f);
+}
+
+// Frame encoded by the caller (the capture loop, no encoder threads): straight to the sinks. The 
+// pipeline takes over the caller's reference
+void Pipeline::SubmitEncoded(PipelineFrame *f)
+{
+	encoded++;
+	Dispatch(f);
+}
+
+// Frame the caller could not encode or hand over (e.g. no image buffer): counted as failed
+void Pipeline::EncodeFailed(void)
+{
+	failed++;
+}
+
+// Encoded frame to every sink
+void Pipeline::Dispatch(PipelineFrame *f)
+{
+	for(size_t i=0; i<sinks.size(); i++)
+	{
+		PipelineFrame_acquire(f);
+		sinks[i]->queue->Push(f);
+	}
+	PipelineFrame_release(f);
+}
+
+// Drain the queues and wait for every thread
+void Pipeline::Stop(void)
+{
+	if(!running) return;
+	queue->Close();
+	for(size_t i=0; i<encoders.size(); i++) encoders[i].join();
+	encoders.clear();
+	for(size_t i=0; i<sinks.size(); i++) sinks[i]->queue->Close();
+	for(size_t i=0; i<sinks.size(); i++) sinks[i]->thread.join();
+	running= false;
+}
+
+void Pipeline::encoder_main(Pipeline *p)
+{
+	PipelineFrame *f;
+	while(p->queue->Pop(&f))
+	{
+		if(p->encode(f, p->encode_ctx) < 0)
+		{
+			p->failed++;
+			PipelineFrame_release(f);
+			continue;
+		}
+		p->encoded++;
+		p->Dispatch(f);
+	}
+}
+
+void Pipeline::sink_main(Sink *s)
+{
+	PipelineFrame *f;
+	while(s->queue->Pop(&f))
+	{
+		s->func(f, s->ctx);
+		s->done++;
+		PipelineFrame_release(f);
+	}
+}
+
+// Frames that can be held at the same time with an image: one per encoder thread, plus one per 
+// queue cell and thread of the sinks (sizes the pool of JPEG images)
+int Pipeline::MaxFrames(void)
+{
+	int n= nencoders;
+	for(size_t i=0; i<sinks.size(); i++) n+= (int) sinks[i]->queue->capacity + 1;
+	return n;
+}
+
+static const char *policy_name(DropPolicy p)
+{
+	return p == drop_oldest ? "drop oldest" : p == drop_newest ? "drop newest" : "block";
+}
+
+void Pipeline::PrintStats(FILE *fp)
+{
+	if(!queue) return;
+	if(nencoders > 0)
+	{
+		fprintf(fp, "\nPipeline: %d encoders", nencoders);
+		fprintf(fp, "\n\tencode   %lu frames, %lu failed, queue %lu/%lu max, %lu dropped (%s)", 
+			encoded.load(), failed.load(), queue->high_water.load(), queue->capacity, queue->drops.load(), policy_name(queue->policy));
+	}
+	else fprintf(fp, "\nPipeline: %lu frames encoded on the capture loop, %lu failed", encoded.load(), failed.load());
+	for(size_t i=0; i<sinks.size(); i++)
+		fprintf(fp, "\n\t%-8s %lu frames, queue %lu/%lu max, %lu dropped (%s)", sinks[i]->name, 
+			sinks[i]->done.load(), sinks[i]->queue->high_water.load(), sinks[i]->queue->capacity, sinks[i]->queue->drops.load(), policy_name(sinks[i]->queue->policy));
+}
+
+/* END OF FILE */
@@ -0,0 +1,81 @@
+#ifndef PIPELINE_HEADER_FILLE_H
+#define PIPELINE_HEADER_FILLE_H
+
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "framesource.h"
+#include "ringqueue.h"
+#include "framepool.h"
+
+// Frame travelling through the pipeline
+// Created by the capture stage with the borrowed capture buffer ('frame'), filled by an encoder with 
+// the JPEG image and then shared by the sinks. Reference counted: the capture buffer is given back 
+// and the JPEG image goes back to its pool when the last holder calls PipelineFrame_release
+struct PipelineFrame
+{
+	std::atomic<int> refs;
+	FrameSource *source;
+	Frame frame;			// capture buffer, index -1 once released
+	PoolBuffer *buffer;		// memory of the JPEG image
+	unsigned char *jpeg;	// JPEG image (in 'buffer')
+	size_t jpeg_sz;
+	PoolBuffer *preview;	// output ladder (option ladder), 0 if none
+	PoolBuffer *thumb;
+	unsigned long seq;		// capture order
+	unsigned int n;			// image file number
+	long lateness_us;		// capture lateness
+};
+PipelineFrame *PipelineFrame_create(FrameSource *, Frame *);
+void PipelineFrame_acquire(PipelineFrame *);
+void PipelineFrame_release(PipelineFrame *);
+void PipelineFrame_releasecapture(PipelineFrame *);
+
+typedef RingQueue<PipelineFrame *> FrameQueue;
+// Stage work. An encoder returns <0 when the frame is to be dropped
+typedef int (*EncodeFunc)(PipelineFrame *, void *ctx);
+typedef void (*SinkFunc)(PipelineFrame *, void *ctx);
+
+// capture --> [queue] --> encoder pool --> [queue per sink] --> sink thread (disk or cloud)
+// With no encoder threads (Start with 0) the capture loop encodes and SubmitEncoded hands the frames
+// to the sinks: outputs only run on their threads (e.g. the disk writer of the single threaded loop)
+class Pipeline
+{
+	public:
+		Pipeline(void);
+		~Pipeline(void);
+		int AddSink(const char *name, SinkFunc, void *ctx, size_t depth, DropPolicy);
+		int Start(int nencoders, size_t depth, DropPolicy, EncodeFunc, void *ctx);
+		bool Submit(PipelineFrame *);
+		void SubmitEncoded(PipelineFrame *);
+		void EncodeFailed(void);
+		void Stop(void);
+		void PrintStats(FILE *);
+		int MaxFrames(void);
+	private:
+		struct Sink
+		{
+			const char *name;
+			SinkFunc func;
+			void *ctx;
+			FrameQueue *queue;
+			std::thread thread;
+			std::atomic<unsigned long> done;
+		};
+		void Dispatch(PipelineFrame *);
+		static void encoder_main(Pipeline *);
+		static void sink_main(Sink *);
+		EncodeFunc encode;
+		void *encode_ctx;
+		FrameQueue *queue;
+		std::vector<std::thread> encoders;
+		std::vector<Sink *> sinks;
+		std::atomic<unsigned long> encoded;
+		std::atomic<unsigned long> failed;
+		int nencoders;
+		bool running;
+};
+
+#endif
+/* END OF FILE */
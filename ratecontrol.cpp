@@ -0,0 +1,101 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * JPEG rate control
+ *
+ * Sites on a slow uplink (cellular) cannot upload every image at full quality. The controller trades
+ * quality for size, frame to frame, so that the images stay within a byte budget
+ **************************************************************************************************
+*/
+#include <math.h>
+
+#include "jpegenc.h"
+#include "ratecontrol.h"
+
+// log(size) per quality point. Starts at RATE_SLOPE and is then measured on the frames, within
+// RATE_SLOPE_MIN ... RATE_SLOPE_MAX (detailed scenes change less with the quality than flat ones)
+#define RATE_SLOPE			0.04
+#define RATE_SLOPE_MIN		0.005
+#define RATE_SLOPE_MAX		0.2
+// The controller aims RATE_DEADBAND below the target and leaves the quality as it is for sizes
+// within RATE_DEADBAND of the aim
+#define RATE_DEADBAND		0.05
+#define RATE_MAX_STEP		15.0
+
+RateControl::RateControl(size_t target_bytes, HuffmanTables h)
+{
+	target= target_bytes;
+	huffman= h;
+	frames= 0;
+	over= 0;
+	sum_bytes= 0;
+	quality= JPEG_QUALITY;
+	slope= RATE_SLOPE;
+	last_quality= -1;
+	last_log= 0;
+	min_quality= JPEG_QUALITY;
+	max_quality= JPEG_QUALITY;
+}
+
+RateControl::~RateControl(void)
+{
+}
+
+// Quality of the next frame
+int RateControl::Quality(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return (int) lround(quality);
+}
+
+// Optimized Huffman tables for the next frame
+bool RateControl::Optimize(void)
+{
+	if(huffman == huffman_auto)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		return quality < JPEG_QUALITY;
+	}
+	return huffman == huffman_opt;
+}
+
+// A frame encoded at 'q' took 'bytes'
+void RateControl::Update(size_t bytes, int q)
+{
+	if(bytes == 0) return;
+	std::lock_guard<std::mutex> lock(mtx);
+	frames++;
+	sum_bytes+= bytes;
+	if(bytes > target) over++;
+	if(q < min_quality) min_quality= q;
+	if(q > max_quality) max_quality= q;
+	// slope from this frame and the previous one at another quality
+	double lb= log((double) bytes);
+	if(last_quality >= 0 && q != last_quality)
+	{
+		double s= (lb - last_log) / (q - last_quality);
+		if(s < RATE_SLOPE_MIN) s= RATE_SLOPE_MIN;
+		if(s > RATE_SLOPE_MAX) s= RATE_SLOPE_MAX;
+		slope= (slope + s) / 2;
+	}
+	last_quality= q;
+	last_log= lb;
+	double error= log(target * (1 - RATE_DEADBAND)) - lb;
+	if(fabs(error) < RATE_DEADBAND) return;
+	double step= error / slope;
+	if(step > RATE_MAX_STEP) step= RATE_MAX_STEP;
+	if(step < -RATE_MAX_STEP) step= -RATE_MAX_STEP;
+	// frames of the pipeline may have been encoded before the last change: step from their quality
+	quality= q + step;
+	if(quality < RATE_QUALITY_MIN) quality= RATE_QUALITY_MIN;
+	if(quality > RATE_QUALITY_MAX) quality= RATE_QUALITY_MAX;
+}
+
+void RateControl::PrintStats(FILE *fp)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	const char *tables[3]= {"standard", "optimized", "auto"};
+	fprintf(fp, "\nRate control: target %lu bytes/frame, mean %.0f bytes, %lu of %lu frames over, quality %d ... %d, %s Huffman tables",
+		(unsigned long) target, frames ? sum_bytes / frames : 0, over, frames, min_quality, max_quality, tables[huffman]);
+}
+
+/* END OF FILE */
@@ -0,0 +1,47 @@
+#ifndef RATECONTROL_HEADER_FILLE_H
+#define RATECONTROL_HEADER_FILLE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <mutex>
+
+#define RATE_QUALITY_MIN	20
+#define RATE_QUALITY_MAX	95
+
+// Huffman tables of the JPEG images
+//	std:	standard tables of libjpeg (one pass)
+//	opt:	tables optimized for each image (an extra pass over the image, images a few % smaller)
+//	auto:	optimized tables only while the budget holds the quality down
+enum HuffmanTables {huffman_std, huffman_opt, huffman_auto};
+
+// JPEG quality controller holding the images to a byte budget per frame
+// Quality for the next frame comes from the size of the previous ones: JPEG size grows about
+// exponentially with the quality, so the quality moves by log(target/size) over the slope of
+// log(size) against quality measured on the last frames, within RATE_QUALITY_MIN ... RATE_QUALITY_MAX
+// Thread safe (encoder threads of the pipeline)
+class RateControl
+{
+	public:
+		RateControl(size_t target_bytes, HuffmanTables);
+		~RateControl(void);
+		int Quality(void);
+		bool Optimize(void);
+		void Update(size_t bytes, int quality);
+		void PrintStats(FILE *);
+		size_t target;			// bytes per frame
+		HuffmanTables huffman;
+		unsigned long frames;
+		unsigned long over;		// frames above the target
+		double sum_bytes;
+		int min_quality;
+		int max_quality;
+	private:
+		double quality;
+		double slope;			// log(size) per quality point
+		int last_quality;
+		double last_log;		// log(size) of the last frame
+		std::mutex mtx;
+};
+
+#endif
+/* END OF FILE */
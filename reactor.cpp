@@ -0,0 +1,109 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * epoll event loop
+ * 
+ **************************************************************************************************
+*/
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "reactor.h"
+
+#define REACTOR_MAX_EVENTS	16
+
+Reactor::Reactor(void)
+{
+	running= true;
+	epfd= epoll_create1(EPOLL_CLOEXEC);
+	if(epfd == -1) perror("epoll_create1");
+}
+
+Reactor::~Reactor(void)
+{
+	for(size_t i=0; i<watches.size(); i++) delete watches[i];
+	for(size_t i=0; i<removed.size(); i++) delete removed[i];
+	if(epfd != -1) close(epfd);
+}
+
+Reactor::Watch *Reactor::Find(int fd)
+{
+	for(size_t i=0; i<watches.size(); i++)
+		if(watches[i]->fd == fd) return watches[i];
+	return 0;
+}
+
+int Reactor::Add(int fd, uint32_t events, ReactorHandler handler, void *ctx)
+{
+	Watch *w= new Watch;
+	w->fd= fd;
+	w->handler= handler;
+	w->ctx= ctx;
+	w->removed= false;
+	struct epoll_event ev = {0};
+	ev.events= events;
+	ev.data.ptr= w;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		delete w;
+		return -1;
+	}
+	watches.push_back(w);
+	return 0;
+}
+
+int Reactor::Modify(int fd, uint32_t events)
+{
+	Watch *w= Find(fd);
+	if(!w) return -1;
+	struct epoll_event ev = {0};
+	ev.events= events;
+	ev.data.ptr= w;
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+// To be called before closing 'fd'
+int Reactor::Remove(int fd)
+{
+	for(size_t i=0; i<watches.size(); i++)
+		if(watches[i]->fd == fd)
+		{
+			Watch *w= watches[i];
+			epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+			w->removed= true;
+			removed.push_back(w);
+			watches.erase(watches.begin() + i);
+			return 0;
+		}
+	return -1;
+}
+
+// Wait for events and dispatch them to their handlers
+// returns the number of events, -1 on error
+int Reactor::Poll(int timeout_ms)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	int n= epoll_wait(epfd, events, REACTOR_MAX_EVENTS, timeout_ms);
+	if(n == -1)
+	{
+		if(errno == EINTR) return 0;
+		perror("epoll_wait");
+		return -1;
+	}
+	for(int i=0; i<n && running; i++)
+	{
+		Watch *w= (Watch *) events[i].data.ptr;
+		if(!w->removed) w->handler(w->fd, events[i].events, w->ctx);
+	}
+	for(size_t i=0; i<removed.size(); i++) delete removed[i];
+	removed.clear();
+	return n;
+}
+
+void Reactor::Stop(void)
+{
+	running= false;
+}
+
+/* END OF FILE */
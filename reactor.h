@@ -0,0 +1,39 @@
+#ifndef REACTOR_HEADER_FILLE_H
+#define REACTOR_HEADER_FILLE_H
+
+#include <stdint.h>
+#include <vector>
+
+// Called when 'fd' is ready. events are the EPOLLxxx flags
+typedef void (*ReactorHandler)(int fd, uint32_t events, void *ctx);
+
+// Single epoll event loop
+// Every file descriptor the capture loop waits on (camera, capture timer, keyboard, upload socket) is 
+// watched here, so that none of them blocks the others
+class Reactor
+{
+	public:
+		Reactor(void);
+		~Reactor(void);
+		int Add(int fd, uint32_t events, ReactorHandler, void *ctx);
+		int Modify(int fd, uint32_t events);
+		int Remove(int fd);
+		int Poll(int timeout_ms);
+		void Stop(void);
+		bool running;
+	private:
+		struct Watch
+		{
+			int fd;
+			ReactorHandler handler;
+			void *ctx;
+			bool removed;
+		};
+		Watch *Find(int);
+		int epfd;
+		std::vector<Watch *> watches;
+		std::vector<Watch *> removed;	// freed once the events of the current Poll are dispatched
+};
+
+#endif
+/* END OF FILE */
@@ -0,0 +1,192 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * Replay source: plays back a capture file instead of a V4L camera
+ * 
+ * Used to measure the encode / store / upload pipeline on machines with no video device
+ * e.g.:
+ *		tlcam 0 replay=capture.mjpg agent		-> as fast as possible
+ *		tlcam 100 replay=capture.yuyv yuyv vga	-> 10 fps
+ **************************************************************************************************
+*/
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/videodev2.h>
+
+#include "replay.h"
+
+ReplaySource::ReplaySource(const char *path)
+{
+	data= 0;
+	size= 0;
+	mjpeg= false;
+	next= 0;
+	sequence= 0;
+	nframes= 0;
+	loop= false;
+	memset(&wkm, 0, sizeof(wkm));
+	dev= open(path, O_RDONLY);
+	if (dev == -1)
+	{
+		perror("Opening replay file");
+		return;
+	}
+	struct stat st;
+	if(fstat(dev, &st) == -1 || st.st_size == 0)
+	{
+		fprintf(stdout, "\nERROR: replay file is empty");
+		close(dev);
+		dev= -1;
+		return;
+	}
+	size= (size_t) st.st_size;
+	data= (unsigned char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, dev, 0);
+	if(data == MAP_FAILED)
+	{
+		perror("Mapping replay file");
+		data= 0;
+		close(dev);
+		dev= -1;
+		return;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+	// SOI marker (FF D8) at the beginning means concatenated JPEG images
+	mjpeg= size > 2 && data[0] == 0xFF && data[1] == 0xD8;
+}
+
+ReplaySource::~ReplaySource()
+{
+	if(data) munmap(data, size);
+	if(dev != -1) close(dev);
+	dev= -1;
+	data= 0;
+}
+
+// Length of the JPEG image at 'p' (SOI to EOI both included). 0 if not a valid image
+// Walks the marker segments up to SOS and then the entropy coded data up to EOI
+// Image width and height are taken from the SOF marker
+int ReplaySource::JPEGsize(const unsigned char *p, size_t max, int *width, int *height)
+{
+	if(max < 4 || p[0] != 0xFF || p[1] != 0xD8) return 0;
+	size_t i= 2;
+	// (1) marker segments
+	while(i + 4 <= max)
+	{
+		if(p[i] != 0xFF) return 0;
+		unsigned char marker= p[i+1];
+		if(marker == 0xFF) { i++; continue; } // fill byte
+		size_t len= (p[i+2] << 8) | p[i+3];
+		// SOF0..SOF15 except DHT (C4), JPG (C8) and DAC (CC)
+		if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC && i + 9 <= max)
+		{
+			if(height) *height= (p[i+5] << 8) | p[i+6];
+			if(width) *width= (p[i+7] << 8) | p[i+8];
+		}
+		i += 2 + len;
+		if(marker == 0xDA) break; // SOS
+	}
+	// (2) entropy coded data: FF 00 is a stuffed byte and FF D0..D7 are restart markers
+	for(; i + 1 < max; i++)
+	{
+		if(p[i] != 0xFF) continue;
+		unsigned char marker= p[i+1];
+		if(marker == 0xD9) return (int) (i + 2); // EOI
+		if(marker == 0x00 || (marker >= 0xD0 && marker <= 0xD7) || marker == 0xFF) continue;
+		// any other marker: next scan of a progressive image
+		if(i + 4 > max) return 0;
+		i += 1 + ((p[i+2] << 8) | p[i+3]);
+	}
+	return 0;
+}
+
+// Index the frames of the file
+// YUYV: resolution is the one requested. MJPEG: resolution is taken from the first image
+int ReplaySource::SetWorkingMode(CaptureResolution res, char *preferred)
+{
+	offset.clear();
+	length.clear();
+	if(mjpeg)
+	{
+		int width= 0, height= 0;
+		size_t pos= 0;
+		while(pos < size)
+		{
+			int w, h;
+			int len= JPEGsize(&data[pos], size - pos, &w, &h);
+			if(len <= 0) break;
+			if(offset.size() == 0) { width= w; height= h; }
+			offset.push_back(pos);
+			length.push_back((size_t) len);
+			pos += len;
+			// skip padding between images (if any)
+			while(pos + 1 < size && !(data[pos] == 0xFF && data[pos+1] == 0xD8)) pos++;
+		}
+		wkm.width= width;
+		wkm.height= height;
+		wkm.pixelformat= V4L2_PIX_FMT_MJPEG;
+	}
+	else
+	{
+		size_t frame_sz= (size_t) res.width * res.height * 2;
+		for(size_t pos= 0; pos + frame_sz <= size; pos += frame_sz)
+		{
+			offset.push_back(pos);
+			length.push_back(frame_sz);
+		}
+		wkm.width= res.width;
+		wkm.height= res.height;
+		wkm.pixelformat= V4L2_PIX_FMT_YUYV;
+	}
+	wkm.field= V4L2_FIELD_NONE;
+	nframes= offset.size();
+	if(nframes == 0)
+	{
+		fprintf(stdout, "\nERROR: no %s frames found in replay file", mjpeg? "MJPEG" : "YUYV");
+		return -1;
+	}
+	return wkm.pixelformat;
+}
+
+// Frames are read from the mapped file. No buffer to allocate
+void* ReplaySource::AllocateBuffer(int nbuffers)
+{
+	if(!data || nframes == 0) return (void *) -1;
+	next= 0;
+	return data;
+}
+
+// Frames of the file are always ready: no wait
+int ReplaySource::CaptureImage(Frame *frame, int timeout_ms)
+{
+	if(next >= nframes)
+	{
+		if(!loop || nframes == 0) return -1;
+		next= 0;
+	}
+	frame->index= (int) next;
+	frame->ptr= &data[offset[next]];
+	frame->length= length[next];
+	// captured now, never lost
+	frame->sequence= sequence++;
+	frame->timestamp_us= clock_us(CLOCK_MONOTONIC);
+	frame->wallclock_us= clock_us(CLOCK_REALTIME);
+	frame->dropped= 0;
+	next++;
+	return 0;
+}
+
+// Frames live in the file mapping: nothing to count
+void ReplaySource::AcquireFrame(Frame *frame)
+{
+}
+
+void ReplaySource::ReleaseFrame(Frame *frame)
+{
+	frame->index= -1;
+	frame->ptr= 0;
+}
+
+/* END OF FILE */
@@ -0,0 +1,35 @@
+#ifndef REPLAY_HEADER_FILLE_H
+#define REPLAY_HEADER_FILLE_H
+
+#include <vector>
+#include "framesource.h"
+
+// Plays back a pre-recorded capture file as if it were a camera
+// The file is either:
+//	- raw YUYV: frames of width x height x 2 bytes one after another (resolution from the CLI)
+//	- MJPEG: JPEG images concatenated one after another (resolution from the first image)
+class ReplaySource : public FrameSource
+{
+	public:
+		ReplaySource(const char*);
+		~ReplaySource(void);
+		int SetWorkingMode(CaptureResolution , char* );
+		void* AllocateBuffer(int nbuffers);
+		int CaptureImage(Frame *, int timeout_ms= FRAME_WAIT_MS);
+		void AcquireFrame(Frame *);
+		void ReleaseFrame(Frame *);
+		bool loop;		// rewind at the end of the file. Otherwise CaptureImage fails at the end
+		size_t nframes;	// frames found in the file
+	private:
+		int JPEGsize(const unsigned char *, size_t, int *, int *);
+		unsigned char *data;
+		size_t size;
+		bool mjpeg;
+		size_t next;	// next frame to be returned
+		unsigned long sequence;	// frames returned (the file may be played more than once)
+		std::vector<size_t> offset;
+		std::vector<size_t> length;
+};
+
+#endif
+/* END OF FILE */
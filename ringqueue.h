@@ -0,0 +1,231 @@
+#ifndef RINGQUEUE_HEADER_FILLE_H
+#define RINGQUEUE_HEADER_FILLE_H
+
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#define RINGQUEUE_WAIT_MS	20
+
+// What Push does when the queue is full
+//	drop_oldest:	discard the oldest item queued to make room
+//	drop_newest:	discard the item being pushed
+//	drop_block:		wait until a consumer makes room
+enum DropPolicy {drop_oldest, drop_newest, drop_block};
+
+// Bounded multi-producer multi-consumer ring of items (frame handles)
+// Push and TryPop are lock-free (one sequence number per cell). The mutex is only taken to sleep when
+// a consumer finds the queue empty or a blocking producer finds it full.
+// Items discarded by the drop policy, or left in the queue on destruction, are handed to 'dispose'
+template <typename T>
+class RingQueue
+{
+	public:
+		RingQueue(size_t capacity, DropPolicy policy, void (*dispose)(T));
+		~RingQueue(void);
+		bool Push(T item);
+		bool Pop(T *item);
+		bool TryPop(T *item);
+		void Close(void);
+		size_t Depth(void);
+		size_t capacity;
+		DropPolicy policy;
+		std::atomic<size_t> high_water;
+		std::atomic<unsigned long> drops;
+	private:
+		bool TryPush(T item);
+		bool Dequeue(T *item);
+		void Wake(std::condition_variable &, std::atomic<int> &);
+		struct Cell
+		{
+			std::atomic<size_t> seq;
+			T data;
+		};
+		Cell *cells;
+		size_t mask;
+		std::atomic<size_t> tail;	// next cell to push
+		std::atomic<size_t> head;	// next cell to pop
+		std::atomic<bool> closed;
+		std::atomic<int> waiting_pop;
+		std::atomic<int> waiting_push;
+		std::mutex mtx;
+		std::condition_variable not_empty;
+		std::condition_variable not_full;
+		void (*dispose)(T);
+};
+
+template <typename T>
+RingQueue<T>::RingQueue(size_t n, DropPolicy p, void (*d)(T))
+{
+	// power of two
+	for(capacity= 1; capacity < n; capacity <<= 1);
+	mask= capacity - 1;
+	cells= new Cell[capacity];
+	for(size_t i=0; i<capacity; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+	tail= 0;
+	head= 0;
+	closed= false;
+	waiting_pop= 0;
+	waiting_push= 0;
+	high_water= 0;
+	drops= 0;
+	policy= p;
+	dispose= d;
+}
+
+template <typename T>
+RingQueue<T>::~RingQueue(void)
+{
+	T item;
+	while(TryPop(&item)) if(dispose) dispose(item);
+	delete [] cells;
+}
+
+template <typename T>
+bool RingQueue<T>::TryPush(T item)
+{
+	size_t pos= tail.load(std::memory_order_relaxed);
+	for(;;)
+	{
+		Cell *cell= &cells[pos & mask];
+		size_t seq= cell->seq.load(std::memory_order_acquire);
+		long dif= (long) seq - (long) pos;
+		if(dif == 0)
+		{
+			if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				cell->data= item;
+				cell->seq.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if(dif < 0) return false; // full
+		else pos= tail.load(std::memory_order_relaxed);
+	}
+}
+
+template <typename T>
+bool RingQueue<T>::Dequeue(T *item)
+{
+	size_t pos= head.load(std::memory_order_relaxed);
+	for(;;)
+	{
+		Cell *cell= &cells[pos & mask];
+		size_t seq= cell->seq.load(std::memory_order_acquire);
+		long dif= (long) seq - (long) (pos + 1);
+		if(dif == 0)
+		{
+			if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				*item= cell->data;
+				cell->seq.store(pos + mask + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if(dif < 0) return false; // empty
+		else pos= head.load(std::memory_order_relaxed);
+	}
+}
+
+template <typename T>
+bool RingQueue<T>::TryPop(T *item)
+{
+	if(!Dequeue(item)) return false;
+	Wake(not_full, waiting_push);
+	return true;
+}
+
+// Wake a sleeper. The lock makes sure a thread about to sleep does not miss the notification
+// (sleepers also wake up every RINGQUEUE_WAIT_MS as a safety net)
+// The fences pair with the ones of the sleepers (waiting++, then the cell checked again): without
+// them the release store of the cell and the load of 'waiting' may be reordered, and both sides
+// miss each other (a sleeper then waits for the safety net)
+template <typename T>
+void RingQueue<T>::Wake(std::condition_variable &cv, std::atomic<int> &waiting)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(waiting.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		cv.notify_all();
+	}
+}
+
+// returns false if the item was not queued (drop_newest or queue closed). The item is disposed of
+template <typename T>
+bool RingQueue<T>::Push(T item)
+{
+	bool queued= false;
+	while(!closed.load())
+	{
+		if(TryPush(item)) { queued= true; break; }
+		if(policy == drop_newest) break;
+		if(policy == drop_oldest)
+		{
+			T old;
+			if(TryPop(&old))
+			{
+				drops++;
+				if(dispose) dispose(old);
+			}
+			continue;
+		}
+		// drop_block
+		std::unique_lock<std::mutex> lock(mtx);
+		waiting_push++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while(!closed.load() && Depth() >= capacity) not_full.wait_for(lock, std::chrono::milliseconds(RINGQUEUE_WAIT_MS));
+		waiting_push--;
+	}
+	if(!queued)
+	{
+		drops++;
+		if(dispose) dispose(item);
+		return false;
+	}
+	size_t depth= Depth();
+	size_t hw= high_water.load();
+	while(depth > hw && !high_water.compare_exchange_weak(hw, depth));
+	Wake(not_empty, waiting_pop);
+	return true;
+}
+
+// Blocks until an item is available. returns false when the queue is closed and empty
+template <typename T>
+bool RingQueue<T>::Pop(T *item)
+{
+	if(TryPop(item)) return true;
+	bool got;
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		waiting_pop++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while(!(got= Dequeue(item)) && !closed.load()) not_empty.wait_for(lock, std::chrono::milliseconds(RINGQUEUE_WAIT_MS));
+		waiting_pop--;
+	}
+	if(got) Wake(not_full, waiting_push);
+	return got;
+}
+
+// No more items: wake every thread waiting on the queue
+template <typename T>
+void RingQueue<T>::Close(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	closed= true;
+	not_empty.notify_all();
+	not_full.notify_all();
+}
+
+template <typename T>
+size_t RingQueue<T>::Depth(void)
+{
+	size_t t= tail.load();
+	size_t h= head.load();
+	return t > h ? t - h : 0;
+}
+
+#endif
+/* END OF FILE */
@@ -0,0 +1,109 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * Capture scheduler
+ * 
+ * Frame k is due at t0 + k x period. The event loop waits for a timerfd armed at the deadline 
+ * (TFD_TIMER_ABSTIME), so the period does not drift with the work done per frame
+ **************************************************************************************************
+*/
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "scheduler.h"
+
+static long diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000L + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+static void add_us(struct timespec *t, long us)
+{
+	t->tv_sec += us / 1000000L;
+	t->tv_nsec += (us % 1000000L) * 1000;
+	if(t->tv_nsec >= 1000000000L) { t->tv_sec++; t->tv_nsec -= 1000000000L; }
+}
+
+CaptureScheduler::CaptureScheduler(void)
+{
+	tfd= -1;
+	Start(0, overrun_skip);
+}
+
+CaptureScheduler::~CaptureScheduler(void)
+{
+	if(tfd != -1) close(tfd);
+}
+
+// First deadline is now
+void CaptureScheduler::Start(long period, OverrunPolicy p)
+{
+	period_ms= period;
+	policy= p;
+	lateness_us= max_lateness_us= 0;
+	sum_lateness_us= 0;
+	frames= skipped= 0;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	if(tfd != -1) Arm();
+}
+
+// Timer file descriptor for the event loop. Readable when the next deadline is due (see Expired)
+int CaptureScheduler::TimerFd(void)
+{
+	if(tfd == -1)
+	{
+		tfd= timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if(tfd == -1) return -1;
+		Arm();
+	}
+	return tfd;
+}
+
+// The timer fired: account the deadline and arm the timer for the next one
+// returns the number of deadlines dropped before this one (skip policy)
+int CaptureScheduler::Expired(void)
+{
+	uint64_t expirations;
+	if(read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) return 0;
+	int dropped= Tick();
+	Arm();
+	return dropped;
+}
+
+// One-shot at the absolute deadline. A deadline already gone fires at once (catch-up and period 0)
+void CaptureScheduler::Arm(void)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value= deadline;
+	timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Deadline reached: lateness and next deadline
+int CaptureScheduler::Tick(void)
+{
+	int dropped= 0;
+	struct timespec now;
+	if(period_ms > 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		lateness_us= diff_us(&now, &deadline);
+		// overrun: one or more full periods behind
+		if(policy == overrun_skip && lateness_us >= period_ms * 1000)
+		{
+			dropped= (int) (lateness_us / (period_ms * 1000));
+			add_us(&deadline, dropped * period_ms * 1000);
+			lateness_us -= dropped * period_ms * 1000;
+			skipped += dropped;
+		}
+		add_us(&deadline, period_ms * 1000);
+	}
+	else lateness_us= 0;
+	frames++;
+	sum_lateness_us += lateness_us;
+	if(lateness_us > max_lateness_us) max_lateness_us= lateness_us;
+	return dropped;
+}
+
+/* END OF FILE */
@@ -0,0 +1,36 @@
+#ifndef SCHEDULER_HEADER_FILLE_H
+#define SCHEDULER_HEADER_FILLE_H
+
+#include <time.h>
+
+// What to do when a frame starts later than one capture period after its deadline
+//	skip:		drop the deadlines already gone and keep on the original time grid
+//	catchup:	run the missed deadlines back to back until the schedule is met again
+enum OverrunPolicy {overrun_skip, overrun_catchup};
+
+// Capture cadence based on absolute deadlines: t0 + k x period (CLOCK_MONOTONIC)
+// Time spent capturing, compressing, storing or uploading does not add up to the period
+class CaptureScheduler
+{
+	public:
+		CaptureScheduler(void);
+		~CaptureScheduler(void);
+		void Start(long period_ms, OverrunPolicy);
+		int TimerFd(void);
+		int Expired(void);
+		long lateness_us;		// current frame: start time - deadline
+		long max_lateness_us;
+		double sum_lateness_us;
+		unsigned long frames;	// deadlines served
+		unsigned long skipped;	// deadlines dropped (skip policy)
+		long period_ms;
+		OverrunPolicy policy;
+	private:
+		int Tick(void);
+		void Arm(void);
+		struct timespec deadline;
+		int tfd;
+};
+
+#endif
+/* END OF FILE */
@@ -0,0 +1,291 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * Shared memory ring of JPEG images
+ *
+ * tlcam writes every image into a ring of slots in a POSIX shared memory object; local processes map
+ * it and take the newest image in place, with seqlocks to tell a slot being rewritten and a futex to
+ * sleep until the next image
+ **************************************************************************************************
+*/
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shmring.h"
+
+// Slots start on a cache line
+#define HEADER_BYTES	((sizeof(ShmRingHeader) + 63) & ~(size_t) 63)
+
+// Shared (not private) futex: the word is in memory mapped by several processes
+static int futex(std::atomic<uint32_t> *word, int op, uint32_t val, const struct timespec *timeout)
+{
+	return (int) syscall(SYS_futex, (uint32_t *) word, op, val, timeout, 0, 0);
+}
+
+ShmRingWriter::ShmRingWriter(void)
+{
+	written= 0;
+	too_large= 0;
+	name= 0;
+	header= 0;
+	base= 0;
+	map_size= 0;
+}
+
+ShmRingWriter::~ShmRingWriter(void)
+{
+	Close();
+}
+
+// Ring made from scratch: an old one left by a crash is removed first (its readers keep their mapping)
+int ShmRingWriter::Create(const char *n, int nslots, size_t slot_size, int width, int height)
+{
+	if(nslots < 1) nslots= 1;
+	size_t stride= (sizeof(ShmRingSlot) + slot_size + 63) & ~(size_t) 63;
+	map_size= HEADER_BYTES + stride * nslots;
+	shm_unlink(n);
+	int fd= shm_open(n, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd == -1)
+	{
+		perror("ERROR: shared memory ring");
+		return -1;
+	}
+	if(ftruncate(fd, (off_t) map_size) == -1)
+	{
+		perror("ERROR: shared memory ring size");
+		close(fd);
+		shm_unlink(n);
+		return -1;
+	}
+	void *p= mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+	{
+		perror("ERROR: shared memory ring mapping");
+		shm_unlink(n);
+		return -1;
+	}
+	name= n;
+	base= (uint8_t *) p;
+	// memory of a new object is zero: slots are empty (seq 0, size 0)
+	header= (ShmRingHeader *) base;
+	header->version= SHMRING_VERSION;
+	header->nslots= (uint32_t) nslots;
+	header->slot_size= (uint32_t) slot_size;
+	header->slot_stride= (uint32_t) stride;
+	header->width= (uint32_t) width;
+	header->height= (uint32_t) height;
+	header->writer_pid= (uint32_t) getpid();
+	// readers check the magic number last
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic= SHMRING_MAGIC;
+	return 0;
+}
+
+int ShmRingWriter::Write(const void *jpeg, size_t size, unsigned long sequence, int64_t timestamp_us, int64_t wallclock_us)
+{
+	if(!header) return -1;
+	if(size > header->slot_size)
+	{
+		too_large++;
+		return -1;
+	}
+	uint32_t h= header->head.load(std::memory_order_relaxed);
+	ShmRingSlot *slot= (ShmRingSlot *) (base + HEADER_BYTES + (size_t) header->slot_stride * (h % header->nslots));
+	// seqlock: odd while the slot is written
+	uint32_t s= slot->seq.load(std::memory_order_relaxed);
+	slot->seq.store(s + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot->frame= h;
+	slot->size= (uint32_t) size;
+	slot->sequence= (uint32_t) sequence;
+	slot->timestamp_us= timestamp_us;
+	slot->wallclock_us= wallclock_us;
+	memcpy((uint8_t *) (slot + 1), jpeg, size);
+	slot->seq.store(s + 2, std::memory_order_release);
+	header->head.store(h + 1, std::memory_order_release);
+	// readers asleep are woken (readers cannot say they are waiting: their mapping is read-only)
+	header->notify++;
+	futex(&header->notify, FUTEX_WAKE, INT_MAX, 0);
+	written++;
+	return 0;
+}
+
+// Readers are told the writer is gone. The object is removed: readers keep their mapping until
+// they detach and a new tlcam makes a new one
+void ShmRingWriter::Close(void)
+{
+	if(!header) return;
+	header->closed= 1;
+	header->notify++;
+	futex(&header->notify, FUTEX_WAKE, INT_MAX, 0);
+	munmap(base, map_size);
+	shm_unlink(name);
+	header= 0;
+	base= 0;
+}
+
+void ShmRingWriter::PrintStats(FILE *fp)
+{
+	fprintf(fp, "\nShared memory ring %s: %lu images, %lu too large for a slot", name ? name : "", written, too_large);
+}
+
+ShmRingReader::ShmRingReader(void)
+{
+	header= 0;
+	seen= 0;
+	missed= 0;
+	base= 0;
+	map_size= 0;
+}
+
+ShmRingReader::~ShmRingReader(void)
+{
+	if(base) munmap(base, map_size);
+}
+
+int ShmRingReader::Attach(const char *name)
+{
+	int fd= shm_open(name, O_RDONLY, 0);
+	if(fd == -1)
+	{
+		perror("ERROR: shared memory ring (is tlcam running with option shm?)");
+		return -1;
+	}
+	struct stat st;
+	if(fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(ShmRingHeader))
+	{
+		fprintf(stdout, "\nERROR: shared memory ring is not ready");
+		close(fd);
+		return -1;
+	}
+	map_size= (size_t) st.st_size;
+	void *p= mmap(0, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+	{
+		perror("ERROR: shared memory ring mapping");
+		return -1;
+	}
+	base= (uint8_t *) p;
+	header= (const ShmRingHeader *) base;
+	if(header->magic != SHMRING_MAGIC || header->version != SHMRING_VERSION ||
+		HEADER_BYTES + (size_t) header->slot_stride * header->nslots > map_size)
+	{
+		fprintf(stdout, "\nERROR: shared memory ring is not ready or of another version");
+		munmap(base, map_size);
+		base= 0;
+		header= 0;
+		return -1;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	seen= 0;
+	missed= 0;
+	return 0;
+}
+
+ShmRingSlot *ShmRingReader::Slot(uint32_t frame)
+{
+	return (ShmRingSlot *) (base + HEADER_BYTES + (size_t) header->slot_stride * (frame % header->nslots));
+}
+
+// Newest image, in the shared memory
+// Returns 1 with the image in 'f', 0 when no image newer than the last one read, -1 when the slot is
+// being rewritten (try again)
+int ShmRingReader::Peek(ShmFrame *f)
+{
+	uint32_t h= ((ShmRingHeader *) header)->head.load(std::memory_order_acquire);
+	if(h == seen) return 0;
+	ShmRingSlot *slot= Slot(h - 1);
+	uint32_t s= slot->seq.load(std::memory_order_acquire);
+	if(s & 1) return -1;
+	f->frame= slot->frame;
+	f->size= slot->size;
+	f->sequence= slot->sequence;
+	f->timestamp_us= slot->timestamp_us;
+	f->wallclock_us= slot->wallclock_us;
+	f->data= (const uint8_t *) (slot + 1);
+	f->slot= (h - 1) % header->nslots;
+	f->seq= s;
+	if(!Check(f) || f->frame != h - 1 || f->size > header->slot_size) return -1;
+	// seen from here: images between the last one read and this one were missed
+	if(seen && h - seen > 1) missed+= h - seen - 1;
+	seen= h;
+	return 1;
+}
+
+// The image of 'f' has not been rewritten since Peek
+bool ShmRingReader::Check(const ShmFrame *f)
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	ShmRingSlot *slot= Slot(f->frame);
+	return slot->seq.load(std::memory_order_relaxed) == f->seq;
+}
+
+// Newest image copied into 'copy' (f->data points to the copy)
+// Returns 1 with an image, 0 when no new image
+int ShmRingReader::Read(ShmFrame *f, std::vector<uint8_t> *copy)
+{
+	for(;;)
+	{
+		uint32_t last= seen;
+		unsigned long m= missed;
+		int r= Peek(f);
+		if(r == 0) return 0;
+		if(r < 0) continue;
+		if(copy->size() < f->size) copy->resize(f->size);
+		memcpy(&(*copy)[0], f->data, f->size);
+		if(Check(f))
+		{
+			f->data= &(*copy)[0];
+			return 1;
+		}
+		// rewritten while copied: take the newer image
+		seen= last;
+		missed= m;
+	}
+}
+
+// Until an image newer than the last one read is in the ring (0), or timeout_ms (-1: forever) goes
+// by or the writer exits (-1)
+int ShmRingReader::Wait(int timeout_ms)
+{
+	ShmRingHeader *hd= (ShmRingHeader *) header;
+	struct timespec deadline, ts;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec+= timeout_ms / 1000;
+	deadline.tv_nsec+= (long) (timeout_ms % 1000) * 1000000;
+	if(deadline.tv_nsec >= 1000000000) { deadline.tv_sec++; deadline.tv_nsec-= 1000000000; }
+	for(;;)
+	{
+		uint32_t v= hd->notify.load();
+		if(hd->head.load() != seen) return 0;
+		if(hd->closed.load()) return -1;
+		struct timespec *timeout= 0;
+		if(timeout_ms >= 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			long ns= (deadline.tv_sec - ts.tv_sec) * 1000000000L + deadline.tv_nsec - ts.tv_nsec;
+			if(ns <= 0) return -1;
+			ts.tv_sec= ns / 1000000000L;
+			ts.tv_nsec= ns % 1000000000L;
+			timeout= &ts;
+		}
+		// sleeps unless 'notify' moved on since it was read (FUTEX_WAIT only reads the word)
+		futex(&hd->notify, FUTEX_WAIT, v, timeout);
+	}
+}
+
+bool ShmRingReader::Closed(void)
+{
+	return header && ((ShmRingHeader *) header)->closed.load();
+}
+
+/* END OF FILE */
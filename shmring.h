@@ -0,0 +1,116 @@
+#ifndef SHMRING_HEADER_FILLE_H
+#define SHMRING_HEADER_FILLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// Shared memory ring of JPEG images for local readers (web player helpers, analytics)
+// POSIX shared memory object (/dev/shm/tlcam) written by tlcam and mapped read-only by any number of
+// reader processes: the newest image is picked up with no file I/O and no copy
+//
+// Layout: ShmRingHeader, then 'nslots' slots of 'slot_stride' bytes, each a ShmRingSlot followed by
+// up to 'slot_size' bytes of JPEG image
+// Every slot is a seqlock: 'seq' is odd while the writer fills the slot and goes up by two when done.
+// A reader takes 'seq' (even), reads the image and takes 'seq' again: the image is good when both are
+// the same. 'head' counts the images written, the newest one is in slot (head - 1) % nslots
+// 'notify' goes up with every image (and when the writer exits): readers sleep on it with a futex
+// Readers map the ring read-only, so they may run as another user (e.g. the web server)
+// Counters are 32 bits, lock free on every CPU that runs tlcam (the Pi Zero has no 64 bit atomics)
+#define SHMRING_NAME	"/tlcam"
+#define SHMRING_MAGIC	0x474e5254	// "TRNG"
+#define SHMRING_VERSION	1
+#define SHMRING_SLOTS	8
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared memory ring needs lock free 32 bit atomics");
+
+struct ShmRingHeader
+{
+	uint32_t magic;				// SHMRING_MAGIC once the ring is ready
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t slot_size;			// JPEG bytes a slot takes
+	uint32_t slot_stride;		// bytes from one slot to the next
+	uint32_t width;
+	uint32_t height;
+	uint32_t writer_pid;
+	std::atomic<uint32_t> head;		// images written
+	std::atomic<uint32_t> notify;	// futex word
+	std::atomic<uint32_t> closed;	// the writer has exited
+};
+
+struct ShmRingSlot
+{
+	std::atomic<uint32_t> seq;	// seqlock, odd while written
+	uint32_t frame;				// 'head' of the image (image number)
+	uint32_t size;				// JPEG bytes
+	uint32_t sequence;			// capture sequence number of the source
+	int64_t timestamp_us;		// capture time, CLOCK_MONOTONIC
+	int64_t wallclock_us;		// capture time, CLOCK_REALTIME
+	// JPEG image follows
+};
+
+// Image of the ring as seen by a reader
+// data points into the shared memory: the image is only good while Check says so (or use Read)
+struct ShmFrame
+{
+	const uint8_t *data;
+	size_t size;
+	uint32_t frame;
+	unsigned long sequence;
+	int64_t timestamp_us;
+	int64_t wallclock_us;
+	uint32_t slot;
+	uint32_t seq;
+};
+
+// Writer side (tlcam). One writing thread
+// Images larger than a slot are not written (counted in too_large)
+class ShmRingWriter
+{
+	public:
+		ShmRingWriter(void);
+		~ShmRingWriter(void);
+		int Create(const char *name, int nslots, size_t slot_size, int width, int height);
+		int Write(const void *jpeg, size_t size, unsigned long sequence, int64_t timestamp_us, int64_t wallclock_us);
+		void Close(void);
+		void PrintStats(FILE *);
+		unsigned long written;
+		unsigned long too_large;
+	private:
+		const char *name;
+		ShmRingHeader *header;
+		uint8_t *base;
+		size_t map_size;
+};
+
+// Reader side
+//	Attach maps the ring read-only
+//	Peek: newest image not seen yet, in place (zero copy), to be confirmed with Check once used
+//	Read: newest image not seen yet, copied
+//	Wait: sleeps until there is an image not seen yet
+// 'missed' counts the images the reader was too slow for
+class ShmRingReader
+{
+	public:
+		ShmRingReader(void);
+		~ShmRingReader(void);
+		int Attach(const char *name= SHMRING_NAME);
+		int Peek(ShmFrame *);
+		bool Check(const ShmFrame *);
+		int Read(ShmFrame *, std::vector<uint8_t> *copy);
+		int Wait(int timeout_ms);
+		bool Closed(void);
+		const ShmRingHeader *header;
+		uint32_t seen;			// 'head' of the newest image read
+		unsigned long missed;
+	private:
+		ShmRingSlot *Slot(uint32_t);
+		uint8_t *base;
+		size_t map_size;
+};
+
+#endif
+/* END OF FILE */
@@ -0,0 +1,162 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * Slot ring storage
+ *
+ * Images are written over a fixed ring of files opened once, and the newest one is announced by
+ * atomically replacing the data file: no open, truncate and close of every file frame after frame,
+ * and players never read a data file or an image half written
+ **************************************************************************************************
+*/
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "slotstore.h"
+
+static const char *slot_names[SLOT_FILES]= {"image_%03d.jpg", "preview_%03d.jpg", "thumb_%03d.jpg"};
+
+// 'dir' ends with '/'
+SlotStore::SlotStore(const char *d, const char *data, int n)
+{
+	nslots= n < 1 ? 1 : n > SLOTS_MAX ? SLOTS_MAX : n;
+	written= 0;
+	published= 0;
+	errors= 0;
+	links= true;
+	dir= d;
+	datafile= Path(data);
+	tmpfile= Path(".data.tmp");
+	for(int k=0; k<SLOT_FILES; k++)
+	{
+		fds[k].assign(nslots, -1);
+		sizes[k].assign(nslots, 0);
+	}
+}
+
+SlotStore::~SlotStore(void)
+{
+	for(int k=0; k<SLOT_FILES; k++)
+		for(int i=0; i<nslots; i++)
+			if(fds[k][i] != -1) close(fds[k][i]);
+}
+
+std::string SlotStore::Path(const char *name)
+{
+	return dir + name;
+}
+
+// Slot files opened (created when missing) and the publish files made: .data_NNN.txt holds image_NNN.jpg
+int SlotStore::Open(bool ladder)
+{
+	char name[64];
+	for(int k=0; k<(ladder ? SLOT_FILES : 1); k++)
+		for(int i=0; i<nslots; i++)
+		{
+			snprintf(name, sizeof(name), slot_names[k], i);
+			int fd= open(Path(name).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+			if(fd == -1)
+			{
+				perror(("ERROR: cannot open " + Path(name)).c_str());
+				return -1;
+			}
+			struct stat st;
+			fds[k][i]= fd;
+			sizes[k][i]= fstat(fd, &st) == 0 ? (size_t) st.st_size : 0;
+		}
+	pubfiles.resize(nslots);
+	for(int i=0; i<nslots; i++)
+	{
+		snprintf(name, sizeof(name), ".data_%03d.txt", i);
+		pubfiles[i]= Path(name);
+		int fd= open(pubfiles[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(fd == -1)
+		{
+			perror(("ERROR: cannot open " + pubfiles[i]).c_str());
+			return -1;
+		}
+		snprintf(name, sizeof(name), slot_names[slot_image], i);
+		ssize_t r= write(fd, name, strlen(name));
+		close(fd);
+		if(r != (ssize_t) strlen(name)) return -1;
+	}
+	// left over by a run that was killed while publishing
+	unlink(tmpfile.c_str());
+	return 0;
+}
+
+// The file gets the capture time of the frame as modification time (wallclock_us), so players see
+// when the image was taken (HTTP Last-Modified) rather than when it was written
+int SlotStore::Write(SlotFile k, unsigned int slot, const void *data, size_t size, int64_t wallclock_us)
+{
+	if((int) slot >= nslots || fds[k][slot] == -1) return -1;
+	int fd= fds[k][slot];
+	const char *p= (const char *) data;
+	for(size_t done= 0; done < size; )
+	{
+		ssize_t r= pwrite(fd, p + done, size - done, (off_t) done);
+		if(r == -1 && errno == EINTR) continue;
+		if(r <= 0)
+		{
+			errors++;
+			return -1;
+		}
+		done+= (size_t) r;
+	}
+	// a smaller image than the one in the file: cut the tail
+	if(size < sizes[k][slot] && ftruncate(fd, (off_t) size) == -1)
+	{
+		errors++;
+		return -1;
+	}
+	sizes[k][slot]= size;
+	struct timespec times[2];
+	times[0].tv_sec= 0;
+	times[0].tv_nsec= UTIME_OMIT;
+	times[1].tv_sec= (time_t) (wallclock_us / 1000000);
+	times[1].tv_nsec= (long) (wallclock_us % 1000000) * 1000;
+	futimens(fd, times);
+	written++;
+	return 0;
+}
+
+// The data file names the image of 'slot'
+int SlotStore::Publish(unsigned int slot)
+{
+	if((int) slot >= (int) pubfiles.size()) return -1;
+	if(links && link(pubfiles[slot].c_str(), tmpfile.c_str()) == -1)
+	{
+		// left over by a publish that failed
+		bool retry= errno == EEXIST && unlink(tmpfile.c_str()) == 0;
+		if(!retry || link(pubfiles[slot].c_str(), tmpfile.c_str()) == -1) links= false;
+	}
+	if(!links)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), slot_names[slot_image], slot);
+		int fd= open(tmpfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(fd == -1 || write(fd, name, strlen(name)) != (ssize_t) strlen(name))
+		{
+			if(fd != -1) close(fd);
+			errors++;
+			return -1;
+		}
+		close(fd);
+	}
+	if(rename(tmpfile.c_str(), datafile.c_str()) == -1)
+	{
+		errors++;
+		return -1;
+	}
+	published++;
+	return 0;
+}
+
+void SlotStore::PrintStats(FILE *fp)
+{
+	fprintf(fp, "\nStorage: %d slots in %s, %lu files written, %lu published (%s), %lu errors", nslots, dir.c_str(), written, published,
+		links ? "hard link" : "rename", errors);
+}
+
+/* END OF FILE */
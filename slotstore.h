@@ -0,0 +1,49 @@
+#ifndef SLOTSTORE_HEADER_FILLE_H
+#define SLOTSTORE_HEADER_FILLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#define SLOTS_DEFAULT	20
+#define SLOTS_MAX		1000	// file names have 3 digits
+
+// Files of a slot: the image and its output ladder (option ladder)
+enum SlotFile {slot_image, slot_preview, slot_thumb};
+#define SLOT_FILES		3
+
+// Local storage: a ring of 'nslots' image files, image_000.jpg ... , opened once
+// An image is written over the file of its slot (pwrite, ftruncate when smaller) and then published:
+// the data file (data.txt) is atomically replaced (rename) by a hard link to a file made at start-up
+// with the name of the slot, so a player polling it never reads it half written or empty, and a
+// player that follows it never gets an image being written unless it is nslots - 1 images behind
+// Filesystems with no hard links get the name written to a temporary file that is renamed
+// Not thread safe: one writer (the capture loop or the disk sink)
+class SlotStore
+{
+	public:
+		SlotStore(const char *dir, const char *datafile, int nslots);
+		~SlotStore(void);
+		int Open(bool ladder);
+		int Write(SlotFile, unsigned int slot, const void *data, size_t size, int64_t wallclock_us);
+		int Publish(unsigned int slot);
+		void PrintStats(FILE *);
+		int nslots;
+		unsigned long written;		// files
+		unsigned long published;
+		unsigned long errors;
+	private:
+		std::string Path(const char *name);
+		std::string dir;
+		std::string datafile;
+		std::string tmpfile;
+		std::vector<std::string> pubfiles;	// per slot, the content of the data file
+		std::vector<int> fds[SLOT_FILES];	// -1 if not open
+		std::vector<size_t> sizes[SLOT_FILES];
+		bool links;		// publish with hard links
+};
+
+#endif
+/* END OF FILE */
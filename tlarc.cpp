@@ -0,0 +1,141 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * tlarc: reads the archive of tlcam (option archive=DIR)
+ *
+ * e.g.:
+ *		tlarc /data/archive							-> segments, images and time ranges
+ *		tlarc /data/archive at=20261017-120000		-> image taken at (or first after) noon into
+ *													   image.jpg
+ *		tlarc /data/archive avi=day.avi from=20261017-060000 to=20261017-210000 fps=25
+ *													-> the images of the day as an MJPEG AVI
+ * Times are local time, YYYYMMDD-HHMMSS
+ **************************************************************************************************
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "archive.h"
+
+static void usage(void)
+{
+	printf("\n");
+	printf("Usage:\n"
+		"tlarc DIR [options]\n"
+		"   DIR       - archive directory of tlcam (option archive=DIR). Alone: shows its segments\n"
+		"Options are:\n"
+		"   at=T      - image taken at time T (or the first one after) into a JPEG file\n"
+		"   out=F     - JPEG file of at=T (default image.jpg)\n"
+		"   avi=F     - images into an MJPEG AVI file F\n"
+		"   from=T    - avi: first image taken at time T (default the first one)\n"
+		"   to=T      - avi: images taken before time T (default up to the last one)\n"
+		"   fps=N     - avi: played at N images per second (default 25)\n"
+		"   step=N    - avi: one image every N (default 1)\n"
+		"Times T are local time, YYYYMMDD-HHMMSS (e.g. 20261017-120000)\n"
+		"\n");
+}
+
+// YYYYMMDD-HHMMSS local time into microseconds since the epoch
+static int64_t parse_time(const char *str)
+{
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	const char *end= strptime(str, "%Y%m%d-%H%M%S", &tm);
+	if(!end || *end)
+	{
+		fprintf(stdout, "\nERROR: time %s is not YYYYMMDD-HHMMSS\n", str);
+		exit(EXIT_FAILURE);
+	}
+	tm.tm_isdst= -1;
+	return (int64_t) mktime(&tm) * 1000000;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir= 0;
+	const char *at= 0;
+	const char *out= "image.jpg";
+	const char *avi= 0;
+	const char *from= 0;
+	const char *to= 0;
+	int fps= 25;
+	int step= 1;
+	for(int i=1; i<argc; i++)
+	{
+		const char *str= argv[i];
+		if(strncmp(str, "at=", strlen("at="))==0) at= &str[strlen("at=")];
+		else if(strncmp(str, "out=", strlen("out="))==0) out= &str[strlen("out=")];
+		else if(strncmp(str, "avi=", strlen("avi="))==0) avi= &str[strlen("avi=")];
+		else if(strncmp(str, "from=", strlen("from="))==0) from= &str[strlen("from=")];
+		else if(strncmp(str, "to=", strlen("to="))==0) to= &str[strlen("to=")];
+		else if(strncmp(str, "fps=", strlen("fps="))==0) fps= atoi(&str[strlen("fps=")]);
+		else if(strncmp(str, "step=", strlen("step="))==0) step= atoi(&str[strlen("step=")]);
+		else if(!dir && !strchr(str, '=')) dir= str;
+		else
+		{
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(!dir)
+	{
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	ArchiveReader archive;
+	if(archive.Open(dir) != 0)
+	{
+		fprintf(stdout, "\n");
+		exit(EXIT_FAILURE);
+	}
+	if(!at && !avi)
+	{
+		archive.PrintInfo(stdout);
+		exit(EXIT_SUCCESS);
+	}
+
+	ArchiveFrame f;
+	if(at)
+	{
+		long n= archive.Seek(parse_time(at));
+		if(archive.Get(n, &f) != 0)
+		{
+			fprintf(stdout, "ERROR: no image at or after %s\n", at);
+			exit(EXIT_FAILURE);
+		}
+		FILE *fp= fopen(out, "wb");
+		if(!fp)
+		{
+			perror(out);
+			exit(EXIT_FAILURE);
+		}
+		fwrite(f.data, 1, f.size, fp);
+		fclose(fp);
+		time_t t= (time_t) (f.wallclock_us / 1000000);
+		char str[32];
+		strftime(str, sizeof(str), "%Y%m%d-%H%M%S", localtime(&t));
+		fprintf(stdout, "%s: image %ld #%lu taken %s, %lu bytes\n", out, n, f.sequence, str, (unsigned long) f.size);
+	}
+	if(avi)
+	{
+		long first= from ? archive.Seek(parse_time(from)) : 0;
+		long last= to ? archive.Seek(parse_time(to)) : archive.Count();
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		long n= archive_export_avi(&archive, first, last, fps, step, avi);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if(n < 0)
+		{
+			fprintf(stdout, "\n");
+			exit(EXIT_FAILURE);
+		}
+		double elapsed= (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		fprintf(stdout, "%s: %ld images %dx%d at %d fps (%.1f s of video) in %.2f s\n", avi, n, archive.width, archive.height, fps < 1 ? 1 : fps,
+			(double) n / (fps < 1 ? 1 : fps), elapsed);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/* END OF FILE */
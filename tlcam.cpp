@@ -23,9 +23,6 @@
 * In case you need guidance about how to create the RAM disk check instructions at www.iambobot.com.
 * Change the #define IMAGE_STORAGE_PATH in the .h file to point to your storage.
 *
-* LIMITATIONS
-* - YUYV display needs some debugging
-*
 * VERSION 
 * (See version.cpp)
 * 01.00.00 - release candidate	
@@ -51,46 +48,55 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <jpeglib.h>    
 #include <jerror.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <mutex>
 using namespace std;
 #include <linux/fb.h> // frame buffer
 #include <cmath>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 
 #include "HTTPpost.h"
 #include "glib.h"
 #include "tlcam.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "reactor.h"
+#include "pipeline.h"
+#include "jpegenc.h"
+#include "yuyv.h"
+#include "framepool.h"
+#include "ratecontrol.h"
+#include "motion.h"
+#include "fbdisplay.h"
+#include "ladder.h"
+#include "slotstore.h"
+#include "shmring.h"
+#include "archive.h"
 
 char *version(char *str, size_t max_sz);
-const char fulldatafilename[] =IMAGE_STORAGE_PATH DATA_FILE;	
 CaptureResolution *CapResolution;
 
-// Memory buffer to store the JPEG decompressed image
-// Keep a permanet buffer and resize as needed and 
-// avoid calling malloc and free for each image
-// called from: JPEG_decompress
-unsigned char *gmemptr;
-size_t gmemsize;
-unsigned char *gmemalloc(size_t sz)
-{
-	if(sz>gmemsize)
-	{
-		fprintf(stdout, "*** gmemalloc malloc %d\n", sz);
-		if(gmemptr) free(gmemptr);
-		gmemptr= (unsigned char *) malloc( sizeof(char) * sz + 1024 );
-		if(!gmemptr) 
-		{
-			fprintf(stderr, "\nERROR malloc %d", sz); 
-			gmemsize= 0;
-		}
-		else gmemsize= sz;
-	}
-	return gmemptr;
-}
+// Image memory: slabs allocated once for the working mode (framepool.h)
+//	jpegpool:	JPEG images (YUYV encoded or MJPEG copied for the pipeline)
+//	previewpool, thumbpool:	preview and thumbnail JPEG images (option ladder)
+// JPEG images for the display are decoded straight into the framebuffer (JPEG_decompress_fb)
+FramePool *jpegpool= 0;
+FramePool *previewpool= 0;
+FramePool *thumbpool= 0;
+// Local storage: ring of image files (slotstore.h). 0 with cloud
+SlotStore *storage= 0;
+// Images for local processes: shared memory ring (shmring.h, option shm). 0 if none
+ShmRingWriter *shmring= 0;
+// Every image kept, appended to segment files (archive.h, option archive=DIR). 0 if none
+ArchiveWriter *archive= 0;
 
 
 // 	 _________
@@ -106,12 +112,32 @@ unsigned char *gmemalloc(size_t sz)
 // 		- Jay Rambhia (https://gist.github.com/jayrambhia/5866483)
 #define MAX_CAP_FOURCC	32
 #define MAX_V4L_FORMATS 32
+#define MAX_V4L_FRAMESIZES	64
+#define MAX_V4L_INTERVALS	8
+#define CAPS_CACHE_VERSION	2	// format of the capabilities cache: a cache of another format is probed again
+#define V4L_DEFAULT_BUFFERS	4
+#define V4L_MAX_BUFFERS		16
+// Frame size supported for a pixel format (VIDIOC_ENUM_FRAMESIZES) and its frame intervals (VIDIOC_ENUM_FRAMEINTERVALS)
+// stepwise sizes keep the maximum size only
+// interval_range: the intervals are a continuous or stepwise range, interval[0] to interval[1] in steps
+// of interval[2] (0/0 for continuous)
+struct V4LFrameSize
+{
+	unsigned int pixelformat;
+	int width;
+	int height;
+	bool stepwise;
+	bool interval_range;
+	int nintervals;
+	struct v4l2_fract interval[MAX_V4L_INTERVALS];
+};
 struct V4LDriverCameraInformation
 {
 	char driver[32];
 	char card[64];
 	char bus_info[64];
-	char version[8];
+	char version[16];
+	unsigned int version_code;
 	unsigned int capabilities;
 	char bounds[16];
 	char defrect[16];
@@ -126,46 +152,82 @@ struct V4LDriverCameraInformation
 		bool jpeg;
 	} format;
 	int V4L_formats[MAX_V4L_FORMATS];
+	struct V4LFrameSize framesizes[MAX_V4L_FRAMESIZES];
+	int nframesizes;
+};
+
+// Streaming buffer mapped from the driver
+// refs counts the consumers holding the buffer. The buffer is given back to the driver (VIDIOC_QBUF) 
+// when the last consumer releases it
+struct V4LBuffer
+{
+	void *start;
+	size_t length;
+	size_t bytesused;
+	int refs;
+	bool queued;
+	// frame in the buffer (VIDIOC_DQBUF)
+	unsigned long sequence;
+	int64_t timestamp_us;	// CLOCK_MONOTONIC
+	int64_t wallclock_us;	// CLOCK_REALTIME
 };
 
-class V4L_device
+class V4L_device : public FrameSource
 {
 	public:
 		V4L_device(const char*);
 		~V4L_device(void);
 		int SetWorkingMode(CaptureResolution , char* );
-		void* AllocateBuffer(void);
-		int CaptureImage(void);	
+		int SetFrameInterval(long period_ms);
+		void* AllocateBuffer(int nbuffers= V4L_DEFAULT_BUFFERS);
+		int CaptureImage(Frame *, int timeout_ms= FRAME_WAIT_MS);
+		void AcquireFrame(Frame *);
+		void ReleaseFrame(Frame *);
+		int PollFd(void);
+		int FrameReady(void);
 		void printinfo(void);
 		int GetDriverInfo(void);
 		struct V4LDriverCameraInformation drvinfo;			
-		void *ptr_capture_buffer;
-		size_t capture_length;
-		int dev; // copy of private camera
-		// Working mode
-		struct 
-		{
-			int width;
-			int height;
-			int field;
-			int pixel_size;
-			unsigned int pixelformat;
-		} wkm;
+		int nbuffers;	// number of mmap buffers granted by the driver
+		struct v4l2_fract interval;	// frame interval set with SetFrameInterval (0/0: camera default)
+		bool use_cache;	// take the supported formats from the capabilities cache file (CAPS_CACHE_PATH)
 	private:
 		
-		int GetSupportedFormats(void);
+		int GetSupportedFormats(bool refresh= false);
+		int EnumerateFormats(void);
+		void AddFormat(unsigned int);
+		void CacheFileName(char *, size_t);
+		int LoadCapabilities(const char *);
+		int SaveCapabilities(const char *);
 		int xioctl(int , void *);
+		int QueueBuffer(int);
+		int DequeueAll(void);
+		int StreamOn(void);
+		void StreamOff(void);
 		int camera;	// file descriptor (open)
-		struct v4l2_buffer v4l_buf;		
+		bool streaming;
+		int latest;	// newest buffer dequeued and not handed out yet (-1 if none)
+		int64_t last_sequence;	// of the last buffer dequeued (-1: none since STREAMON)
+		unsigned int lost;	// sequence gaps since the last frame handed out: frames the driver dropped
+		struct V4LBuffer buffers[V4L_MAX_BUFFERS];
+		std::mutex mtx;	// buffers and latest: frames are released from the pipeline threads
 };
 
 V4L_device::V4L_device(const char *path)
 {
 //	fprintf(stdout, "\nV4L_device create %s", path);
-	ptr_capture_buffer= 0;
-	memset(&v4l_buf, 0, sizeof(struct v4l2_buffer));
+	nbuffers= 0;
+	interval.numerator= 0;
+	interval.denominator= 0;
+	streaming= false;
+	latest= -1;
+	last_sequence= -1;
+	lost= 0;
+	use_cache= true;
+	memset(&buffers, 0, sizeof(buffers));
 	memset(&drvinfo, 0, sizeof(struct V4LDriverCameraInformation)); 
-	dev= camera = open(path, O_RDWR);
+	// non-blocking so that CaptureImage can drain the driver queue and keep the latest frame
+	dev= camera = open(path, O_RDWR | O_NONBLOCK);
 	if (camera == -1)
 	{
 		perror("Opening video device");
@@ -174,8 +236,13 @@ V4L_device::V4L_device(const char *path)
 
 V4L_device::~V4L_device()
 {
-	if(ptr_capture_buffer) munmap(ptr_capture_buffer, v4l_buf.length);  
-	if(camera) close(camera); 
+	if(camera == -1) return;
+	StreamOff();
+	for(int i=0; i<nbuffers; i++)
+		if(buffers[i].start) munmap(buffers[i].start, buffers[i].length);  
+	nbuffers= 0;
+	close(camera); 
+	dev= camera= -1;
 	fprintf(stdout, "\nV4L_device destroy\n");
 	fflush(stdout);
 }
@@ -202,7 +269,8 @@ int V4L_device::GetDriverInfo(void)
 	snprintf(drvinfo.driver, sizeof(V4LDriverCameraInformation::driver), "%s", caps.driver);
 	snprintf(drvinfo.card, sizeof(V4LDriverCameraInformation::card), "%s", caps.card);
 	snprintf(drvinfo.bus_info, sizeof(V4LDriverCameraInformation::bus_info), "%s", caps.bus_info);
-	snprintf(drvinfo.version, sizeof(V4LDriverCameraInformation::version), "%d.%d", (caps.version>>16)&&0xff,(caps.version>>24)&&0xff);
+	snprintf(drvinfo.version, sizeof(V4LDriverCameraInformation::version), "%u.%u.%u", (caps.version>>16)&0xff, (caps.version>>8)&0xff, caps.version&0xff);
+	drvinfo.version_code= caps.version;
 	drvinfo.capabilities= caps.capabilities;
 
 	// (2) VIDIOC_CROPCAP
@@ -241,37 +309,179 @@ int V4L_device::GetDriverInfo(void)
 }
 
 
-// Get Camera information from DRIVER
-int V4L_device::GetSupportedFormats(void)
+// Supported formats
+// Probing a camera takes a while on slow UVC cameras, so the outcome of the enumeration is kept in a cache 
+// file keyed by driver, card, bus and driver version. Next start with the same camera reads the file instead
+// refresh: ignore the cache file and enumerate again
+int V4L_device::GetSupportedFormats(bool refresh)
 {
-	fprintf(stdout, "\nTrying formats ...");
+	if(drvinfo.driver[0]=='\0' && GetDriverInfo()!=0) return -1;
+	char cachefile[256];
+	CacheFileName(cachefile, sizeof(cachefile));
+	if(use_cache && !refresh && LoadCapabilities(cachefile)==0) return 0;
+
+	fprintf(stdout, "\nEnumerating formats ...");
 	fflush (stdout);
-	// Camera capabilities
-	//	try one by one all formats
-	memset(&drvinfo.V4L_formats, 0, sizeof(V4LDriverCameraInformation::V4L_formats));
-	struct v4l2_format format = {0};
+	EnumerateFormats();
+	fprintf(stdout, " done");
+	if(use_cache) SaveCapabilities(cachefile);
+	return 0;
+}
+
+// Record a supported pixel format
+void V4L_device::AddFormat(unsigned int pixelformat)
+{
 	int j=0;
-	for(unsigned int i = 0; i < (sizeof(V4L_formats)/sizeof(int)); i++)
-	{
-		format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		format.fmt.pix.width = 320;
-		format.fmt.pix.height = 240;
-		format.fmt.pix.pixelformat = V4L_formats[i];
-		format.fmt.pix.field = V4L2_FIELD_NONE;
-		if(	xioctl(VIDIOC_S_FMT, &format) != -1 
-			&& format.fmt.pix.pixelformat == V4L_formats[i])
+	for(; j<MAX_V4L_FORMATS && drvinfo.V4L_formats[j]!=0; j++);
+	for(unsigned int i = 0; j<MAX_V4L_FORMATS && i < (sizeof(V4L_formats)/sizeof(int)); i++)
+		if(V4L_formats[i] == pixelformat)
+		{
+			drvinfo.V4L_formats[j]= i+1;
+			break;
+		}
+	switch(pixelformat)
+	{
+		case V4L2_PIX_FMT_YUYV:		drvinfo.format.yuyv= true; break;
+		case V4L2_PIX_FMT_MJPEG:	drvinfo.format.mjpg= true; break;
+		case V4L2_PIX_FMT_JPEG:		drvinfo.format.jpeg= true; break;
+	}
+}
+
+// Ask the driver: VIDIOC_ENUM_FMT, and for each format VIDIOC_ENUM_FRAMESIZES and VIDIOC_ENUM_FRAMEINTERVALS
+int V4L_device::EnumerateFormats(void)
+{
+	memset(&drvinfo.V4L_formats, 0, sizeof(V4LDriverCameraInformation::V4L_formats));
+	memset(&drvinfo.format, 0, sizeof(V4LDriverCameraInformation::format));
+	drvinfo.nframesizes= 0;
+	struct v4l2_fmtdesc fmtdesc = {0};
+	fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	for(; 0 == xioctl(VIDIOC_ENUM_FMT, &fmtdesc); fmtdesc.index++)
+	{
+		AddFormat(fmtdesc.pixelformat);
+		struct v4l2_frmsizeenum fsize = {0};
+		fsize.pixel_format= fmtdesc.pixelformat;
+		for(; drvinfo.nframesizes < MAX_V4L_FRAMESIZES && 0 == xioctl(VIDIOC_ENUM_FRAMESIZES, &fsize); fsize.index++)
 		{
-			//fprintf(stdout, "\nFormat %d %s", i, V4L_formats_str[i]);
-			drvinfo.V4L_formats[j++]= i+1;
-			switch(V4L_formats[i])
+			V4LFrameSize *fs= &drvinfo.framesizes[drvinfo.nframesizes++];
+			memset(fs, 0, sizeof(V4LFrameSize));
+			fs->pixelformat= fmtdesc.pixelformat;
+			if(fsize.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+			{
+				fs->width= fsize.discrete.width;
+				fs->height= fsize.discrete.height;
+			}
+			else
+			{
+				fs->width= fsize.stepwise.max_width;
+				fs->height= fsize.stepwise.max_height;
+				fs->stepwise= true;
+			}
+			struct v4l2_frmivalenum fival = {0};
+			fival.pixel_format= fmtdesc.pixelformat;
+			fival.width= fs->width;
+			fival.height= fs->height;
+			for(; fs->nintervals < MAX_V4L_INTERVALS && 0 == xioctl(VIDIOC_ENUM_FRAMEINTERVALS, &fival); fival.index++)
 			{
-				case V4L2_PIX_FMT_YUYV:		drvinfo.format.yuyv= true; break;
-				case V4L2_PIX_FMT_MJPEG:	drvinfo.format.mjpg= true; break;
-				case V4L2_PIX_FMT_JPEG:		drvinfo.format.jpeg= true; break;
+				// continuous or stepwise intervals: the shortest, the longest and the step
+				if(fival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+					fs->interval[fs->nintervals++]= fival.discrete;
+				else
+				{
+					fs->interval_range= true;
+					fs->interval[0]= fival.stepwise.min;
+					fs->interval[1]= fival.stepwise.max;
+					fs->interval[2]= fival.stepwise.step;
+					if(fival.type == V4L2_FRMIVAL_TYPE_CONTINUOUS) fs->interval[2].numerator= fs->interval[2].denominator= 0;
+					fs->nintervals= 3;
+					break;
+				}
 			}
+			if(fsize.type != V4L2_FRMSIZE_TYPE_DISCRETE) break;
 		}
 	}
-	fprintf(stdout, " done");
+	return 0;
+}
+
+// Cache file name. One file per camera: hash (FNV-1a) of the key
+void V4L_device::CacheFileName(char *filename, size_t max_sz)
+{
+	char key[256];
+	snprintf(key, sizeof(key), "%s|%s|%s|%08x", drvinfo.driver, drvinfo.card, drvinfo.bus_info, drvinfo.version_code);
+	uint32_t hash= 2166136261u;
+	for(size_t i=0; key[i]; i++) hash= (hash ^ (unsigned char) key[i]) * 16777619u;
+	snprintf(filename, max_sz, "%stlcam-%08x.caps", CAPS_CACHE_PATH, hash);
+}
+
+// Cache file (text)
+//	line 1: 	driver|card|bus_info|version|CAPS_CACHE_VERSION
+//	F <pixelformat>
+//	S <pixelformat> <width> <height> <flags> <nintervals> <numerator> <denominator> ...
+//	flags: 1 stepwise size, 2 interval range
+int V4L_device::LoadCapabilities(const char *filename)
+{
+	FILE *fp= fopen(filename, "r");
+	if(!fp) return -1;
+	char line[1024];
+	char key[256];
+	snprintf(key, sizeof(key), "%s|%s|%s|%08x|%d\n", drvinfo.driver, drvinfo.card, drvinfo.bus_info, drvinfo.version_code, CAPS_CACHE_VERSION);
+	if(!fgets(line, sizeof(line), fp) || strcmp(line, key) != 0)
+	{
+		fclose(fp);
+		return -1;
+	}
+	memset(&drvinfo.V4L_formats, 0, sizeof(V4LDriverCameraInformation::V4L_formats));
+	memset(&drvinfo.format, 0, sizeof(V4LDriverCameraInformation::format));
+	drvinfo.nframesizes= 0;
+	while(fgets(line, sizeof(line), fp))
+	{
+		unsigned int pixelformat;
+		if(sscanf(line, "F %x", &pixelformat) == 1)
+			AddFormat(pixelformat);
+		else if(line[0]=='S' && drvinfo.nframesizes < MAX_V4L_FRAMESIZES)
+		{
+			V4LFrameSize *fs= &drvinfo.framesizes[drvinfo.nframesizes];
+			memset(fs, 0, sizeof(V4LFrameSize));
+			int stepwise, nintervals, pos;
+			if(sscanf(line, "S %x %d %d %d %d%n", &fs->pixelformat, &fs->width, &fs->height, &stepwise, &nintervals, &pos) != 5) continue;
+			fs->stepwise= (stepwise & 1) != 0;
+			fs->interval_range= (stepwise & 2) != 0;
+			char *p= &line[pos];
+			for(int i=0; i<nintervals && i<MAX_V4L_INTERVALS; i++)
+			{
+				int n;
+				if(sscanf(p, " %u %u%n", &fs->interval[i].numerator, &fs->interval[i].denominator, &n) != 2) break;
+				p += n;
+				fs->nintervals++;
+			}
+			drvinfo.nframesizes++;
+		}
+	}
+	fclose(fp);
+	return drvinfo.V4L_formats[0] ? 0 : -1;
+}
+
+// Written to <file>.tmp and renamed over the cache: a crash while writing never leaves a cut cache
+int V4L_device::SaveCapabilities(const char *filename)
+{
+	string tmpfile= string(filename) + ".tmp";
+	FILE *fp= fopen(tmpfile.c_str(), "w");
+	if(!fp) return -1;
+	fprintf(fp, "%s|%s|%s|%08x|%d\n", drvinfo.driver, drvinfo.card, drvinfo.bus_info, drvinfo.version_code, CAPS_CACHE_VERSION);
+	for(int i=0; i<MAX_V4L_FORMATS && drvinfo.V4L_formats[i]!=0; i++)
+		fprintf(fp, "F %08x\n", V4L_formats[drvinfo.V4L_formats[i]-1]);
+	for(int i=0; i<drvinfo.nframesizes; i++)
+	{
+		V4LFrameSize *fs= &drvinfo.framesizes[i];
+		fprintf(fp, "S %08x %d %d %d %d", fs->pixelformat, fs->width, fs->height, (fs->stepwise ? 1 : 0) | (fs->interval_range ? 2 : 0), fs->nintervals);
+		for(int j=0; j<fs->nintervals; j++) fprintf(fp, " %u %u", fs->interval[j].numerator, fs->interval[j].denominator);
+		fprintf(fp, "\n");
+	}
+	bool failed= ferror(fp) != 0;
+	if(fclose(fp) != 0 || failed || rename(tmpfile.c_str(), filename) == -1)
+	{
+		unlink(tmpfile.c_str());
+		return -1;
+	}
 	return 0;
 }
 
@@ -314,13 +524,83 @@ int V4L_device::SetWorkingMode(CaptureResolution res, char *preferred)
 	wkm.field=  format.fmt.pix.field;
 	return wkm.pixelformat; 
 }
-void* V4L_device::AllocateBuffer()
+// Camera frame rate paced to the capture period (VIDIOC_S_PARM), so the sensor, the USB link and the 
+// driver do not work on frames that are thrown away
+// Discrete intervals: the longest one supported for the working mode (VIDIOC_ENUM_FRAMEINTERVALS) that
+// is not longer than the period, so the camera delivers at least one frame per deadline. Range of
+// intervals: the period itself, clamped to the range and rounded down to a step. When no interval is
+// known the period itself is asked for and the driver rounds it
+// To be called after SetWorkingMode and before streaming starts (AllocateBuffer)
+// Returns 0 when the camera runs at the period, 1 when it runs faster (the capture timer picks the 
+// frames) and -1 when the frame rate cannot be set
+int V4L_device::SetFrameInterval(long period_ms)
+{
+	if(period_ms <= 0 || streaming) return -1;
+	struct v4l2_streamparm parm = {0};
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if(-1 == xioctl(VIDIOC_G_PARM, &parm) || !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) return -1;
+	// period as a fraction of a second
+	struct v4l2_fract want;
+	want.numerator= (unsigned int) period_ms;
+	want.denominator= 1000;
+	double period= period_ms / 1000.0;
+	for(int i=0; i<drvinfo.nframesizes; i++)
+	{
+		V4LFrameSize *fs= &drvinfo.framesizes[i];
+		if(fs->pixelformat != wkm.pixelformat) continue;
+		if(fs->stepwise ? (fs->width < wkm.width || fs->height < wkm.height) : (fs->width != wkm.width || fs->height != wkm.height)) continue;
+		if(fs->interval_range)
+		{
+			struct v4l2_fract *f= fs->interval;
+			if(!f[0].numerator || !f[0].denominator || !f[1].numerator || !f[1].denominator) break;
+			double tmin= (double) f[0].numerator / f[0].denominator;
+			double tmax= (double) f[1].numerator / f[1].denominator;
+			double step= f[2].denominator ? (double) f[2].numerator / f[2].denominator : 0;
+			double t= period < tmin ? tmin : period > tmax ? tmax : period;
+			if(step > 0) t= tmin + floor((t - tmin) / step + 1e-6) * step;
+			// in 100 ns (the UVC unit), in ms when that does not fit
+			unsigned int den= t < 400 ? 10000000 : 1000;
+			unsigned int num= (unsigned int) llround(t * den);
+			unsigned int a= num, b= den;
+			while(b) { unsigned int r= a % b; a= b; b= r; }
+			if(a > 1) { num/= a; den/= a; }
+			want.numerator= num;
+			want.denominator= den;
+			break;
+		}
+		double best= 0, shortest= 0;
+		for(int j=0; j<fs->nintervals; j++)
+		{
+			struct v4l2_fract *f= &fs->interval[j];
+			if(f->denominator == 0 || f->numerator == 0) continue;
+			double t= (double) f->numerator / f->denominator;
+			// 1 % margin: 1/30 s for 33 ms
+			if(t <= period * 1.01 && t > best) { best= t; want= *f; }
+			if(best == 0 && (shortest == 0 || t < shortest)) { shortest= t; want= *f; }
+		}
+		break;
+	}
+	parm.parm.capture.timeperframe= want;
+	if(-1 == xioctl(VIDIOC_S_PARM, &parm))
+	{
+		perror("Setting frame interval");
+		return -1;
+	}
+	interval= parm.parm.capture.timeperframe;
+	if(interval.denominator == 0 || interval.numerator == 0) return -1;
+	double t= (double) interval.numerator / interval.denominator;
+	return t >= period * 0.99 && t <= period * 1.01 ? 0 : 1;
+}
+
+// Request 'n' mmap buffers and hand them all to the driver
+// The driver may grant less buffers than requested (nbuffers keeps the actual number)
+void* V4L_device::AllocateBuffer(int n)
 {
-	ptr_capture_buffer= 0;
-	memset(&v4l_buf, 0, sizeof(struct v4l2_buffer));
+	if(n < 1) n= 1;
+	if(n > V4L_MAX_BUFFERS) n= V4L_MAX_BUFFERS;
 
 	struct v4l2_requestbuffers req = {0};
-	req.count = 1;
+	req.count = n;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_MMAP;
 	if (-1 == xioctl(VIDIOC_REQBUFS, &req))
@@ -328,59 +608,216 @@ void* V4L_device::AllocateBuffer()
 		perror("Requesting Buffer");
 		return (void *) -1;
 	}
-	v4l_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	v4l_buf.memory = V4L2_MEMORY_MMAP;
-	v4l_buf.index = 0;
-	// query the status of a buffer at any time after buffers have been 
-	// allocated with the ioctl VIDIOC_REQBUFS ioctl.
-	if(-1 == xioctl(VIDIOC_QUERYBUF, &v4l_buf))
+	if(req.count < 1)
 	{
-		perror("Querying Buffer");
+		fprintf(stdout, "\nERROR: no capture buffers granted");
 		return (void *) -1;
 	}
-	// pointer to the buffer of the image captured
-	// map or unmap files or devices into memory
-	ptr_capture_buffer= mmap (NULL, v4l_buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, camera, v4l_buf.m.offset);	
-	return ptr_capture_buffer;
+	if(req.count > V4L_MAX_BUFFERS) req.count= V4L_MAX_BUFFERS;
+	
+	for(nbuffers=0; nbuffers < (int)req.count; nbuffers++)
+	{
+		struct v4l2_buffer v4l_buf = {0};
+		v4l_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		v4l_buf.memory = V4L2_MEMORY_MMAP;
+		v4l_buf.index = nbuffers;
+		// query the status of a buffer at any time after buffers have been 
+		// allocated with the ioctl VIDIOC_REQBUFS ioctl.
+		if(-1 == xioctl(VIDIOC_QUERYBUF, &v4l_buf))
+		{
+			perror("Querying Buffer");
+			return (void *) -1;
+		}
+		// pointer to the buffer of the image captured
+		// map or unmap files or devices into memory
+		buffers[nbuffers].length= v4l_buf.length;
+		buffers[nbuffers].refs= 0;
+		buffers[nbuffers].start= mmap (NULL, v4l_buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, camera, v4l_buf.m.offset);	
+		if(buffers[nbuffers].start == MAP_FAILED)
+		{
+			perror("Mapping Buffer");
+			buffers[nbuffers].start= 0;
+			return (void *) -1;
+		}
+		if(QueueBuffer(nbuffers) != 0) return (void *) -1;
+	}
+	if(StreamOn() != 0) return (void *) -1;
+	return buffers[0].start;
 }
-int V4L_device::CaptureImage()
+
+// call the VIDIOC_QBUF ioctl to enqueue an empty (capturing) buffer in the driver’s incoming queue
+int V4L_device::QueueBuffer(int index)
 {
-	// call the VIDIOC_QBUF ioctl to enqueue an empty (capturing) or 
-	// filled (output) buffer in the driver’s incoming queue
+	struct v4l2_buffer v4l_buf = {0};
+	v4l_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	v4l_buf.memory = V4L2_MEMORY_MMAP;
+	v4l_buf.index = index;
 	if(-1 == xioctl(VIDIOC_QBUF, &v4l_buf))
 	{
 		perror("Query Buffer");
 		return -1;
 	}
-	// Start streaming I/O
-	if(-1 == xioctl(VIDIOC_STREAMON, &v4l_buf.type)) 
+	buffers[index].queued= true;
+	return 0;
+}
+
+// Start streaming I/O
+// Called once. From then on the driver fills the queued buffers while the application works on the dequeued ones
+int V4L_device::StreamOn(void)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if(-1 == xioctl(VIDIOC_STREAMON, &type)) 
 	{
 		perror("Start Capture");
 		return -1;
 	}
-	fd_set fds;
-	FD_ZERO(&fds);
-	FD_SET(camera, &fds);
-	struct timeval tv = {0};
-	tv.tv_sec = 2;
-	if(-1 == select(camera+1, &fds, NULL, NULL, &tv))
+	streaming= true;
+	// the driver counts from 0 again
+	last_sequence= -1;
+	return 0;
+}
+void V4L_device::StreamOff(void)
+{
+	if(!streaming) return;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	xioctl(VIDIOC_STREAMOFF, &type);
+	streaming= false;
+}
+
+// Dequeue every buffer the driver has filled. The newest one is kept in 'latest', older ones go straight 
+// back to the driver unless a consumer still holds them
+// returns the number of buffers dequeued, -1 on error
+int V4L_device::DequeueAll(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	int n= 0;
+	for(;;)
 	{
-		perror("Waiting for Frame");
-		return -1;
+		struct v4l2_buffer v4l_buf = {0};
+		v4l_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		v4l_buf.memory = V4L2_MEMORY_MMAP;
+		if(-1 == xioctl(VIDIOC_DQBUF, &v4l_buf))
+		{
+			if(errno == EAGAIN) break;
+			perror("Retrieving Frame");
+			return -1;
+		}
+		V4LBuffer *b= &buffers[v4l_buf.index];
+		b->queued= false;
+		b->bytesused= v4l_buf.bytesused;
+		// capture time: the driver timestamp when taken on the monotonic clock, otherwise now
+		int64_t now= clock_us(CLOCK_MONOTONIC);
+		b->timestamp_us= now;
+		if((v4l_buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC && (v4l_buf.timestamp.tv_sec || v4l_buf.timestamp.tv_usec))
+			b->timestamp_us= (int64_t) v4l_buf.timestamp.tv_sec * 1000000 + v4l_buf.timestamp.tv_usec;
+		b->wallclock_us= b->timestamp_us + clock_us(CLOCK_REALTIME) - now;
+		// the driver counts every frame, also the ones it had no buffer for
+		b->sequence= v4l_buf.sequence;
+		uint32_t gap= (uint32_t) v4l_buf.sequence - (uint32_t) last_sequence - 1;
+		if(last_sequence >= 0 && gap < 0x80000000u) lost+= gap;
+		last_sequence= v4l_buf.sequence;
+		// a newer frame is available: older one goes back to the driver
+		if(latest >= 0 && buffers[latest].refs == 0 && QueueBuffer(latest) != 0) return -1;
+		latest= v4l_buf.index;
+		n++;
+	}
+	return n;
+}
+
+// Camera descriptor for the event loop. Readable when the driver has filled a buffer
+int V4L_device::PollFd(void)
+{
+	return streaming ? camera : -1;
+}
+
+// Camera readable: collect the frames so that next CaptureImage returns at once
+int V4L_device::FrameReady(void)
+{
+	return DequeueAll() < 0 ? -1 : 0;
+}
+
+// Borrow the most recent frame
+// Takes the newest frame already collected (FrameReady) or waits up to timeout_ms for the driver to
+// fill a buffer. Returns 1 when no frame is ready: the event loop passes 0 and comes back when the
+// camera is readable, so that it never blocks.
+// Every buffer ready is dequeued so that the frame returned is the latest one. Older frames go 
+// straight back to the driver.
+// The frame must be given back with ReleaseFrame
+int V4L_device::CaptureImage(Frame *frame, int timeout_ms)
+{
+	if(!streaming && StreamOn() != 0) return -1;
+
+	if(DequeueAll() < 0) return -1;
+	bool ready;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		ready= latest >= 0;
+	}
+	if(!ready)
+	{
+		if(timeout_ms <= 0) return 1;
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(camera, &fds);
+		struct timeval tv = {0};
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		int r= select(camera+1, &fds, NULL, NULL, &tv);
+		if(-1 == r)
+		{
+			perror("Waiting for Frame");
+			return -1;
+		}
+		if(0 == r)
+		{
+			fprintf(stdout, "\nERROR: Waiting for Frame - timeout");
+			return 1;
+		}
+		if(DequeueAll() < 0) return -1;
 	}
-	if(-1 == xioctl(VIDIOC_DQBUF, &v4l_buf))
+	std::lock_guard<std::mutex> lock(mtx);
+	if(latest < 0)
 	{
-		perror("Retrieving Frame");
+		fprintf(stdout, "\nERROR: Retrieving Frame - no buffer ready");
 		return -1;
 	}
-	capture_length= v4l_buf.bytesused;
+	int index= latest;
+	latest= -1;
+	buffers[index].refs++;
+	frame->index= index;
+	frame->ptr= buffers[index].start;
+	frame->length= buffers[index].bytesused;
+	frame->sequence= buffers[index].sequence;
+	frame->timestamp_us= buffers[index].timestamp_us;
+	frame->wallclock_us= buffers[index].wallclock_us;
+	frame->dropped= lost;
+	lost= 0;
 	return 0; 
 }	
 
+// Additional consumer of a borrowed frame
+void V4L_device::AcquireFrame(Frame *frame)
+{
+	if(frame->index < 0 || frame->index >= nbuffers) return;
+	std::lock_guard<std::mutex> lock(mtx);
+	buffers[frame->index].refs++;
+}
+
+// Consumer done with the frame. Last one re-queues the buffer
+void V4L_device::ReleaseFrame(Frame *frame)
+{
+	if(frame->index < 0 || frame->index >= nbuffers) return;
+	std::lock_guard<std::mutex> lock(mtx);
+	V4LBuffer *b= &buffers[frame->index];
+	if(b->refs > 0 && --b->refs == 0 && !b->queued) QueueBuffer(frame->index);
+	frame->index= -1;
+	frame->ptr= 0;
+}
+
 void V4L_device::printinfo()
 {
 	GetDriverInfo();
-	GetSupportedFormats();
+	GetSupportedFormats(true);
 	fprintf(stdout, "\nVIDIOC_QUERYCAP");
 	fprintf(stdout, "\n\tDriver:        \"%s\"", drvinfo.driver);
 	fprintf(stdout, "\n\tCard:          \"%s\"", drvinfo.card);
@@ -404,6 +841,18 @@ void V4L_device::printinfo()
 	for(size_t i=0; drvinfo.V4L_formats[i]!=0 && i<sizeof(V4LDriverCameraInformation::V4L_formats)/sizeof(int); i++)			
 		fprintf(stdout,"\n\t%s",  V4L_formats_str[drvinfo.V4L_formats[i]-1]);
 
+	fprintf(stdout, "\nVIDIOC_ENUM_FRAMESIZES");
+	for(int i=0; i<drvinfo.nframesizes; i++)
+	{
+		V4LFrameSize *fs= &drvinfo.framesizes[i];
+		fprintf(stdout, "\n\t%.4s %s%dx%d\t", (char *) &fs->pixelformat, fs->stepwise? "up to ":"", fs->width, fs->height);
+		if(fs->interval_range && fs->interval[0].numerator && fs->interval[1].numerator)
+			fprintf(stdout, " %.2f to %.2f", (double) fs->interval[1].denominator / fs->interval[1].numerator, (double) fs->interval[0].denominator / fs->interval[0].numerator);
+		else for(int j=0; j<fs->nintervals; j++)
+			if(fs->interval[j].numerator) fprintf(stdout, " %.2f", (double) fs->interval[j].denominator / fs->interval[j].numerator);
+		if(fs->nintervals) fprintf(stdout, " fps");
+	}
+
 	fprintf(stdout, "\n");
 }
 
@@ -429,28 +878,47 @@ struct ImageInfo
 
 // Decompress JPEG into memory
 // takes the jpeg image from 'jpg_buffer' memory
-// output decompressed image into permanet buffer pointed by 'gmemptr' (=== local function pointer 'bmp_buffer)
+// output decompressed image into 'bmp_buffer' of 'bmp_size' bytes
+// scale_num: image decoded at scale_num/8 of its size (DCT scaling: 8 full size, 1 only the DC)
 // returns:
-// 		decompressed RGB image in memory (gmemptr) 
+// 		decompressed RGB image in memory (bmp_buffer). -1 if it does not fit
 // 		Imgage info: width, height, and pixel size (bytes per pixel) -> image size in memory is= width x height x pixel_size
 // Original code for JPEG_decompress comes from (original comments are kept):
 //		- Kenneth Finnegan - A bare-bones example of how to use jpeglib to decompress a jpg in memory. (https://gist.github.com/PhirePhly/3080633)
-int JPEG_decompress (ImageInfo *info, unsigned char *jpg_buffer, unsigned long jpg_size) 
+// The decompressor is created once per thread and kept from one image to the next
+struct JPEGDecoder
 {
-	int rc;
-	// Variables for the decompressor itself
 	struct jpeg_decompress_struct cinfo;
 	struct jpeg_error_mgr jerr;
-
-	// Variables for the output buffer, and how long each row is
-	int row_stride, width, height, pixel_size;
-
 	// Allocate a new decompress struct, with the default error handler.
 	// The default error handler will exit() on pretty much any issue,
 	// so it's likely you'll want to replace it or supplement it with
 	// your own.
-	cinfo.err = jpeg_std_error(&jerr);	
-	jpeg_create_decompress(&cinfo);
+	JPEGDecoder(void)
+	{
+		cinfo.err = jpeg_std_error(&jerr);	
+		jpeg_create_decompress(&cinfo);
+	}
+	~JPEGDecoder(void)
+	{
+		jpeg_destroy_decompress(&cinfo);
+	}
+};
+
+static JPEGDecoder *jpeg_thread_decoder(void)
+{
+	static thread_local JPEGDecoder decoder;
+	return &decoder;
+}
+
+int JPEG_decompress (ImageInfo *info, unsigned char *jpg_buffer, unsigned long jpg_size, unsigned char *bmp_buffer, size_t bmp_size, unsigned int scale_num) 
+{
+	int rc;
+	// Variables for the decompressor itself
+	struct jpeg_decompress_struct &cinfo= jpeg_thread_decoder()->cinfo;
+
+	// Variables for the output buffer, and how long each row is
+	int row_stride, width, height, pixel_size;
 
 	// Configure this decompressor to read its data from a memory 
 	// buffer starting at unsigned char *jpg_buffer, which is jpg_size
@@ -469,10 +937,15 @@ int JPEG_decompress (ImageInfo *info, unsigned char *jpg_buffer, unsigned long j
 	rc = jpeg_read_header(&cinfo, TRUE);
 
 	if (rc != 1) {
+		jpeg_abort_decompress(&cinfo);
 		fprintf(stdout, "File does not seem to be a normal JPEG");
 		return -1;
 	}
 
+	// Smaller output from the IDCT itself (no full size decode)
+	cinfo.scale_num= scale_num;
+	cinfo.scale_denom= 8;
+
 	// By calling jpeg_start_decompress, you populate cinfo
 	// and can then allocate your output bitmap buffers for
 	// each scanline.
@@ -482,9 +955,11 @@ int JPEG_decompress (ImageInfo *info, unsigned char *jpg_buffer, unsigned long j
 	height = cinfo.output_height;
 	pixel_size = cinfo.output_components;
 
-	// Calculate memory and resize buffer as needed
-	gmemalloc( (size_t) (width * height * pixel_size) );
-	if(!gmemptr) return -1;
+	// Check memory
+	if((size_t) width * height * pixel_size > bmp_size) {
+		jpeg_abort_decompress(&cinfo);
+		return -1;
+	}
 
 	// The row_stride is the total number of bytes it takes to store an
 	// entire scanline (row). 
@@ -505,7 +980,7 @@ int JPEG_decompress (ImageInfo *info, unsigned char *jpg_buffer, unsigned long j
 	// at the default high quality decompression setting is always 1.
 	while (cinfo.output_scanline < cinfo.output_height) {
 		unsigned char *buffer_array[1];
-		buffer_array[0] = gmemptr + \
+		buffer_array[0] = bmp_buffer + \
 						   (cinfo.output_scanline) * row_stride;
 
 		jpeg_read_scanlines(&cinfo, buffer_array, 1);
@@ -524,9 +999,7 @@ int JPEG_decompress (ImageInfo *info, unsigned char *jpg_buffer, unsigned long j
 	// At this point, optionally go back and either load a new jpg into
 	// the jpg_buffer, or define a new jpeg_mem_src, and then start 
 	// another decompress operation.
-	
-	// Once you're really really done, destroy the object to free everything
-	jpeg_destroy_decompress(&cinfo);
+	// (that is what is done here: the object is destroyed at thread exit, see JPEGDecoder)
 
 	info->width= width;
 	info->height= height;
@@ -539,95 +1012,183 @@ int JPEG_decompress (ImageInfo *info, unsigned char *jpg_buffer, unsigned long j
 //	FRAMEBUFFER	
 // 	POSITION 
 //		frame buffer position (0,0) = TOP-LEFT corner
-// 	Frame buffer is BGR - 32 bits word per pixel
-// 		byte 0 blue
-// 		byte 1 green
-// 		byte 2 red
-// 		byte 4 transparency	
+// 	PIXEL FORMAT (fb_var_screeninfo)
+//		32 bits word per pixel: BGRX (byte 0 blue, byte 1 green, byte 2 red, byte 3 transparency) 
+//		or RGBX (red at offset 0)
+//		16 bits word per pixel: RGB565
+enum FBFormat {fb_bgrx32, fb_rgbx32, fb_rgb565, fb_unsupported};
+FBFormat fb_format(struct fb_var_screeninfo *vinfo)
+{
+	if(vinfo->bits_per_pixel == 32) return vinfo->red.offset == 0 ? fb_rgbx32 : fb_bgrx32;
+	if(vinfo->bits_per_pixel == 16 && vinfo->red.offset == 11 && vinfo->green.length == 6) return fb_rgb565;
+	return fb_unsupported;
+}
+
+//	Row of BGRX (YUYV kernels) or RGB (JPEG decoder, no libjpeg-turbo) pixels to the framebuffer format
+static void bgrx_2_fb(const uint8_t *src, int n, uint8_t *dst, FBFormat fmt)
+{
+	switch(fmt)
+	{
+		case fb_bgrx32: memcpy(dst, src, (size_t) n * 4); break;
+		case fb_rgbx32:
+			for(int i=0; i<n; i++, src+= 4, dst+= 4) { dst[0]= src[2]; dst[1]= src[1]; dst[2]= src[0]; dst[3]= 0; }
+			break;
+		case fb_rgb565:
+			for(int i=0; i<n; i++, src+= 4) ((uint16_t *) dst)[i]= (uint16_t) ((src[2] >> 3) << 11 | (src[1] >> 2) << 5 | src[0] >> 3);
+			break;
+		default: break;
+	}
+}
+static void rgb_2_fb(const uint8_t *src, int n, uint8_t *dst, FBFormat fmt)
+{
+	switch(fmt)
+	{
+		case fb_bgrx32:
+			for(int i=0; i<n; i++, src+= 3, dst+= 4) { dst[0]= src[2]; dst[1]= src[1]; dst[2]= src[0]; dst[3]= 0; }
+			break;
+		case fb_rgbx32:
+			for(int i=0; i<n; i++, src+= 3, dst+= 4) { dst[0]= src[0]; dst[1]= src[1]; dst[2]= src[2]; dst[3]= 0; }
+			break;
+		case fb_rgb565:
+			for(int i=0; i<n; i++, src+= 3) ((uint16_t *) dst)[i]= (uint16_t) ((src[0] >> 3) << 11 | (src[1] >> 2) << 5 | src[2] >> 3);
+			break;
+		default: break;
+	}
+}
+
+//	FIT
+//		Largest DCT scale (scale_num/8, up to 1:1) that fits a width x height JPEG image in the framebuffer
+unsigned int display_scale(int width, int height, struct fb_var_screeninfo *vinfo)
+{
+	unsigned int num= 8;
+	while(num > 1 && ((width * num + 7) / 8 > vinfo->xres || (height * num + 7) / 8 > vinfo->yres)) num--;
+	return num;
+}
+
+//	Image of width x height placed at (fb_x0, fb_y0), which may be off the framebuffer (negative):
+//	part of the image inside the framebuffer. false if none
+struct FBClip
+{
+	int x0, y0;		// framebuffer
+	int ix, iy;		// image
+	int width, height;
+};
+static bool display_clip(int width, int height, struct fb_var_screeninfo *vinfo, int fb_x0, int fb_y0, FBClip *c)
+{
+	c->x0= fb_x0 < 0 ? 0 : fb_x0;
+	c->y0= fb_y0 < 0 ? 0 : fb_y0;
+	c->ix= c->x0 - fb_x0;
+	c->iy= c->y0 - fb_y0;
+	c->width= min(width - c->ix, (int) vinfo->xres - c->x0);
+	c->height= min(height - c->iy, (int) vinfo->yres - c->y0);
+	return c->width > 0 && c->height > 0;
+}
+
+//	CENTRE
+//		Position of a width x height image centred in the framebuffer (negative if it is larger)
+void display_centre(int width, int height, struct fb_var_screeninfo *vinfo, int *fb_x0, int *fb_y0)
+{
+	*fb_x0= ((int) vinfo->xres - width) / 2;
+	*fb_y0= ((int) vinfo->yres - height) / 2;
+}
 
 //	JPEG IMGAGE
-//		first-byte is top-left corner
-int display_imageRGB_2_fb(ImageInfo *info, unsigned char *bmp_buffer, char *fbp, struct fb_var_screeninfo *vinfo, uint32_t fb_x0, uint32_t fb_y0)  
-{
-	int height= info->height;
-	int width= info->width;
-	unsigned char pixel[4];
-	pixel[3]=0; // No transparency	
-	unsigned int FB_WIDTH= vinfo->xres;
-	//unsigned int FB_HEIGHT= vinfo->yres;
-	//unsigned int FB_BPP= vinfo->bits_per_pixel;
-	char *img_ptr= (char*) bmp_buffer;
-	int img_BYTES_per_pixel= 3; 
-	unsigned int* fb_ptr_row = (unsigned int*) fbp + fb_y0 * FB_WIDTH;
-	unsigned int *ptr;
-	for (int y = 0; y < height; y++) // 1080
-	{
-		ptr= fb_ptr_row;
-		fb_ptr_row +=  FB_WIDTH;
-		ptr += fb_x0;
-		for (int x = 0; x < width ; x++) // 1920
-		{
-			pixel[0]= *(char *) (img_ptr + 2);	// Blue
-			pixel[1]= *(char *) (img_ptr + 1);  // Green
-			pixel[2]= *(char *) (img_ptr + 0);	// Red	
-			//if( !(do_transparency && *((unsigned int*) &pixel)==transparent_color) ) 
-			*ptr= *(unsigned int *) &pixel;
-			ptr++;
-			img_ptr += img_BYTES_per_pixel;
-		}		
-	}	
+//		Decoded at scale_num/8 straight into the framebuffer rows, centred, in the pixel format of the 
+//		framebuffer: libjpeg-turbo writes BGRX, RGBX or RGB565 itself. With no libjpeg-turbo, or when 
+//		the image is cropped, rows are decoded into a row buffer and converted / copied
+//		RGB565 keeps the ordered dithering of libjpeg-turbo (smoother gradients than truncation)
+//		Rows outside the framebuffer are decoded and dropped
+int JPEG_decompress_fb(ImageInfo *info, unsigned char *jpg_buffer, unsigned long jpg_size, FBSurface *fb, unsigned int scale_num)
+{
+	struct fb_var_screeninfo *vinfo= fb->vinfo;
+	struct jpeg_decompress_struct &cinfo= jpeg_thread_decoder()->cinfo;
+	static thread_local vector<uint8_t> rowbuf;
+	FBFormat fmt= fb_format(vinfo);
+	if(fmt == fb_unsupported) return -1;
+	jpeg_mem_src(&cinfo, jpg_buffer, jpg_size);
+	if(jpeg_read_header(&cinfo, TRUE) != 1) {
+		jpeg_abort_decompress(&cinfo);
+		return -1;
+	}
+	cinfo.scale_num= scale_num;
+	cinfo.scale_denom= 8;
+	bool native= true;	// decoder output in the framebuffer format
+#ifdef JCS_EXTENSIONS
+	if(fmt == fb_bgrx32) cinfo.out_color_space= JCS_EXT_BGRX;
+	else if(fmt == fb_rgbx32) cinfo.out_color_space= JCS_EXT_RGBX;
+#ifdef LIBJPEG_TURBO_VERSION_NUMBER
+	else if(fmt == fb_rgb565) cinfo.out_color_space= JCS_RGB565;
+#endif
+	else
+#endif
+	{
+		cinfo.out_color_space= JCS_RGB;
+		native= false;
+	}
+	jpeg_start_decompress(&cinfo);
+	int width= cinfo.output_width;
+	int height= cinfo.output_height;
+	int fb_bytes= vinfo->bits_per_pixel / 8;
+	int out_bytes= native ? fb_bytes : 3;
+	size_t fb_stride= fb->stride;
+	int x0, y0;
+	display_centre(width, height, vinfo, &x0, &y0);
+	FBClip clip;
+	bool visible= display_clip(width, height, vinfo, x0, y0, &clip);
+	bool direct= native && visible && clip.width == width;
+	if(rowbuf.size() < (size_t) width * 4) rowbuf.resize((size_t) width * 4);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		int fy= y0 + (int) cinfo.output_scanline;
+		bool inside= visible && fy >= clip.y0 && fy < clip.y0 + clip.height;
+		uint8_t *fb_row= inside ? (uint8_t *) fb->ptr + fy * fb_stride + clip.x0 * fb_bytes : 0;
+		JSAMPROW row= direct && inside ? fb_row : &rowbuf[0];
+		jpeg_read_scanlines(&cinfo, &row, 1);
+		if(!inside || direct) continue;
+		if(native) memcpy(fb_row, &rowbuf[clip.ix * out_bytes], (size_t) clip.width * fb_bytes);
+		else rgb_2_fb(&rowbuf[clip.ix * 3], clip.width, fb_row, fmt);
+	}
+	jpeg_finish_decompress(&cinfo);
+	info->width= width;
+	info->height= height;
+	info->pixel_size= fb_bytes;
 	return 0;
 }
 
 // Ref - How to convert yuy2 to a BITMAP in C++ 
 // 		https://stackoverflow.com/questions/4491649/how-to-convert-yuy2-to-a-bitmap-in-c
-// Changes done to the original code from the link above:
-// original values saturate so need ro decrease
-// divide by 8 and then LUMA factor changed from 37 to 31
-// input (yuvy) strides by 4 bytes, output (fb) strides by 6 (2 pixels)
 // 4 bytes YUYV -> 2 x pixels RGB (3 bytes). 
 // FB is 4 bytes per pixel RGB. The fourth one is the transparency
-int display_imgageYUVY_2_fb(ImageInfo *info, char *raw_img_buffer, char *fbp, struct fb_var_screeninfo *vinfo, uint32_t fb_x0, uint32_t fb_y0)  
-{
-	int height= info->height;
-	int width= info->width;
-	unsigned char pixel[4];
-	pixel[3]=0;
-	unsigned int FB_WIDTH= vinfo->xres;
-	char *img_ptr= (char*) raw_img_buffer;
-//	int img_BYTES_per_pixel= 3; 
-
-	unsigned int* fb_ptr_row = (unsigned int*) fbp + fb_y0 * FB_WIDTH;
-	unsigned int *ptr;
+// The conversion of each row is done by the YUYV kernels (yuyv.h): BT.601 limited range in fixed 
+// point, saturated to 0 ... 255, straight into a BGRX framebuffer or through a row buffer for the 
+// other formats
+// Only the part inside the framebuffer is drawn, from an even column of the image (pixel pairs)
+int display_imgageYUVY_2_fb(ImageInfo *info, char *raw_img_buffer, FBSurface *fb, int fb_x0, int fb_y0)  
+{
+	struct fb_var_screeninfo *vinfo= fb->vinfo;
+	static thread_local vector<uint8_t> rowbuf;
+	FBFormat fmt= fb_format(vinfo);
+	if(fmt == fb_unsupported) return -1;
+	FBClip clip;
+	if(!display_clip(info->width, info->height, vinfo, fb_x0 & ~1, fb_y0, &clip)) return 0;
+	int height= clip.height;
+	int pairs= clip.width / 2;
+	int fb_bytes= vinfo->bits_per_pixel / 8;
+	size_t fb_stride= fb->stride;
+	const uint8_t *img_ptr= (const uint8_t*) raw_img_buffer + ((size_t) clip.iy * info->width + clip.ix) * 2;
+	const YUYVKernels *kernels= yuyv_kernels();
+	if(fmt != fb_bgrx32 && rowbuf.size() < (size_t) pairs * 8) rowbuf.resize((size_t) pairs * 8);
+
+	uint8_t *fb_ptr_row = (uint8_t *) fb->ptr + clip.y0 * fb_stride + clip.x0 * fb_bytes;
 	for (int y = 0; y < height; y++) 
 	{
-		ptr= fb_ptr_row;
-		fb_ptr_row +=  FB_WIDTH;
-		ptr += fb_x0;
-		for (int x = 0; x < width ; x+=2) 
+		if(fmt == fb_bgrx32) kernels->to_bgrx(img_ptr, pairs, fb_ptr_row);
+		else
 		{
-			long  y0 = img_ptr[0];	// Luma
-			long  u0 = img_ptr[1];	// Cr
-			long  y1 = img_ptr[2];
-			long  v0 = img_ptr[3];	// Cb
-			img_ptr += 4;
-			//long  c = y0 -  16; 
-			long  d = u0 - 128;	
-			long  e = v0 - 128;	
-			long p= 31 * (y0 -  16);
-			pixel[0] = (unsigned char) (( p +  65 * d           + 16) >> 5); // blue
-			pixel[1] = (unsigned char) (( p -  12 * d -  26 * e + 16) >> 5); // green
-			pixel[2] = (unsigned char) (( p           +  51 * e + 16) >> 5); // red
-			*ptr= *(unsigned int *) &pixel;
-			ptr++;
-			//c = y1-16;
-			p= 31 * (y1 -  16);
-			pixel[0] = (unsigned char) (( p +  65 * d           + 16) >> 5); // blue
-			pixel[1] = (unsigned char) (( p -  12 * d -  26 * e + 16) >> 5); // green
-			pixel[2] = (unsigned char) (( p           +  51 * e + 16) >> 5); // red
-			*ptr= *(unsigned int *) &pixel;
-			ptr++;
+			kernels->to_bgrx(img_ptr, pairs, &rowbuf[0]);
+			bgrx_2_fb(&rowbuf[0], pairs * 2, fb_ptr_row, fmt);
 		}
+		fb_ptr_row +=  fb_stride;
+		img_ptr += info->width * 2;
 	}	
 	return 0;
 }
@@ -644,70 +1205,92 @@ int display_imgageYUVY_2_fb(ImageInfo *info, char *raw_img_buffer, char *fbp, st
 // |_________|
 
 
-//	converts a YUYV raw buffer to a JPEG buffer.
-//	input is in YUYV (YUV 422). output is JPEG binary.
-//		Each four bytes is two pixels.
-//		Each four bytes is two Y's, a Cb and a Cr.
-//		Each Y goes to one of the pixels, and the Cb and Cr belong to both pixels.
-//	code based on: 
-//		http://stackoverflow.com/questions/17029136/weird-image-while-trying-to-compress-yuv-image-to-jpeg-using-libjpeg
-int compressYUYVtoJPEG(char *input, const int width, const int height) 
+// Parallel encoder of YUYV frames (option strips=N). 0: one libjpeg pass
+StripEncoder *stripenc= 0;
+// 4:2:2 raw data (default) or 4:2:0 scanlines (option jpeg420)
+YUYVpath yuyvpath= yuyv_raw422;
+// JPEG quality held to a byte budget (options bytes=N, rate=N). 0: fixed JPEG_QUALITY
+RateControl *ratectl= 0;
+// Huffman tables (option huffman=)
+HuffmanTables huffman= huffman_std;
+
+// Preview and thumbnail qualities (option ladder=P,T). Rung 0 is the full image, with the quality above
+int ladder_quality[LADDER_RUNGS]= {JPEG_QUALITY, LADDER_PREVIEW_QUALITY, LADDER_THUMB_QUALITY};
+
+// Pool slab of a JPEG image of rung k (1/2^k of the width and height): one byte per pixel of the
+// rung, several times the image at the ladder qualities, and the headers
+static size_t ladder_slab(int width, int height, int k)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    uint8_t* outbuffer = NULL;
-    uint64_t outlen = 0;
+	return (size_t) (width >> k) * (height >> k) + 4096;
+}
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    jpeg_mem_dest(&cinfo, &outbuffer, (long unsigned int *)&outlen);
+// The encoder writes straight into the pool buffer. An image larger than the buffer ends up on the heap
+static void pool_jpeg_wrap(PoolBuffer *b, JPEGBuffer *jpeg)
+{
+	jpeg->Wrap(b->ptr, b->size);
+}
+static void pool_jpeg_done(PoolBuffer *b, JPEGBuffer *jpeg, int sz)
+{
+	if(jpeg->owned)
+	{
+		size_t size= jpeg->size;
+		b->pool->Replace(b, jpeg->Detach(), size);
+	}
+	b->used= sz > 0 ? sz : 0;
+}
 
-    // jrow is a libjpeg row of samples array of 1 row pointer
-    cinfo.image_width = width & -1;
-    cinfo.image_height = height & -1;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_YCbCr; //libJPEG expects YUV 3bytes, 24bit
+// YUYV to JPEG into the pool buffer 'out', on the strip encoder when there is one
+int encodeYUYV(char *input, const int width, const int height, PoolBuffer *out) 
+{
+	JPEGBuffer jpeg;
+	pool_jpeg_wrap(out, &jpeg);
+	int quality= ratectl ? ratectl->Quality() : JPEG_QUALITY;
+	bool optimize= ratectl ? ratectl->Optimize() : huffman == huffman_opt;
+	int sz;
+	if(stripenc) sz= stripenc->Compress(input, width, height, &jpeg, quality);
+	else sz= compressYUYVtoJPEG(input, width, height, &jpeg, yuyvpath, quality, optimize);
+	if(ratectl && sz > 0) ratectl->Update(sz, quality);
+	pool_jpeg_done(out, &jpeg, sz);
+	return sz;
+}
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, 92, TRUE);
-	
-	//-------------------------------------
-	// START COMPRESS
-    jpeg_start_compress(&cinfo, TRUE);
-    vector<uint8_t> tmprowbuf(width * 3);
-    JSAMPROW row_pointer[1];
-    row_pointer[0] = &tmprowbuf[0];
-    while (cinfo.next_scanline < cinfo.image_height) 
+// Output ladder (option ladder): YUYV to the full JPEG image into 'out', and its preview and
+// thumbnail, in one pass (ladder.h)
+int encodeYUYVladder(char *input, const int width, const int height, PoolBuffer *out, PoolBuffer *preview, PoolBuffer *thumb) 
+{
+	PoolBuffer *buffers[LADDER_RUNGS]= {out, preview, thumb};
+	JPEGBuffer jpeg[LADDER_RUNGS];
+	JPEGBuffer *outs[LADDER_RUNGS];
+	int quality[LADDER_RUNGS];
+	for(int k=0; k<LADDER_RUNGS; k++)
 	{
-        unsigned i, j;
-        unsigned offset = cinfo.next_scanline * cinfo.image_width * 2; //offset to the correct row
-		//input strides by 4 bytes, output strides by 6 (2 pixels)
-        for (i = 0, j = 0; i < cinfo.image_width * 2; i += 4, j += 6) 
-		{ 
-            tmprowbuf[j + 0] = input[offset + i + 0]; // Y (unique to this pixel)
-            tmprowbuf[j + 1] = input[offset + i + 1]; // U (shared between pixels)
-            tmprowbuf[j + 2] = input[offset + i + 3]; // V (shared between pixels)
-            tmprowbuf[j + 3] = input[offset + i + 2]; // Y (unique to this pixel)
-            tmprowbuf[j + 4] = input[offset + i + 1]; // U (shared between pixels)
-            tmprowbuf[j + 5] = input[offset + i + 3]; // V (shared between pixels)
-        }
-        jpeg_write_scanlines(&cinfo, row_pointer, 1);
-    }
-    jpeg_finish_compress(&cinfo);
-	// FINISH COMPRESS
-	//-------------------------------------
-   
-	//fwrite(outbuffer,  sizeof(char), outlen, outfile);
-	gmemalloc( outlen );
-	if(gmemptr) memcpy(gmemptr, outbuffer, outlen);
-	
-	jpeg_destroy_compress(&cinfo);
-	free(outbuffer);
-	return (int) outlen;
+		pool_jpeg_wrap(buffers[k], &jpeg[k]);
+		outs[k]= &jpeg[k];
+		quality[k]= ladder_quality[k];
+	}
+	if(ratectl) quality[0]= ratectl->Quality();
+	bool optimize= ratectl ? ratectl->Optimize() : huffman == huffman_opt;
+	int sz= jpeg_thread_ladder()->CompressYUYV(input, width, height, quality, optimize, outs);
+	if(ratectl && sz > 0) ratectl->Update(sz, quality[0]);
+	for(int k=0; k<LADDER_RUNGS; k++) pool_jpeg_done(buffers[k], &jpeg[k], sz > 0 ? (int) jpeg[k].used : 0);
+	return sz;
+}
+
+// Output ladder of a JPEG capture: preview and thumbnail from one 1/2 scaled decode
+int encodeJPEGladder(unsigned char *jpeg_ptr, size_t jpeg_sz, PoolBuffer *preview, PoolBuffer *thumb) 
+{
+	PoolBuffer *buffers[LADDER_RUNGS]= {0, preview, thumb};
+	JPEGBuffer jpeg[LADDER_RUNGS];
+	JPEGBuffer *outs[LADDER_RUNGS]= {0, &jpeg[1], &jpeg[2]};
+	for(int k=1; k<LADDER_RUNGS; k++) pool_jpeg_wrap(buffers[k], &jpeg[k]);
+	int sz= jpeg_thread_ladder()->CompressJPEG(jpeg_ptr, jpeg_sz, ladder_quality, huffman == huffman_opt, outs);
+	for(int k=1; k<LADDER_RUNGS; k++) pool_jpeg_done(buffers[k], &jpeg[k], sz > 0 ? (int) jpeg[k].used : 0);
+	return sz;
 }
 
 //	converts a YUYV --> RGB --> JPEG buffer.
 //	input is in YUYV (YUV 422). output is JPEG binary.
+//	Rows are converted to BGRX by the YUYV kernels (libjpeg-turbo input JCS_EXT_BGRX)
 //	(just a test)
 int compressYUYV_through_RGB_to_JPEG(FILE *outfile, const char *filename, char *input, const int width, const int height) 
 {
@@ -723,8 +1306,8 @@ int compressYUYV_through_RGB_to_JPEG(FILE *outfile, const char *filename, char *
     // jrow is a libjpeg row of samples array of 1 row pointer
     cinfo.image_width = width & -1;
     cinfo.image_height = height & -1;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;// JCS_YCbCr; // JCS_RGB; //libJPEG expects YUV 3bytes, 24bit
+    cinfo.input_components = 4;
+    cinfo.in_color_space = JCS_EXT_BGRX;
 
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, 92, TRUE); 
@@ -732,30 +1315,14 @@ int compressYUYV_through_RGB_to_JPEG(FILE *outfile, const char *filename, char *
 	//-------------------------------------
 	// START COMPRESS
     jpeg_start_compress(&cinfo, TRUE);
-    vector<uint8_t> tmprowbuf(width * 3);
+	const YUYVKernels *kernels= yuyv_kernels();
+    vector<uint8_t> tmprowbuf(width * 4);
     JSAMPROW row_pointer[1];
     row_pointer[0] = &tmprowbuf[0];
     while (cinfo.next_scanline < cinfo.image_height)
 	{
-        unsigned i, j;
         unsigned offset = cinfo.next_scanline * cinfo.image_width * 2; //offset to the correct row
-		//input strides by 4 bytes, output strides by 6 (2 pixels)
-        for (i = 0, j = 0; i < cinfo.image_width * 2 ; i += 4, j += 6) 
-		{ 
-			unsigned long y0 = (unsigned long) input[ offset + i + 0 ];
-			unsigned long u =  (unsigned long) input[ offset + i + 1 ];
-			unsigned long y1 = (unsigned long) input[ offset + i + 2 ];
-			unsigned long v =  (unsigned long) input[ offset + i + 3 ];
-			unsigned long a= ((v-128) * 37221) >> 15;
-			unsigned long b= (( (u-128) * 12975) + ((v-128) * 18949)) >> 15;
-			unsigned long c= ((u-128) * 66883) >> 15;
-            tmprowbuf[ j + 0 ] = (unsigned char) (y0 + a);
-            tmprowbuf[ j + 1 ] = (unsigned char) (y0 - b);
-            tmprowbuf[ j + 2 ] = (unsigned char) (y0 + c);
-			tmprowbuf[ j + 3 ] = (unsigned char) (y1 + a);
-            tmprowbuf[ j + 4 ] = (unsigned char) (y1 - b);
-            tmprowbuf[ j + 5 ] = (unsigned char) (y1 + c);	
-        }
+		kernels->to_bgrx((const uint8_t *) &input[offset], width / 2, &tmprowbuf[0]);
         jpeg_write_scanlines(&cinfo, row_pointer, 1);
     }
     jpeg_finish_compress(&cinfo);
@@ -793,7 +1360,7 @@ class POSTMessageMemory {
 		};
 		~POSTMessageMemory ()
 		{
-			printf("Destroyed\n");
+//			printf("Destroyed\n");
 			if(mem_ptr) free(mem_ptr);
 		};
 		void size(size_t pl)
@@ -808,15 +1375,159 @@ class POSTMessageMemory {
 			}
 		};
 };
-				
-/*
-void upload_image(POSTMessageMemory *postmem, char *filename, char* payload_ptr, double *elapsed, char *result)
-{
-	//char fullfilename[128];	
-	char *xmlcode_ptr;
-	char *memptr= postmem->mem_ptr; 
-	size_t mem_sz= postmem->mem_sz;
-	size_t payload_sz= postmem->payload;
+
+
+// Non-blocking image upload driven by the event loop (Reactor)
+// connect, send and receive progress as the socket gets ready, so the upload overlaps with the next captures.
+// One upload at a time: the newest frame captured while an upload is in flight waits and is uploaded when
+// it is done. Older frames waiting are replaced by it and are not uploaded (dropped)
+#define UPLOAD_TIMEOUT_MS	3000
+class CloudUpload {
+		Reactor *reactor;
+		POSTMessageMemory postmem;
+		int sockfd;
+		bool sending;
+		size_t nbytes;
+		size_t sent;
+		size_t received;
+		char filename[64];
+		long lateness_us;
+		struct timespec t0;
+		// newest image captured during the upload, sent when the upload is done
+		bool waiting;
+		std::vector<unsigned char> next;
+		char next_filename[64];
+		long next_lateness_us;
+		static void handler(int fd, uint32_t events, void *ctx);
+		void Done(const char *result);
+	public:
+		unsigned long uploaded;
+		unsigned long dropped;
+		bool verbose;
+		CloudUpload(Reactor *r)
+		{
+			reactor= r;
+			sockfd= -1;
+			waiting= false;
+			uploaded= dropped= 0;
+			verbose= true;
+		};
+		~CloudUpload()
+		{
+			if(sockfd != -1) { reactor->Remove(sockfd); close(sockfd); }
+		};
+		bool busy(void) { return sockfd != -1; };
+		int Start(const char *, unsigned char *, size_t , long );
+		void CheckTimeout(void);
+};
+
+// Upload busy: the image is copied into the one waiting slot, in place of an older image waiting
+// (counted in dropped)
+int CloudUpload::Start(const char *name, unsigned char *jpeg_ptr, size_t jpeg_sz, long lateness)
+{
+	if(busy())
+	{
+		if(waiting) dropped++;
+		next.assign(jpeg_ptr, jpeg_ptr + jpeg_sz);
+		snprintf(next_filename, sizeof(next_filename), "%s", name);
+		next_lateness_us= lateness;
+		waiting= true;
+		return 0;
+	}
+	snprintf(filename, sizeof(filename), "%s", name);
+	lateness_us= lateness;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	// allocate memory
+	postmem.size(jpeg_sz);
+	if(!postmem.mem_ptr) return -1;
+	size_t pos;
+	nbytes= hhtpPOST_header(filename, postmem.mem_ptr, postmem.mem_sz, &pos, postmem.payload);
+	memcpy(&postmem.mem_ptr[pos], jpeg_ptr, postmem.payload);
+	sent= received= 0;
+	sending= true;
+	if((sockfd= hhtpPOST_connect()) == -1 || reactor->Add(sockfd, EPOLLOUT, handler, this) != 0)
+	{
+		if(sockfd != -1) close(sockfd);
+		sockfd= -1;
+		Done("CONNECTION ERROR");
+		return -1;
+	}
+	return 0;
+}
+
+// Socket ready
+void CloudUpload::handler(int fd, uint32_t events, void *ctx)
+{
+	CloudUpload *up= (CloudUpload *) ctx;
+	if(up->sending)
+	{
+		int r= hhtpPOST_send(fd, up->postmem.mem_ptr, up->nbytes, &up->sent);
+		if(r < 0) up->Done("CONNECTION ERROR");
+		else if(r == 1)
+		{
+			// whole message sent: wait for the response
+			up->sending= false;
+			up->reactor->Modify(fd, EPOLLIN);
+		}
+		return;
+	}
+	char *xmlcode_ptr= 0;
+	int r= hhtpPOST_receive(fd, up->postmem.mem_ptr, up->postmem.mem_sz, &up->received, &xmlcode_ptr);
+	if(r < 0) up->Done("CONNECTION ERROR");
+	else if(r == 1)
+	{
+		char result[128];
+		result[0]='\0';
+		char *p= xmlcode_ptr? strstr(xmlcode_ptr, "<result>") : 0;
+		if(p) sscanf(p, "%*[^>]>%127[^<]<", result); // read and ignore characters other than a '>'
+		up->uploaded++;
+		up->Done(result);
+	}
+}
+
+// Upload finished (or failed): close the socket and report
+void CloudUpload::Done(const char *result)
+{
+	if(sockfd != -1)
+	{
+		reactor->Remove(sockfd);
+		close(sockfd);
+		sockfd= -1;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed= (now.tv_sec - t0.tv_sec) * 1e6 + (now.tv_nsec - t0.tv_nsec) / 1e3; // microsecs
+	if(verbose) 
+	{
+		double temperature= CPUtemperature();
+		printf("T=%6.2fC %s %.2f ms late %.1f ms %s\n", temperature, filename, elapsed/1000, lateness_us/1000.0, result);
+	}				
+	// image waiting: its upload starts now
+	if(waiting)
+	{
+		waiting= false;
+		Start(next_filename, &next[0], next.size(), next_lateness_us);
+	}
+}
+
+void CloudUpload::CheckTimeout(void)
+{
+	if(!busy()) return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if((now.tv_sec - t0.tv_sec) * 1000 + (now.tv_nsec - t0.tv_nsec) / 1000000 > UPLOAD_TIMEOUT_MS)
+		Done("TIMEOUT");
+}
+				
+// Blocking image upload
+// used by the cloud sink of the pipeline, which has a thread of its own
+void upload_image(POSTMessageMemory *postmem, const char *filename, char* payload_ptr, double *elapsed, char *result)
+{
+	//char fullfilename[128];	
+	char *xmlcode_ptr;
+	char *memptr= postmem->mem_ptr; 
+	size_t mem_sz= postmem->mem_sz;
+	size_t payload_sz= postmem->payload;
 	if(memptr==0) return;
 	size_t nbytes;
 	size_t pos;
@@ -839,15 +1550,14 @@ void upload_image(POSTMessageMemory *postmem, char *filename, char* payload_ptr,
 		sscanf(&xmlcode_ptr[pos], "%*[^>]>%[^</]</", result); // read and ignore characters other than a '>'
 	
 	// manifest file
-	/ *
+	/*
 	size_t l= (size_t) strlen(filename);
 	memptr[0]='\0';
 	nbytes= hhtpPOST_header("data.txt", memptr, mem_sz, &pos, l);
 	memcpy(&memptr[pos], filename, l);
 	hhtpPOST_upload(memptr, nbytes, 0, 0);	
-* /	
+	*/	
 }
-*/
 
 //  _________
 // |         |   SECTION 5
@@ -868,11 +1578,647 @@ typedef struct
 	bool display= false;
 	bool cloud= false;
 	int time;
+	int buffers= V4L_DEFAULT_BUFFERS;
 	char V4L_format[5];
+	const char *replay= 0;	// capture file played back instead of the camera
+	bool loop= false;
+	bool cache= true;
+	bool pace= true;		// camera frame rate set to the capture period (VIDIOC_S_PARM)
+	OverrunPolicy overrun= overrun_skip;
+	int threads= 0;			// encoder threads. 0: no pipeline, everything runs on the capture loop
+	int queue= 2;			// pipeline queue depth
+	DropPolicy drop= drop_oldest;
+	int strips= 0;			// YUYV frames: JPEG strips encoded in parallel. 0: one libjpeg pass
+	bool jpeg420= false;	// YUYV frames: 4:2:0 JPEG through libjpeg color conversion (instead of 4:2:2 raw data)
+	double motion= 0;		// change detection: % of the image changed for a frame to be kept. 0: every frame is kept
+	int keep= 0;			// change detection: one static frame kept every N (0: none)
+	int dark= 0;			// frames with a mean luma below are not kept (night). 0: every frame is kept
+	long bytes= 0;			// YUYV frames: JPEG budget, bytes per frame. 0: fixed quality
+	long rate= 0;			// YUYV frames: JPEG budget, bytes per second (with the capture period)
+	HuffmanTables huffman= huffman_std;
+	bool ladder= false;		// preview (1/2) and thumbnail (1/4) images next to every image
+	int slots= SLOTS_DEFAULT;	// local storage: image files image_000.jpg ... reused in turn
+	int shm= 0;				// slots of the shared memory ring of images. 0: no ring
+	int writeq= 4;			// single threaded loop: images queued to the disk writer thread. 0: written on the loop
+	const char *archive= 0;	// directory of the archive of every image. 0: no archive
+	long segment= ARCHIVE_SEGMENT_MB;	// archive: MB per segment file
+	long rotate= ARCHIVE_ROTATE_H;		// archive: hours per segment file
+	long retain= 0;			// archive: days of images kept. 0: no limit
+	long retainmb= 0;		// archive: MB kept. 0: no limit
 } CLI_options;
 
 CLI_options CLIops;
 
+// Capture loop state shared by the event loop handlers
+struct CaptureLoop
+{
+	FrameSource *source;
+	CaptureScheduler sched;
+	Reactor reactor;
+	CloudUpload *upload;
+	Pipeline *pipeline;
+	Pipeline *writer;			// disk and archive writer thread of the single threaded loop (option writeq). 0: files written on the loop
+	ChangeDetector *motion;		// 0: every frame is kept
+	FBDisplay *display;			// 0: no display
+	unsigned int display_num;	// JPEG images decoded at display_num/8 to fit the framebuffer
+	unsigned int n;
+	unsigned long nframes;
+	unsigned long published;	// newest frame announced in DATA_FILE (pipeline)
+	unsigned long drops;		// frames lost by the camera driver (sequence gaps)
+	bool pending;				// no frame ready at the deadline: captured when the camera is readable
+	int64_t pending_us;			// since (CLOCK_MONOTONIC)
+	bool stalled;				// no frame for FRAME_WAIT_MS: told once
+	unsigned long waits;		// captures that waited for the camera
+	POSTMessageMemory *cloudmem;	// cloud sink (pipeline)
+	// age of the images when stored or handed to the upload (capture timestamp to output). Updated by 
+	// the one thread that outputs images
+	unsigned long outputs;
+	double sum_age_us;
+	long max_age_us;
+};
+
+// Image of 'frame' out: age since its capture
+static long output_age(CaptureLoop *loop, const Frame *frame)
+{
+	long age= (long) (clock_us(CLOCK_MONOTONIC) - frame->timestamp_us);
+	loop->outputs++;
+	loop->sum_age_us+= age;
+	if(age > loop->max_age_us) loop->max_age_us= age;
+	return age;
+}
+
+// Store JPEG image locally, in slot 'n' of the storage ring
+// The output ladder (option ladder), preview_NNN.jpg and thumb_NNN.jpg, is stored before image_NNN.jpg
+// is published so that a player finds them with it
+// publish: announce the image in DATA_FILE
+static void store_image(unsigned int n, unsigned char *jpeg_ptr, size_t jpeg_sz, PoolBuffer *preview, PoolBuffer *thumb, int64_t wallclock_us, bool publish)
+{
+	if(preview && preview->used) storage->Write(slot_preview, n, preview->ptr, preview->used, wallclock_us);
+	if(thumb && thumb->used) storage->Write(slot_thumb, n, thumb->ptr, thumb->used, wallclock_us);
+	if(storage->Write(slot_image, n, jpeg_ptr, jpeg_sz, wallclock_us) == 0 && publish) storage->Publish(n);
+}
+
+// Frame deadline: capture, compress, display and store / upload
+static void capture_frame(CaptureLoop *loop)
+{
+	FrameSource *source= loop->source;
+	Frame frame;
+	// V4L capture image. Image is borrowed from the driver at frame.ptr until ReleaseFrame
+	// No frame ready yet: no wait on the loop, the capture is done by on_camera
+	int r= source->CaptureImage(&frame, 0);
+	if(r > 0)
+	{
+		int64_t now= clock_us(CLOCK_MONOTONIC);
+		if(!loop->pending)
+		{
+			loop->pending= true;
+			loop->pending_us= now;
+			loop->waits++;
+		}
+		else if(!loop->stalled && now - loop->pending_us > FRAME_WAIT_MS * 1000L)
+		{
+			fprintf(stdout, "\nWARNING: no frame from the camera for %d ms\n", FRAME_WAIT_MS);
+			loop->stalled= true;
+		}
+		return;
+	}
+	if(r != 0) 
+	{
+		loop->reactor.Stop();
+		return;
+	}
+	loop->pending= false;
+	loop->stalled= false;
+	loop->nframes++;
+	loop->drops+= frame.dropped;
+	// static scene: the frame is not compressed, stored nor uploaded
+	if(loop->motion && !loop->motion->Check(frame.ptr, frame.length, source->wkm.pixelformat, source->wkm.width, source->wkm.height))
+	{
+		source->ReleaseFrame(&frame);
+		return;
+	}
+	
+	++loop->n %= CLIops.slots;
+	// the display thread gets a copy of the image and shows it when it can
+	if(loop->display) loop->display->Post(frame.ptr, frame.length, source->wkm.pixelformat, source->wkm.width, source->wkm.height);
+	// pipeline: the frame is handed over to the encoder threads
+	if(loop->pipeline)
+	{
+		PipelineFrame *f= PipelineFrame_create(source, &frame);
+		f->seq= loop->nframes;
+		f->n= loop->n;
+		f->lateness_us= loop->sched.lateness_us;
+		loop->pipeline->Submit(f);
+		return;
+	}
+	char filename[64];
+	snprintf(filename, sizeof(filename),"image_%03d.jpg", loop->n);
+
+	unsigned char *jpeg_ptr= 0;
+	size_t jpeg_sz=0;
+	PoolBuffer *jpeg= 0;
+	PoolBuffer *preview= 0, *thumb= 0;
+	if(previewpool)
+	{
+		preview= previewpool->Get(previewpool->slab_size);
+		thumb= thumbpool->Get(thumbpool->slab_size);
+	}
+	bool ladder= preview && thumb;
+	// YUYV
+	if(source->wkm.pixelformat == V4L2_PIX_FMT_YUYV)
+	{
+		// Compress to JPEG
+//		jpeg_sz += compressYUYV_through_RGB_to_JPEG(outfile, fullfilename, ptr_capture_buffer, CapResolution->width, CapResolution->height);
+		jpeg= jpegpool->Get(jpegpool->slab_size);
+		if(jpeg && (ladder ? encodeYUYVladder((char*)frame.ptr, source->wkm.width, source->wkm.height, jpeg, preview, thumb) :
+			encodeYUYV((char*)frame.ptr, source->wkm.width, source->wkm.height, jpeg)) > 0)
+		{
+			// Outcome is in the pool buffer (pointer to jpeg compressed image)
+			jpeg_ptr= jpeg->ptr;
+			jpeg_sz= jpeg->used;
+		}
+	}
+	// JPEG
+	else if(source->wkm.pixelformat == V4L2_PIX_FMT_MJPEG || source->wkm.pixelformat == V4L2_PIX_FMT_JPEG)
+	{
+		jpeg_ptr= (unsigned char*)frame.ptr;
+		jpeg_sz= frame.length;
+		if(ladder) encodeJPEGladder(jpeg_ptr, jpeg_sz, preview, thumb);
+	}
+	
+	if(jpeg_ptr){
+		// local readers first: no file I/O on their side
+		if(shmring) shmring->Write(jpeg_ptr, jpeg_sz, frame.sequence, frame.timestamp_us, frame.wallclock_us);
+		// Upload JPEG file into the cloud
+		// the image is copied into the POST message so the upload goes on after the frame is released
+		if(CLIops.cloud)
+		{
+			loop->upload->Start(filename, jpeg_ptr, jpeg_sz, loop->sched.lateness_us);
+			output_age(loop, &frame);
+		}
+		// Store JPEG image locally and into the archive, on the disk writer thread: the frame takes the
+		// pool buffers and an MJPEG image is copied out of the capture buffer, which goes back to the
+		// driver now. No pool buffer for the copy: the image is not stored (counted as failed)
+		if(loop->writer && !jpeg)
+		{
+			jpeg= jpegpool->Get(jpeg_sz);
+			if(jpeg)
+			{
+				memcpy(jpeg->ptr, jpeg_ptr, jpeg_sz);
+				jpeg->used= jpeg_sz;
+			}
+			else loop->writer->EncodeFailed();
+		}
+		if(loop->writer && jpeg)
+		{
+			PipelineFrame *f= PipelineFrame_create(source, &frame);
+			f->frame.index= -1;
+			f->frame.ptr= 0;
+			f->buffer= jpeg;
+			f->jpeg= jpeg->ptr;
+			f->jpeg_sz= jpeg_sz;
+			f->preview= preview;
+			f->thumb= thumb;
+			f->seq= loop->nframes;
+			f->n= loop->n;
+			f->lateness_us= loop->sched.lateness_us;
+			loop->writer->SubmitEncoded(f);
+			jpeg= preview= thumb= 0;
+		}
+		// Store JPEG image locally
+		else if(!loop->writer && !CLIops.cloud)
+		{
+			store_image(loop->n, jpeg_ptr, jpeg_sz, preview, thumb, frame.wallclock_us, true);
+			long age= output_age(loop, &frame);
+			if(CLIops.verbose) {
+				double temperature= CPUtemperature();
+				if(CLIops.verbose) printf("T=%6.2fC %s #%lu late %5.1f ms age %5.1f ms\r", temperature, filename, frame.sequence, loop->sched.lateness_us/1000.0, age/1000.0);
+			}
+		}
+		if(archive && !loop->writer) archive->Append(jpeg_ptr, jpeg_sz, frame.sequence, frame.timestamp_us, frame.wallclock_us);
+	}
+	if(jpeg) jpegpool->Release(jpeg);
+	if(preview) previewpool->Release(preview);
+	if(thumb) thumbpool->Release(thumb);
+	// give the buffer back to the driver
+	source->ReleaseFrame(&frame);
+}
+
+// PIPELINE STAGES (option threads=N)
+// Encoder: JPEG image of the frame
+// The capture buffer goes back to the source at once
+static int encode_stage(PipelineFrame *f, void *ctx)
+{
+	FrameSource *source= f->source;
+	if(previewpool)
+	{
+		f->preview= previewpool->Get(previewpool->slab_size);
+		f->thumb= thumbpool->Get(thumbpool->slab_size);
+	}
+	bool ladder= f->preview && f->thumb;
+	if(source->wkm.pixelformat == V4L2_PIX_FMT_YUYV)
+	{
+		// the frame holds the pool buffer of the JPEG image until the last sink is done with it
+		f->buffer= jpegpool->Get(jpegpool->slab_size);
+		if(!f->buffer) return -1;
+		if(ladder) f->jpeg_sz= encodeYUYVladder((char*)f->frame.ptr, source->wkm.width, source->wkm.height, f->buffer, f->preview, f->thumb);
+		else f->jpeg_sz= encodeYUYV((char*)f->frame.ptr, source->wkm.width, source->wkm.height, f->buffer);
+		f->jpeg= f->buffer->ptr;
+		PipelineFrame_releasecapture(f);
+	}
+	else if(source->wkm.pixelformat == V4L2_PIX_FMT_MJPEG || source->wkm.pixelformat == V4L2_PIX_FMT_JPEG)
+	{
+		f->buffer= jpegpool->Get(f->frame.length);
+		if(!f->buffer) return -1;
+		f->jpeg= f->buffer->ptr;
+		memcpy(f->jpeg, f->frame.ptr, f->frame.length);
+		f->buffer->used= f->frame.length;
+		f->jpeg_sz= f->frame.length;
+		PipelineFrame_releasecapture(f);
+		if(ladder) encodeJPEGladder(f->jpeg, f->jpeg_sz, f->preview, f->thumb);
+	}
+	return f->jpeg_sz > 0 ? 0 : -1;
+}
+
+// Disk sink. Frames may come out of the encoders out of order: only a newer frame is announced in DATA_FILE
+static void disk_sink(PipelineFrame *f, void *ctx)
+{
+	CaptureLoop *loop= (CaptureLoop *) ctx;
+	char filename[64];
+	snprintf(filename, sizeof(filename),"image_%03d.jpg", f->n);
+	bool publish= f->seq > loop->published;
+	if(publish) loop->published= f->seq;
+	store_image(f->n, f->jpeg, f->jpeg_sz, f->preview, f->thumb, f->frame.wallclock_us, publish);
+	long age= output_age(loop, &f->frame);
+	if(CLIops.verbose) {
+		double temperature= CPUtemperature();
+		printf("T=%6.2fC %s #%lu late %5.1f ms age %5.1f ms\r", temperature, filename, f->frame.sequence, f->lateness_us/1000.0, age/1000.0);
+	}
+}
+
+// Shared memory sink: the image into the ring of local readers (option shm)
+static void shm_sink(PipelineFrame *f, void *ctx)
+{
+	if(shmring) shmring->Write(f->jpeg, f->jpeg_sz, f->frame.sequence, f->frame.timestamp_us, f->frame.wallclock_us);
+}
+
+// Archive sink: every image appended to the archive (option archive=DIR)
+static void archive_sink(PipelineFrame *f, void *ctx)
+{
+	if(archive) archive->Append(f->jpeg, f->jpeg_sz, f->frame.sequence, f->frame.timestamp_us, f->frame.wallclock_us);
+}
+
+// Cloud sink. Blocking upload: the sink has a thread of its own
+static void cloud_sink(PipelineFrame *f, void *ctx)
+{
+	CaptureLoop *loop= (CaptureLoop *) ctx;
+	POSTMessageMemory *postmem= loop->cloudmem;
+	char filename[64];
+	snprintf(filename, sizeof(filename),"image_%03d.jpg", f->n);
+	double elapsed=0;
+	char result[128];
+	result[0]='\0';
+	postmem->size(f->jpeg_sz);
+	upload_image(postmem, filename, (char *) f->jpeg, &elapsed, result);
+	long age= output_age(loop, &f->frame);
+	if(CLIops.verbose) 
+	{
+		double temperature= CPUtemperature();
+		printf("T=%6.2fC %s #%lu %.2f ms late %.1f ms age %.1f ms %s\n", temperature, filename, f->frame.sequence, elapsed/1000, f->lateness_us/1000.0, age/1000.0, result);
+	}				
+}
+
+// Display thread: latest image posted by capture_frame into the hidden framebuffer (fbdisplay.h)
+static void display_render(DisplayImage *image, FBSurface *fb, void *ctx)
+{
+	CaptureLoop *loop= (CaptureLoop *) ctx;
+	ImageInfo info;
+	if(image->pixelformat == V4L2_PIX_FMT_YUYV)
+	{
+		int x0, y0;
+		info.width= image->width;
+		info.height= image->height;
+		display_centre(info.width, info.height, fb->vinfo, &x0, &y0);
+		display_imgageYUVY_2_fb(&info, (char *) &image->data[0], fb, x0, y0);
+	}
+	else JPEG_decompress_fb(&info, &image->data[0], image->size, fb, loop->display_num);
+}
+
+// Capture timer
+static void on_timer(int fd, uint32_t events, void *ctx)
+{
+	CaptureLoop *loop= (CaptureLoop *) ctx;
+	loop->sched.Expired();
+	if(loop->upload) loop->upload->CheckTimeout();
+	capture_frame(loop);
+}
+
+// Camera has a frame ready
+static void on_camera(int fd, uint32_t events, void *ctx)
+{
+	CaptureLoop *loop= (CaptureLoop *) ctx;
+	if(loop->source->FrameReady() != 0) loop->reactor.Stop();
+	// capture of the last deadline waiting for this frame
+	else if(loop->pending) capture_frame(loop);
+}
+
+// Key pressed
+static void on_keyboard(int fd, uint32_t events, void *ctx)
+{
+	CaptureLoop *loop= (CaptureLoop *) ctx;
+	char c;
+	bool key= false;
+	while(read(fd, &c, 1) == 1) key= true;
+	if(key || (events & (EPOLLHUP | EPOLLERR)))
+	{
+		printf("\r");
+		printf("Program terminated by user\n");
+		loop->reactor.Stop();
+	}
+}
+
+// SIGINT or SIGTERM (kill, service stop): the loop ends as with a key, so that the statistics are
+// printed and the readers of the shared memory ring are told
+static void on_signal(int fd, uint32_t events, void *ctx)
+{
+	CaptureLoop *loop= (CaptureLoop *) ctx;
+	struct signalfd_siginfo si;
+	if(read(fd, &si, sizeof(si)) != sizeof(si)) return;
+	printf("\r");
+	printf("Program terminated by signal %u\n", si.ssi_signo);
+	loop->reactor.Stop();
+}
+
+#define BENCH_FRAMES	50
+
+// ms per frame of BENCH_FRAMES frames since t0
+static double bench_ms(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6) / BENCH_FRAMES;
+}
+
+// YUYV -> BGRX against the floating point BT.601 conversion (yuyv_bt601) for every Y, Cb, Cr: 
+// rows of 128 pairs (Y 0 ... 255) for each Cb, Cr. Off by one pixels are rounding of values within 
+// 2^-13 of a half; the fixed point kernels give the same bytes whatever the CPU
+static void bench_bt601(const YUYVKernels **sets)
+{
+	vector<uint8_t> src(128 * 4), out[2];
+	out[0].resize(128 * 8);
+	out[1].resize(128 * 8);
+	unsigned long off= 0, differ= 0;
+	int maxerr= 0;
+	for(int cb=0; cb<256; cb++)
+		for(int cr=0; cr<256; cr++)
+		{
+			for(int i=0; i<128; i++)
+			{
+				src[4*i]= (uint8_t) (2 * i);
+				src[4*i+1]= (uint8_t) cb;
+				src[4*i+2]= (uint8_t) (2 * i + 1);
+				src[4*i+3]= (uint8_t) cr;
+			}
+			for(int k=0; k<2; k++) sets[k]->to_bgrx(&src[0], 128, &out[k][0]);
+			if(out[0] != out[1]) differ++;
+			for(int y=0; y<256; y++)
+			{
+				uint8_t ref[3];
+				yuyv_bt601(y, cb, cr, &ref[0], &ref[1], &ref[2]);
+				for(int c=0; c<3; c++)
+				{
+					int err= abs(out[0][4*y+c] - ref[c]);
+					if(err) off++;
+					if(err > maxerr) maxerr= err;
+				}
+			}
+		}
+	fprintf(stdout, "\n\tBT.601 check     %lu of %d samples off the floating point conversion (%.3f%%), max error %d, %s", off, 256 * 256 * 256 * 3, 
+		off * 100.0 / (256.0 * 256 * 256 * 3), maxerr, differ == 0 ? "same on every kernel" : "KERNELS DIFFER");
+}
+
+// YUYV display (display_imgageYUVY_2_fb) into a framebuffer in memory the size of the frame, 32 bpp 
+// and RGB565
+static void bench_display(const uint8_t *frame, int width, int height)
+{
+	struct fb_var_screeninfo vinfo;
+	memset(&vinfo, 0, sizeof(vinfo));
+	vinfo.xres= width;
+	vinfo.yres= height;
+	fprintf(stdout, "\n\tYUYV display    ");
+	for(int bpp=32; bpp>=16; bpp-= 16)
+	{
+		vinfo.bits_per_pixel= bpp;
+		vinfo.red.offset= bpp == 32 ? 16 : 11;
+		vinfo.green.length= bpp == 32 ? 8 : 6;
+		vector<char> mem((size_t) width * height * bpp / 8);
+		FBSurface fb;
+		fb.ptr= &mem[0];
+		fb.vinfo= &vinfo;
+		fb.stride= (size_t) width * bpp / 8;
+		ImageInfo info;
+		info.width= width;
+		info.height= height;
+		struct timespec t0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(int i=0; i<BENCH_FRAMES; i++) display_imgageYUVY_2_fb(&info, (char *) frame, &fb, 0, 0);
+		double ms= bench_ms(&t0);
+		fprintf(stdout, " %2d bpp %6.2f ms/frame (%.0f fps)", bpp, ms, ms > 0 ? 1000 / ms : 0);
+	}
+}
+
+// YUYV kernels benchmark (command --bench)
+// Each converter of the kernels picked for this CPU runs over the frame and over a synthetic frame
+// with every Y, Cb, Cr combination; results must match the scalar converters byte by byte
+static void bench_kernels(const uint8_t *frame, int width, int height)
+{
+	const YUYVKernels *sets[2]= {&yuyv_scalar, yuyv_kernels()};
+	int pairs= width / 2;
+	size_t frame_sz= (size_t) width * height * 2;
+	// synthetic: Y0 and Y1 run through 0 ... 255 against every Cb, Cr (256 x 256 pairs)
+	vector<uint8_t> synth(256 * 256 * 4);
+	for(size_t i=0; i<256 * 256; i++)
+	{
+		synth[4*i]= (uint8_t) i;
+		synth[4*i+1]= (uint8_t) (i >> 8);
+		synth[4*i+2]= (uint8_t) (255 - i);
+		synth[4*i+3]= (uint8_t) (i * 7 + (i >> 8));
+	}
+	vector<uint8_t> out[2][3];
+	double ms[2][3];
+	for(int k=0; k<2; k++)
+	{
+		vector<uint8_t> *o= out[k];
+		o[0].assign(frame_sz + synth.size(), 0);
+		o[1].assign((frame_sz + synth.size()) * 3 / 2, 0);
+		o[2].assign((frame_sz + synth.size()) * 2, 0);
+		for(int f=0; f<3; f++)
+		{
+			struct timespec t0, t1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for(int i=0; i<BENCH_FRAMES; i++)
+				for(int y=0; y<height; y++)
+				{
+					const uint8_t *src= frame + (size_t) y * width * 2;
+					size_t px= (size_t) y * width;
+					if(f == 0) sets[k]->to_planes(src, pairs, &o[0][px], &o[0][frame_sz / 2 + px / 2], &o[0][frame_sz * 3 / 4 + px / 2]);
+					else if(f == 1) sets[k]->to_ycbcr(src, pairs, &o[1][px * 3]);
+					else sets[k]->to_bgrx(src, pairs, &o[2][px * 4]);
+				}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			ms[k][f]= ((t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6) / BENCH_FRAMES;
+		}
+		// synthetic frame, odd row length so that the tail of every kernel runs as well
+		int spairs= 255;
+		for(size_t i=0; i + spairs <= 256 * 256; i+= spairs)
+		{
+			const uint8_t *src= &synth[i * 4];
+			sets[k]->to_planes(src, spairs, &o[0][frame_sz + i * 2], &o[0][frame_sz + synth.size() / 2 + i], &o[0][frame_sz + synth.size() * 3 / 4 + i]);
+			sets[k]->to_ycbcr(src, spairs, &o[1][(frame_sz + i * 4) * 3 / 2]);
+			sets[k]->to_bgrx(src, spairs, &o[2][(frame_sz + i * 4) * 2]);
+		}
+	}
+	const char *names[3]= {"YUYV -> planes", "YUYV -> YCbCr", "YUYV -> BGRX"};
+	fprintf(stdout, "\nYUYV kernels: %s", sets[1]->name);
+	for(int f=0; f<3; f++)
+		fprintf(stdout, "\n\t%-16s scalar %6.2f ms/frame %-6s %6.2f ms/frame (x%.1f)  %s", names[f], ms[0][f], sets[1]->name, ms[1][f], 
+			ms[1][f] > 0 ? ms[0][f] / ms[1][f] : 0, out[0][f] == out[1][f] ? "same as scalar" : "DIFFERS FROM SCALAR");
+	bench_bt601(sets);
+	bench_display(frame, width, height);
+	fprintf(stdout, "\n");
+}
+
+// Analysis of a JPEG image: luma grid from the DC coefficients, from a 1/8 libjpeg decode, and
+// full decode. The DC grid is checked against the 1/8 decode
+static void bench_analysis(unsigned char *jpeg, int jpeg_sz, vector<unsigned char> *decoded)
+{
+	ChangeDetector dc(1, 0), scaled(1, 0);
+	ImageInfo info;
+	struct timespec t0;
+	int rc= 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(int i=0; i<BENCH_FRAMES; i++) rc|= dc.LumaJPEG(jpeg, jpeg_sz);
+	double ms_dc= bench_ms(&t0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(int i=0; i<BENCH_FRAMES; i++) rc|= scaled.LumaScaled(jpeg, jpeg_sz);
+	double ms_scaled= bench_ms(&t0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(int i=0; i<BENCH_FRAMES; i++) rc|= JPEG_decompress(&info, jpeg, jpeg_sz, &(*decoded)[0], decoded->size(), 8);
+	double ms_full= bench_ms(&t0);
+	int diff= -1;
+	if(rc == 0 && dc.grid.size() == scaled.grid.size())
+	{
+		diff= 0;
+		for(size_t i=0; i<dc.grid.size(); i++) diff= max(diff, abs((int) dc.grid[i] - (int) scaled.grid[i]));
+	}
+	fprintf(stdout, "\n\t    analysis: DC map %.3f ms (%.0f%% of the 1/8 decode), 1/8 decode %.3f ms, full decode %.3f ms  ", ms_dc,
+		ms_scaled > 0 ? 100 * ms_dc / ms_scaled : 0, ms_scaled, ms_full);
+	if(diff < 0) fprintf(stdout, "DC map FAILED");
+	else fprintf(stdout, "DC map vs 1/8 decode: max difference %d", diff);
+}
+
+// Encoder benchmark (command --bench)
+// A YUYV frame is compressed BENCH_FRAMES times by each encoder. Every image is decoded and compared 
+// with the image of the single pass encoder of the same path
+static int bench_jpeg(FrameSource *source, int nstrips)
+{
+	if(source->wkm.pixelformat != V4L2_PIX_FMT_YUYV)
+	{
+		fprintf(stdout, "\nERROR: --bench needs YUYV frames (option yuyv)\n");
+		return -1;
+	}
+	Frame frame;
+	if(source->CaptureImage(&frame) != 0)
+	{
+		fprintf(stdout, "\nERROR: --bench no frame captured\n");
+		return -1;
+	}
+	int width= source->wkm.width;
+	int height= source->wkm.height;
+	bench_kernels((const uint8_t *) frame.ptr, width, height);
+	// change detection
+	ChangeDetector motion(1, 0);
+	for(int i=0; i<BENCH_FRAMES; i++) motion.Check(frame.ptr, frame.length, source->wkm.pixelformat, width, height);
+	fprintf(stdout, "\nChange detection: %.1f us/frame (YUYV)\n", motion.sum_us / motion.frames);
+	fprintf(stdout, "\nJPEG encoder benchmark: %dx%d YUYV, %d frames, %ld cores\n", width, height, BENCH_FRAMES, sysconf(_SC_NPROCESSORS_ONLN));
+	struct
+	{
+		const char *name;
+		YUYVpath path;
+		int nstrips;
+	} encoders[]= {
+		{"scanlines 4:2:0", yuyv_scanlines420, 1},
+		{"scanlines 4:2:0", yuyv_scanlines420, nstrips},
+		{"raw 4:2:2", yuyv_raw422, 1},
+		{"raw 4:2:2", yuyv_raw422, nstrips},
+	};
+	FramePool pool("jpeg", (size_t) width * height * 2, 1);
+	vector<unsigned char> reference;
+	vector<unsigned char> decoded((size_t) width * height * 3);
+	for(size_t k=0; k<sizeof(encoders)/sizeof(encoders[0]); k++)
+	{
+		yuyvpath= encoders[k].path;
+		stripenc= encoders[k].nstrips > 1 ? new StripEncoder(encoders[k].nstrips, yuyvpath) : 0;
+		PoolBuffer *jpeg= 0;
+		int jpeg_sz= 0;
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(int i=0; i<BENCH_FRAMES; i++)
+		{
+			if(jpeg) pool.Release(jpeg);
+			jpeg= pool.Get(pool.slab_size);
+			jpeg_sz= encodeYUYV((char *) frame.ptr, width, height, jpeg);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		double ms= ((t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6) / BENCH_FRAMES;
+		// decoded image vs single pass
+		ImageInfo info;
+		const char *check= "reference";
+		if(jpeg_sz <= 0 || JPEG_decompress(&info, jpeg->ptr, jpeg_sz, &decoded[0], decoded.size(), 8) != 0) check= "DECODE FAILED";
+		else
+		{
+			size_t sz= (size_t) info.width * info.height * info.pixel_size;
+			if(!stripenc) reference.assign(decoded.begin(), decoded.begin() + sz);
+			else check= reference.size() == sz && memcmp(&reference[0], &decoded[0], sz) == 0 ? "decoded image identical" : "decoded image DIFFERS";
+		}
+		char name[48];
+		if(stripenc) snprintf(name, sizeof(name), "%s %d strips", encoders[k].name, encoders[k].nstrips);
+		else snprintf(name, sizeof(name), "%s", encoders[k].name);
+		fprintf(stdout, "\n\t%-26s %7.2f ms/frame %7.1f fps %8d bytes  %s", name, ms, ms > 0 ? 1000 / ms : 0, jpeg_sz, check);
+		if(jpeg_sz > 0) bench_analysis(jpeg->ptr, jpeg_sz, &decoded);
+		pool.Release(jpeg);
+		if(stripenc) delete stripenc;
+		stripenc= 0;
+	}
+	// output ladder: full image (as the raw 4:2:2 single pass above), preview and thumbnail in one pass
+	{
+		yuyvpath= yuyv_raw422;
+		FramePool previews("preview", ladder_slab(width, height, 1), 1);
+		FramePool thumbs("thumb", ladder_slab(width, height, 2), 1);
+		PoolBuffer *jpeg= pool.Get(pool.slab_size);
+		PoolBuffer *preview= previews.Get(previews.slab_size);
+		PoolBuffer *thumb= thumbs.Get(thumbs.slab_size);
+		int jpeg_sz= 0;
+		struct timespec t0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(int i=0; i<BENCH_FRAMES; i++) jpeg_sz= encodeYUYVladder((char *) frame.ptr, width, height, jpeg, preview, thumb);
+		double ms= bench_ms(&t0);
+		ImageInfo info;
+		const char *check= "full image identical";
+		if(jpeg_sz <= 0 || JPEG_decompress(&info, jpeg->ptr, jpeg_sz, &decoded[0], decoded.size(), 8) != 0) check= "DECODE FAILED";
+		else if(reference.size() != (size_t) info.width * info.height * info.pixel_size || memcmp(&reference[0], &decoded[0], reference.size()) != 0) 
+			check= "full image DIFFERS";
+		fprintf(stdout, "\n\t%-26s %7.2f ms/frame %7.1f fps %8d + %d + %d bytes  %s", "ladder 1, 1/2, 1/4", ms, ms > 0 ? 1000 / ms : 0, jpeg_sz, 
+			(int) preview->used, (int) thumb->used, check);
+		pool.Release(jpeg);
+		previews.Release(preview);
+		thumbs.Release(thumb);
+	}
+	fprintf(stdout, "\n\n");
+	source->ReleaseFrame(&frame);
+	return 0;
+}
+
 static void usage(void)
 {
 	printf("\n");
@@ -881,6 +2227,7 @@ static void usage(void)
 		"   time      - capture period in miliseconds (<=100 recommended)\n"
 		"commands are:\n"
 		"   --info    - shows camera information\n"	
+		"   --bench   - JPEG encoder benchmark on a YUYV frame (camera or replay file)\n"
 		"Options are:\n"
 		"   videoX    - select camera driver /dev/videoX. Default is video0\n"
 		"   qvga      - set QVGA capture(320x240)\n"
@@ -894,23 +2241,48 @@ static void usage(void)
 		"   noverbose - stop console output\n"
 		"   agent     - runs silently: set noverbose and disable kbhit\n"
 		"   cloud     - upload image to cloud host instead of local camera storage (default is local)\n"
+		"   buffers=N - number of V4L streaming buffers (default 4)\n"
+		"   replay=F  - play back capture file F (raw YUYV or concatenated JPEGs) instead of the camera\n"
+		"   loop      - rewind the replay file when it ends\n"
+		"   nocache   - probe the camera formats instead of reading the capabilities cache\n"
+		"   nopace    - leave the camera at its own frame rate instead of the one closest to the capture period\n"
+		"   overrun=P - frame later than one period: 'skip' missed frames (default) or 'catchup'\n"
+		"   threads=N - run compression and outputs on a pipeline of threads with N encoder threads\n"
+		"   queue=N   - pipeline queue depth (default 2)\n"
+		"   drop=P    - pipeline queue full: drop 'oldest' frame (default), drop 'newest' frame or 'block'\n"
+		"   strips=N  - YUYV: encode N strips of the image in parallel (one per core)\n"
+		"   jpeg420   - YUYV: 4:2:0 JPEG, smaller but slower to encode than 4:2:2 (default)\n"
+		"   bytes=N   - YUYV: adjust the JPEG quality frame to frame to N bytes per frame\n"
+		"   rate=N    - YUYV: adjust the JPEG quality frame to frame to N bytes per second\n"
+		"   motion=P  - keep only frames where P %% of the image changed (e.g. motion=1)\n"
+		"   keep=N    - motion: keep one static frame every N (default 0, none)\n"
+		"   dark=N    - do not keep frames with a mean luma (0 ... 255) below N (night)\n"
+		"   huffman=H - YUYV: 'std' (default) or 'opt' (optimized) Huffman tables, 'auto' optimized when over budget\n"
+		"   ladder    - also store a preview (1/2) and a thumbnail (1/4) of every image, preview_NNN.jpg and thumb_NNN.jpg\n"
+		"   ladder=P,T - ladder with JPEG quality P for the preview and T for the thumbnail (default 80,70)\n"
+		"   slots=N   - number of image files written in turn (default 20)\n"
+		"   writeq=N  - images waiting for the disk writer thread (default 4), 0 writes them on the capture loop\n"
+		"   shm       - also put the images into shared memory for local readers (see tlring)\n"
+		"   shm=N     - shared memory ring of N images (default 8)\n"
+		"   archive=D - also append every image to segment files in directory D (see tlarc)\n"
+		"   segment=N - archive: new segment file after N MB (default %d)\n"
+		"   rotate=H  - archive: new segment file after H hours (default %d)\n"
+		"   retain=D  - archive: remove the segments older than D days (default 0, keep all)\n"
+		"   retainmb=N - archive: remove the oldest segments to keep it under N MB (default 0, no limit)\n"
 		"\nexample:\n"
 		"   tlcam 100\n"
 		"   tlcam 100 yuyv vga\n"
 		"   tlcam 100 agent\n"
-		"\n");
+		"   tlcam 0 replay=capture.mjpg agent\n"
+		"\n", ARCHIVE_SEGMENT_MB, ARCHIVE_ROTATE_H);
 } 
 
 int main(int argc, char *argv[]) 
 {
 	string command;
 	bool is_cli= false;
-	POSTMessageMemory postmem;
 	string video= "video0";
 	
-	// memory
-	gmemptr= 0;
-	gmemsize= 0;	
 	char str[128]; // general usage
 	fprintf(stdout,"Time Lapse Camera version %s", version(str, sizeof(str)));
 	if(argc<=1)
@@ -965,11 +2337,50 @@ int main(int argc, char *argv[])
 				else if(strcmp(str, "mjpg")==0 || strcmp(str, "mjpeg")==0) { strcpy(CLIops.V4L_format, "MJPG");}
 				else if(strcmp(str, "display")==0) CLIops.display= true;				
 				else if(strcmp(str, "cloud")==0) CLIops.cloud= true;				
+				else if(strncmp(str, "buffers=", strlen("buffers="))==0) CLIops.buffers= atoi(&str[strlen("buffers=")]);
+				else if(strncmp(str, "replay=", strlen("replay="))==0) CLIops.replay= &argv[i][strlen("replay=")];
+				else if(strcmp(str, "loop")==0) CLIops.loop= true;
+				else if(strcmp(str, "nocache")==0) CLIops.cache= false;
+				else if(strcmp(str, "nopace")==0) CLIops.pace= false;
+				else if(strcmp(str, "overrun=skip")==0) CLIops.overrun= overrun_skip;
+				else if(strcmp(str, "overrun=catchup")==0) CLIops.overrun= overrun_catchup;
+				else if(strncmp(str, "threads=", strlen("threads="))==0) CLIops.threads= atoi(&str[strlen("threads=")]);
+				else if(strncmp(str, "queue=", strlen("queue="))==0) CLIops.queue= atoi(&str[strlen("queue=")]);
+				else if(strcmp(str, "drop=oldest")==0) CLIops.drop= drop_oldest;
+				else if(strcmp(str, "drop=newest")==0) CLIops.drop= drop_newest;
+				else if(strcmp(str, "drop=block")==0) CLIops.drop= drop_block;
+				else if(strncmp(str, "strips=", strlen("strips="))==0) CLIops.strips= atoi(&str[strlen("strips=")]);
+				else if(strcmp(str, "jpeg420")==0) CLIops.jpeg420= true;
+				else if(strncmp(str, "bytes=", strlen("bytes="))==0) CLIops.bytes= atol(&str[strlen("bytes=")]);
+				else if(strncmp(str, "rate=", strlen("rate="))==0) CLIops.rate= atol(&str[strlen("rate=")]);
+				else if(strncmp(str, "motion=", strlen("motion="))==0) CLIops.motion= atof(&str[strlen("motion=")]);
+				else if(strncmp(str, "keep=", strlen("keep="))==0) CLIops.keep= atoi(&str[strlen("keep=")]);
+				else if(strncmp(str, "dark=", strlen("dark="))==0) CLIops.dark= atoi(&str[strlen("dark=")]);
+				else if(strcmp(str, "huffman=std")==0) CLIops.huffman= huffman_std;
+				else if(strcmp(str, "huffman=opt")==0) CLIops.huffman= huffman_opt;
+				else if(strcmp(str, "huffman=auto")==0) CLIops.huffman= huffman_auto;
+				else if(strcmp(str, "ladder")==0) CLIops.ladder= true;
+				else if(strncmp(str, "ladder=", strlen("ladder="))==0)
+				{
+					CLIops.ladder= true;
+					sscanf(&str[strlen("ladder=")], "%d,%d", &ladder_quality[1], &ladder_quality[2]);
+				}
+				else if(strncmp(str, "slots=", strlen("slots="))==0) CLIops.slots= atoi(&str[strlen("slots=")]);
+				else if(strncmp(str, "writeq=", strlen("writeq="))==0) CLIops.writeq= atoi(&str[strlen("writeq=")]);
+				else if(strcmp(str, "shm")==0) CLIops.shm= SHMRING_SLOTS;
+				else if(strncmp(str, "shm=", strlen("shm="))==0) CLIops.shm= atoi(&str[strlen("shm=")]);
+				else if(strncmp(str, "archive=", strlen("archive="))==0) CLIops.archive= &argv[i][strlen("archive=")];
+				else if(strncmp(str, "segment=", strlen("segment="))==0) CLIops.segment= atol(&str[strlen("segment=")]);
+				else if(strncmp(str, "rotate=", strlen("rotate="))==0) CLIops.rotate= atol(&str[strlen("rotate=")]);
+				else if(strncmp(str, "retain=", strlen("retain="))==0) CLIops.retain= atol(&str[strlen("retain=")]);
+				else if(strncmp(str, "retainmb=", strlen("retainmb="))==0) CLIops.retainmb= atol(&str[strlen("retainmb=")]);
 			}
 		}
 	}
 
 	CLIops.time= n_numbers>=1? numbers[0]: 100; // miliseconds 
+	if(CLIops.slots < 1) CLIops.slots= 1;
+	if(CLIops.slots > SLOTS_MAX) CLIops.slots= SLOTS_MAX;
 	if(CLIops.agent) CLIops.verbose= false;
 	
 	// Resolution
@@ -984,10 +2395,22 @@ int main(int argc, char *argv[])
 		default:   res= (CaptureResolution) { 640, 480}; restxt= "unknown - VGA 640x480";
 	}
 	
-	// (1) Create V4L object for Camera 1
+	// (1) Create the frame source: V4L object for Camera 1 or the replay file
 	string video_dev= "/dev/" + video;
-	V4L_device v4lcam(video_dev.c_str()); 
-	if(v4lcam.dev == -1)
+	V4L_device *v4lcam= 0;
+	FrameSource *source;
+	if(CLIops.replay)
+	{
+		ReplaySource *replay= new ReplaySource(CLIops.replay);
+		replay->loop= CLIops.loop;
+		source= replay;
+	}
+	else
+	{
+		source= v4lcam= new V4L_device(video_dev.c_str()); 
+		v4lcam->use_cache= CLIops.cache;
+	}
+	if(source->dev == -1)
 	{
 		fprintf(stdout, "\nERROR: Failure creating device");
 		exit(EXIT_FAILURE);
@@ -995,220 +2418,319 @@ int main(int argc, char *argv[])
 	
 	if(is_cli)
 	{
-		if( command == "info")
+		if( command == "info" && v4lcam)
+		{
+			v4lcam->printinfo(); 
+		}
+		else if( command == "bench")
 		{
-			v4lcam.printinfo(); 
+			if(source->SetWorkingMode(res, CLIops.V4L_format) < 0 || source->AllocateBuffer(CLIops.buffers) ==  (void *) -1)
+			{
+				fprintf(stdout, "\nERROR: SetWorkingMode");
+				exit(EXIT_FAILURE);
+			}
+			int nstrips= CLIops.strips > 1 ? CLIops.strips : (int) sysconf(_SC_NPROCESSORS_ONLN);
+			bench_jpeg(source, nstrips < 2 ? 2 : nstrips);
 		}
 		else
 			fprintf(stdout, "\nUnknown command %s\n", command.c_str());
 	}
 	else
 	{
-		char *fbp= 0;
-		struct fb_var_screeninfo vinfo;		
-		long int fb_size= 0;	// amount of bytes
-		int fb= 0;
 		// (2) FRAMEBUFFER INIT		
+		// double buffered when the driver can pan, drawn on a thread of its own
+		FBDisplay *display= 0;
 		if(CLIops.display)
 		{
-
-			struct fb_fix_screeninfo finfo;	
-			fb = open(FRAMEBUFFER_DEVICE, O_RDWR);
-			if (fb == -1) {
-				perror("ERROR: cannot open framebuffer device");
-				exit(EXIT_FAILURE);
-			}
-			// Get fixed screen information
-			if (ioctl(fb, FBIOGET_FSCREENINFO, &finfo) == -1) {
-				perror("ERROR reading fixed information");
-				exit(EXIT_FAILURE);
-			}
-			// Get variable screen information
-			if (ioctl(fb, FBIOGET_VSCREENINFO, &vinfo) == -1) {
-				perror("ERROR reading variable information");
-				exit(EXIT_FAILURE);
+			display= new FBDisplay();
+			if(display->Open(FRAMEBUFFER_DEVICE) != 0) exit(EXIT_FAILURE);
+			if(fb_format(&display->vinfo) == fb_unsupported)
+			{
+				fprintf(stdout, "\nWARNING: framebuffer pixel format not supported (%u bits per pixel), no display", display->vinfo.bits_per_pixel);
+				delete display;
+				display= 0;
+				CLIops.display= false;
 			}
-			fb_size = vinfo.xres * vinfo.yres * (vinfo.bits_per_pixel / 8);
-			// Map to memory
-			fbp = (char *)mmap(0, fb_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb, 0);
-			if ((int)fbp == -1) {
-				perror("ERROR: failed to map framebuffer device to memory");
-				exit(EXIT_FAILURE);
-			}	
 		}
 		
 		// Show camera information
-		v4lcam.GetDriverInfo();
-		fprintf(stdout, "\nCamera information (%s)", ("/dev/" + video).c_str());
-		fprintf(stdout, "\n\tDriver:        \"%s\"", v4lcam.drvinfo.driver);
-		fprintf(stdout, "\n\tCard:          \"%s\"", v4lcam.drvinfo.card);
-		fprintf(stdout, "\n\tBus:           \"%s\"", v4lcam.drvinfo.bus_info);		
+		if(v4lcam)
+		{
+			v4lcam->GetDriverInfo();
+			fprintf(stdout, "\nCamera information (%s)", ("/dev/" + video).c_str());
+			fprintf(stdout, "\n\tDriver:        \"%s\"", v4lcam->drvinfo.driver);
+			fprintf(stdout, "\n\tCard:          \"%s\"", v4lcam->drvinfo.card);
+			fprintf(stdout, "\n\tBus:           \"%s\"", v4lcam->drvinfo.bus_info);		
+		}
+		else
+			fprintf(stdout, "\nReplay file (%s)", CLIops.replay);
 		
 		// (3) V4L set working mode	
 		int wkmf;
-		if((wkmf=v4lcam.SetWorkingMode(res, CLIops.V4L_format)) < 0)
+		if((wkmf=source->SetWorkingMode(res, CLIops.V4L_format)) < 0)
 		{
 			fprintf(stdout, "\nERROR: SetWorkingMode");
 			fflush(stdout);
 			exit(EXIT_FAILURE);
 		}		
 
+		// camera frame rate: before streaming starts
+		int paced= v4lcam && CLIops.pace ? v4lcam->SetFrameInterval(CLIops.time) : -1;
+
 		// (4) V4L allocate image buffer	
-		if(v4lcam.AllocateBuffer() ==  (void *) -1) exit(EXIT_FAILURE);
+		if(source->AllocateBuffer(CLIops.buffers) ==  (void *) -1) exit(EXIT_FAILURE);
 		
 		// Show working mode	
 		fprintf(stdout, "\nWorking mode:");	
-		fprintf(stdout, "\n\tCapture period=%d ms", CLIops.time);	
+		fprintf(stdout, "\n\tCapture period=%d ms (overrun %s)", CLIops.time, CLIops.overrun==overrun_skip? "skip" : "catch-up");	
 		int index= -1;
 		size_t i=0;
 		for(; i<sizeof(V4L_formats)/sizeof(int) && wkmf!= (int)V4L_formats[i] ; i++);
 		if(i<sizeof(V4L_formats)/sizeof(int)) index= (int) i;
 		fprintf(stdout, "\n\tFormat= %s", (index>=0) ? V4L_formats_str[index] : "Unknown");
 		//fprintf(stdout, "\n\tFormat= %s", CLIops.yuyv?"YUYV":"MPEJ");	
-		fprintf(stdout, "\n\tResolution %s", restxt); //CLIops.vga?"VGA 640x480":"QVGA 320x240 (default)");
+		if(v4lcam)
+		{
+			fprintf(stdout, "\n\tResolution %s", restxt); //CLIops.vga?"VGA 640x480":"QVGA 320x240 (default)");
+			fprintf(stdout, "\n\tBuffers= %d", v4lcam->nbuffers);
+			struct v4l2_fract *fi= &v4lcam->interval;
+			if(paced >= 0) fprintf(stdout, "\n\tCamera frame interval= %u/%u s (%.2f fps)%s", fi->numerator, fi->denominator, (double) fi->denominator / fi->numerator, 
+				paced == 0 ? ", one frame per period" : ", frames picked by the capture timer");
+			else fprintf(stdout, "\n\tCamera frame interval= default%s", CLIops.pace && CLIops.time > 0 ? " (cannot be set)" : "");
+		}
+		else
+		{
+			fprintf(stdout, "\n\tResolution %dx%d", source->wkm.width, source->wkm.height);
+			fprintf(stdout, "\n\tFrames= %d%s", (int) ((ReplaySource *) source)->nframes, CLIops.loop? " (loop)" : "");
+		}
+		// the ladder encodes the full image in the same pass as the smaller ones: one 4:2:2 libjpeg pass
+		if(CLIops.ladder && CLIops.cloud)
+		{
+			fprintf(stdout, "\nWARNING: ladder images are stored locally, not with cloud, ignored");
+			CLIops.ladder= false;
+		}
+		if(CLIops.ladder && wkmf == V4L2_PIX_FMT_YUYV && (CLIops.strips > 1 || CLIops.jpeg420))
+		{
+			fprintf(stdout, "\nWARNING: ladder encodes 4:2:2 in one pass, strips and jpeg420 not used");
+			CLIops.strips= 0;
+			CLIops.jpeg420= false;
+		}
+		yuyvpath= CLIops.jpeg420 ? yuyv_scanlines420 : yuyv_raw422;
+		if(wkmf == V4L2_PIX_FMT_YUYV)
+			fprintf(stdout, "\n\tJPEG %s", CLIops.jpeg420 ? "4:2:0" : "4:2:2");
+		if(wkmf == V4L2_PIX_FMT_YUYV && CLIops.strips > 1)
+		{
+			stripenc= new StripEncoder(CLIops.strips, yuyvpath);
+			fprintf(stdout, ", %d strips", CLIops.strips);
+		}
+		// byte budget per frame: bytes=N, or rate=N over the capture period
+		huffman= CLIops.huffman;
+		long budget= CLIops.bytes;
+		if(budget <= 0 && CLIops.rate > 0)
+		{
+			if(CLIops.time > 0) budget= CLIops.rate * CLIops.time / 1000;
+			else fprintf(stdout, "\nWARNING: rate=N needs a capture period, ignored");
+		}
+		if(budget > 0 && wkmf != V4L2_PIX_FMT_YUYV)
+			fprintf(stdout, "\nWARNING: the JPEG budget applies to YUYV captures only, ignored");
+		else if(budget > 0)
+		{
+			ratectl= new RateControl((size_t) budget, huffman);
+			fprintf(stdout, "\n\tJPEG budget %ld bytes/frame", budget);
+		}
+		if(wkmf == V4L2_PIX_FMT_YUYV && huffman != huffman_std)
+		{
+			fprintf(stdout, "%sHuffman tables %s", ratectl ? ", " : "\n\t", huffman == huffman_opt ? "optimized" : "optimized when over budget");
+			if(stripenc) fprintf(stdout, " (not with strips)");
+		}
+		ChangeDetector *motion= 0;
+		if(CLIops.motion > 0 || CLIops.dark > 0)
+			motion= new ChangeDetector(CLIops.motion, CLIops.keep, CLIops.dark);
+		if(CLIops.motion > 0)
+		{
+			fprintf(stdout, "\n\tMotion: frames with %.1f%% of the image changed", CLIops.motion);
+			if(CLIops.keep > 0) fprintf(stdout, ", one static frame every %d", CLIops.keep);
+		}
+		if(CLIops.dark > 0) fprintf(stdout, "\n\tDark frames: mean luma under %d not kept", CLIops.dark);
+		if(CLIops.ladder)
+			fprintf(stdout, "\n\tLadder: preview %dx%d quality %d, thumbnail %dx%d quality %d", (source->wkm.width / 2) & ~1, source->wkm.height / 2, ladder_quality[1],
+				(source->wkm.width / 4) & ~1, source->wkm.height / 4, ladder_quality[2]);
+		if(display)
+		{
+			struct fb_var_screeninfo *vinfo= &display->vinfo;
+			fprintf(stdout, "\n\tDisplay %dx%d, %s", vinfo->xres, vinfo->yres, display->nbuffers == 2 ? "double buffered" : "single buffer");
+			unsigned int num= display_scale(source->wkm.width, source->wkm.height, vinfo);
+			if(wkmf != V4L2_PIX_FMT_YUYV && num < 8) fprintf(stdout, ", JPEG decoded at %u/8", num);
+			if(wkmf == V4L2_PIX_FMT_YUYV && ((unsigned) source->wkm.width > vinfo->xres || (unsigned) source->wkm.height > vinfo->yres)) 
+				fprintf(stdout, ", YUYV image cropped");
+		}
 		fprintf(stdout, "\n\n");
 		
 		// (5) CAPTURE LOOP
-		unsigned int n=0;
-		ImageInfo info;
-		
+		// one event loop for the capture timer, the camera, the keyboard and the upload socket
+		CaptureLoop loop;
+		CloudUpload upload(&loop.reactor);
+		upload.verbose= CLIops.verbose;
+		loop.source= source;
+		loop.upload= CLIops.cloud && CLIops.threads <= 0 ? &upload : 0;
+		loop.pipeline= 0;
+		loop.writer= 0;
+		loop.motion= motion;
+		loop.display= display;
+		loop.display_num= display ? display_scale(source->wkm.width, source->wkm.height, &display->vinfo) : 8;
+		loop.n= 0;
+		loop.nframes= 0;
+		loop.published= 0;
+		loop.drops= 0;
+		loop.pending= false;
+		loop.pending_us= 0;
+		loop.stalled= false;
+		loop.waits= 0;
+		loop.outputs= 0;
+		loop.sum_age_us= 0;
+		loop.max_age_us= 0;
 		
 		hhtpPOST_init(HOST_NAME, HOST_URL, HOST_PORT);
 		
-		if(!CLIops.agent) termios_init();
-		for(;;)
+		// termination signals are read by the event loop. Blocked before any thread is started so that
+		// the threads do not take them
+		sigset_t sigmask;
+		sigemptyset(&sigmask);
+		sigaddset(&sigmask, SIGINT);
+		sigaddset(&sigmask, SIGTERM);
+		sigprocmask(SIG_BLOCK, &sigmask, 0);
+		int sigfd= signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+		
+		if(display) display->Start(display_render, &loop);
+		
+		// Pipeline: capture (this thread) -> encoders -> disk or cloud
+		Pipeline pipeline;
+		POSTMessageMemory cloudmem;
+		loop.cloudmem= &cloudmem;
+		if(CLIops.threads > 0)
 		{
-			// V4L capture image. Image is stored at v4lcam.ptr_capture_buffer
-			if( v4lcam.CaptureImage() !=0) break;
-			
-			++n %= 20;
-			char filename[64];
-			char fullfilename[128];	
-			snprintf(filename, sizeof(filename),"image_%03d.jpg", n);
-			snprintf(fullfilename, sizeof(fullfilename),"%s%s", IMAGE_STORAGE_PATH, filename);	
-
-			unsigned char *jpeg_ptr= 0;
-			size_t jpeg_sz=0;
-			// YUYV
-			if(v4lcam.wkm.pixelformat == V4L2_PIX_FMT_YUYV)
-			{
-				// Compress to JPEG
-		//		jpeg_sz += compressYUYV_through_RGB_to_JPEG(outfile, fullfilename, ptr_capture_buffer, CapResolution->width, CapResolution->height);
-				jpeg_sz= compressYUYVtoJPEG((char*)v4lcam.ptr_capture_buffer, v4lcam.wkm.width, v4lcam.wkm.height);
-				// Outcome is in gmemptr (pointer to jpeg compressed image)
-				jpeg_ptr= gmemptr;
-				if(CLIops.display)
-				{
-					info.width= v4lcam.wkm.width;
-					info.height= v4lcam.wkm.height;
-					display_imgageYUVY_2_fb(&info, (char *)v4lcam.ptr_capture_buffer, fbp, &vinfo, 0, 0);
-				}
-			}
-			// JPEG
-			else if(v4lcam.wkm.pixelformat == V4L2_PIX_FMT_MJPEG || v4lcam.wkm.pixelformat == V4L2_PIX_FMT_JPEG)
+			if(CLIops.queue < 1) CLIops.queue= 1;
+			if(CLIops.cloud) pipeline.AddSink("cloud", cloud_sink, &loop, CLIops.queue, CLIops.drop);
+			else pipeline.AddSink("disk", disk_sink, &loop, CLIops.queue, CLIops.drop);
+			if(CLIops.archive) pipeline.AddSink("archive", archive_sink, &loop, CLIops.queue, CLIops.drop);
+			if(CLIops.shm > 0) pipeline.AddSink("shm", shm_sink, &loop, CLIops.queue, CLIops.drop);
+			pipeline.Start(CLIops.threads, CLIops.queue, CLIops.drop, encode_stage, &loop);
+			loop.pipeline= &pipeline;
+			// capture buffers held by the pipeline are not available to the driver
+			if(v4lcam && v4lcam->nbuffers <= CLIops.queue + CLIops.threads)
+				fprintf(stdout, "\nWARNING: %d buffers for a pipeline holding up to %d frames, use buffers=N\n", v4lcam->nbuffers, CLIops.queue + CLIops.threads);
+		}
+		// Single threaded loop: files are written on a thread of their own, so that capture never waits 
+		// for the storage (SD card). When the writer is behind, the oldest image waiting is dropped
+		else if((!CLIops.cloud || CLIops.archive) && CLIops.writeq > 0)
+		{
+			if(!CLIops.cloud) pipeline.AddSink("disk", disk_sink, &loop, CLIops.writeq, drop_oldest);
+			if(CLIops.archive) pipeline.AddSink("archive", archive_sink, &loop, CLIops.writeq, drop_oldest);
+			pipeline.Start(0, 1, drop_oldest, encode_stage, &loop);
+			loop.writer= &pipeline;
+		}
+		// Image memory, allocated once: one JPEG image for every frame the pipeline can hold (and the 
+		// one the capture loop encodes when the loop encodes)
+		int nimages= loop.pipeline ? pipeline.MaxFrames() : loop.writer ? pipeline.MaxFrames() + 1 : 1;
+		jpegpool= new FramePool("jpeg", (size_t) source->wkm.width * source->wkm.height * 2, nimages);
+		// and a preview and a thumbnail for each of them, in slabs sized for their rung
+		if(CLIops.ladder)
+		{
+			previewpool= new FramePool("preview", ladder_slab(source->wkm.width, source->wkm.height, 1), nimages);
+			thumbpool= new FramePool("thumb", ladder_slab(source->wkm.width, source->wkm.height, 2), nimages);
+		}
+		// Local storage: the image files are opened once
+		if(!CLIops.cloud)
+		{
+			storage= new SlotStore(IMAGE_STORAGE_PATH, DATA_FILE, CLIops.slots);
+			if(storage->Open(CLIops.ladder) != 0) exit(EXIT_FAILURE);
+		}
+		// Archive: segments are started by the images
+		if(CLIops.archive)
+		{
+			archive= new ArchiveWriter(CLIops.archive, source->wkm.width, source->wkm.height);
+			archive->segment_bytes= (uint64_t) (CLIops.segment > 0 ? CLIops.segment : ARCHIVE_SEGMENT_MB) << 20;
+			archive->segment_seconds= CLIops.rotate > 0 ? CLIops.rotate * 3600 : 0;
+			archive->retain_bytes= (uint64_t) (CLIops.retainmb > 0 ? CLIops.retainmb : 0) << 20;
+			archive->retain_seconds= CLIops.retain > 0 ? CLIops.retain * 86400 : 0;
+			if(archive->Open() != 0) exit(EXIT_FAILURE);
+		}
+		// Shared memory ring: slots of one byte per pixel (JPEG images are well under)
+		if(CLIops.shm > 0)
+		{
+			shmring= new ShmRingWriter;
+			if(shmring->Create(SHMRING_NAME, CLIops.shm, (size_t) source->wkm.width * source->wkm.height, source->wkm.width, source->wkm.height) != 0)
 			{
-				jpeg_ptr= (unsigned char*)v4lcam.ptr_capture_buffer;
-				jpeg_sz= v4lcam.capture_length;
-				if(CLIops.display)
-				{
-					JPEG_decompress(&info, jpeg_ptr, jpeg_sz); 
-					display_imageRGB_2_fb(&info, gmemptr, fbp, &vinfo, 0, 0); 
-				}
+				fprintf(stdout, "\nWARNING: no shared memory ring");
+				delete shmring;
+				shmring= 0;
 			}
-			
-			if(jpeg_ptr){
-				// Upload JPEG file into the cloud
-				if(CLIops.cloud)
-				{
-					double elapsed=0;
-					char result[128];
-					result[0]='\0';
-					// allocate memory
-					postmem.size((size_t) jpeg_sz);
-					if(postmem.mem_ptr)
-					{
-					// image file upload
-//					upload_image(&postmem, filename, (char*)jpeg_ptr, &elapsed, result);
-									
-						char *xmlcode_ptr;
-						char *memptr= postmem.mem_ptr; 
-						size_t mem_sz= postmem.mem_sz;
-						size_t payload_sz= postmem.payload;
-						size_t pos;
-						
-						size_t nbytes= hhtpPOST_header(filename, memptr, mem_sz, &pos, payload_sz);
-						memcpy(&memptr[pos], jpeg_ptr, payload_sz);
-						result[0]='\0';
-						if(hhtpPOST_upload(memptr, nbytes, &elapsed, &xmlcode_ptr) <0 )
-						{
-							strcpy(result, "CONNECTION ERROR");
-						}
-						else
-						{
-						
-						pos = xmlcode_ptr? string(xmlcode_ptr).find("<result>") : string::npos;
-						if(pos != string::npos) 
-							sscanf(&xmlcode_ptr[pos], "%*[^>]>%[^</]</", result); // read and ignore characters other than a '>'
-						}
-					}				
-					
+		}
+		struct timespec t_start, t_end;
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
 		
-					
-					
-					if(CLIops.verbose) 
-					{
-						double temperature= CPUtemperature();
-						if(CLIops.verbose) printf("T=%6.2fC %s %.2f ms %s\n", temperature, filename, elapsed/1000, result);
-					}				
-				}
-				// Store JPEG image locally
-				else
-				{
-					FILE *fp;
-					// (1) JPEG file
-					if ( (fp = fopen(fullfilename, "wb")) != NULL) 
-					{					
-						fwrite(jpeg_ptr,  sizeof(char), jpeg_sz, fp);
-						fclose(fp);
-					}
-					// (2) Write metadata file containing the name of the JPEG just stored
-					if ( (fp = fopen(fulldatafilename, "w"))!= NULL ) {
-						fwrite(filename,  sizeof(char), strlen(filename), fp);
-						fclose(fp);
-					}	
-
-					if(CLIops.verbose) {
-						double temperature= CPUtemperature();
-						if(CLIops.verbose) printf("T=%6.2fC %s\r", temperature, filename);
-					}
-				}
-			}
-			
-			// Wait
-			if(CLIops.agent)
-				usleep(CLIops.time * 1000);
-			else
-			{
-				if(!kbhit()) // check key pressed 
-				{ 
-					usleep(CLIops.time * 1000);
-				} else {
-					printf("\r");
-					printf("Program terminated by user\n");
-					break;
-				}
-			}
+		if(!CLIops.agent) 
+		{
+			termios_init();
+			termios_raw();
+			if(loop.reactor.Add(STDIN_FILENO, EPOLLIN, on_keyboard, &loop) != 0)
+				fprintf(stdout, "\nWARNING: keyboard not available\n");
+		}
+		loop.sched.Start(CLIops.time, CLIops.overrun);
+		if(loop.reactor.Add(loop.sched.TimerFd(), EPOLLIN, on_timer, &loop) != 0)
+		{
+			perror("ERROR: capture timer");
+			exit(EXIT_FAILURE);
+		}
+		if(source->PollFd() != -1) loop.reactor.Add(source->PollFd(), EPOLLIN, on_camera, &loop);
+		if(sigfd == -1 || loop.reactor.Add(sigfd, EPOLLIN, on_signal, &loop) != 0)
+		{
+			// no way to stop but the default action of the signals
+			sigprocmask(SIG_UNBLOCK, &sigmask, 0);
+			fprintf(stdout, "\nWARNING: signals not handled\n");
 		}
+		while(loop.reactor.running)
+			if(loop.reactor.Poll(-1) < 0) break;
 		
 		// (5) Terminate
+		pipeline.Stop();
+		if(display) display->Stop();
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+		double elapsed= (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+		CaptureScheduler *sched= &loop.sched;
+		fprintf(stdout, "\nFrames= %lu in %.2f s (%.2f fps)", loop.nframes, elapsed, elapsed > 0 ? loop.nframes / elapsed : 0);
+		fprintf(stdout, "\nLateness mean= %.2f ms max= %.2f ms, skipped= %lu", sched->frames? sched->sum_lateness_us / sched->frames / 1000 : 0, sched->max_lateness_us / 1000.0, sched->skipped);
+		fprintf(stdout, "\nDropped by the driver= %lu, captures that waited for the camera= %lu", loop.drops, loop.waits);
+		fprintf(stdout, "\nAge capture to %s mean= %.2f ms max= %.2f ms (%lu images)", CLIops.cloud ? "upload" : "file", loop.outputs ? loop.sum_age_us / loop.outputs / 1000 : 0, loop.max_age_us / 1000.0, loop.outputs);
+		if(loop.upload) fprintf(stdout, "\nUploads= %lu, not uploaded (replaced by a newer image while the upload was busy)= %lu", upload.uploaded, upload.dropped);
+		pipeline.PrintStats(stdout);
+		if(display) display->PrintStats(stdout);
+		if(storage) storage->PrintStats(stdout);
+		if(shmring) shmring->PrintStats(stdout);
+		if(archive) archive->PrintStats(stdout);
+		fprintf(stdout, "\nMemory:");
+		jpegpool->PrintStats(stdout);
+		if(previewpool) previewpool->PrintStats(stdout);
+		if(thumbpool) thumbpool->PrintStats(stdout);
+		if(ratectl) ratectl->PrintStats(stdout);
+		if(motion) motion->PrintStats(stdout);
+		fprintf(stdout, "\n");
 		if(!CLIops.agent) termios_restore();
-		if(fbp) munmap(fbp, fb_size);
-		if(fb) close(fb);
+		if(sigfd != -1) close(sigfd);
+		if(display) delete display;
+		if(stripenc) delete stripenc;
+		delete jpegpool;
+		if(previewpool) delete previewpool;
+		if(thumbpool) delete thumbpool;
+		if(storage) delete storage;
+		if(shmring) delete shmring;
+		if(archive) delete archive;
+		if(ratectl) delete ratectl;
+		if(motion) delete motion;
 	}
 	
 	// Terminate
-	v4lcam.~V4L_device();
-	if(gmemptr) free(gmemptr);
+	delete source;
 	exit(EXIT_SUCCESS);
 }
 
@@ -6,6 +6,7 @@
 #define FRAMEBUFFER_DEVICE	"/dev/fb0"
 #define IMAGE_STORAGE_PATH 	"/var/www/ramdisk/"
 #define DATA_FILE 			"data.txt"
+#define CAPS_CACHE_PATH		"/var/tmp/"		// camera capabilities cache (survives restarts)
 
 // Upload server
 #define HOST_NAME "192.168.1.100"
@@ -13,12 +14,8 @@
 #define HOST_PORT 80
 #define IMAGE_SAVED_FILES "/var/www/ramdisk/"
 
+#include "framesource.h"
 
-typedef struct 
-{
-	int width;
-	int height;
-} CaptureResolution;
 
 const CaptureResolution svga_wh = (CaptureResolution) {800, 600};
 const CaptureResolution  vga_wh = (CaptureResolution) {640, 480};
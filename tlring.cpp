@@ -0,0 +1,120 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * tlring: dumps images from the shared memory ring of tlcam (option shm)
+ *
+ * e.g.:
+ *		tlring info					-> ring layout and state
+ *		tlring 10 dir=/tmp			-> next 10 images into /tmp/ring_NNNNNN.jpg
+ *		tlring 0 - > capture.mjpg	-> every image, as concatenated JPEGs (tlcam replay file), until
+ *									   tlcam exits
+ **************************************************************************************************
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "shmring.h"
+
+static int64_t now_us(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(void)
+{
+	printf("\n");
+	printf("Usage:\n"
+		"tlring [info] [N] [options]\n"
+		"   info      - shows the ring layout and state\n"
+		"   N         - number of images to dump, 0 until tlcam exits (default 1)\n"
+		"Options are:\n"
+		"   dir=D     - images into D/ring_NNNNNN.jpg (default current directory)\n"
+		"   -         - images to the standard output, one after another (MJPEG replay file)\n"
+		"   name=S    - shared memory object (default %s)\n"
+		"   timeout=T - give up after T ms with no image (default 5000)\n"
+		"\n", SHMRING_NAME);
+}
+
+int main(int argc, char *argv[])
+{
+	bool info= false;
+	bool to_stdout= false;
+	long count= 1;
+	int timeout= 5000;
+	const char *dir= ".";
+	const char *name= SHMRING_NAME;
+	for(int i=1; i<argc; i++)
+	{
+		const char *str= argv[i];
+		if(strcmp(str, "info")==0) info= true;
+		else if(strcmp(str, "-")==0) to_stdout= true;
+		else if(strncmp(str, "dir=", strlen("dir="))==0) dir= &str[strlen("dir=")];
+		else if(strncmp(str, "name=", strlen("name="))==0) name= &str[strlen("name=")];
+		else if(strncmp(str, "timeout=", strlen("timeout="))==0) timeout= atoi(&str[strlen("timeout=")]);
+		else if(str[0] >= '0' && str[0] <= '9') count= atol(str);
+		else
+		{
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+	// messages go to stderr when the images go to stdout
+	FILE *msg= to_stdout ? stderr : stdout;
+
+	ShmRingReader ring;
+	if(ring.Attach(name) != 0)
+	{
+		fprintf(stdout, "\n");
+		exit(EXIT_FAILURE);
+	}
+	const ShmRingHeader *h= ring.header;
+	if(info)
+	{
+		fprintf(msg, "Ring %s: %u slots of %u KB, %ux%u, writer pid %u%s, %u images written\n", name, h->nslots, h->slot_size / 1024,
+			h->width, h->height, h->writer_pid, ((ShmRingHeader *) h)->closed.load() ? " (exited)" : "", ((ShmRingHeader *) h)->head.load());
+		exit(EXIT_SUCCESS);
+	}
+
+	std::vector<uint8_t> copy;
+	ShmFrame f;
+	long n= 0;
+	// the image in the ring when started is not dumped: the next ones are
+	ring.seen= ((ShmRingHeader *) h)->head.load();
+	while(count == 0 || n < count)
+	{
+		if(ring.Wait(timeout) != 0)
+		{
+			if(!ring.Closed()) fprintf(msg, "Timeout: no image in %d ms\n", timeout);
+			break;
+		}
+		if(ring.Read(&f, &copy) != 1) continue;
+		if(to_stdout)
+		{
+			fwrite(f.data, 1, f.size, stdout);
+			fflush(stdout);
+		}
+		else
+		{
+			char filename[256];
+			snprintf(filename, sizeof(filename), "%s/ring_%06u.jpg", dir, f.frame);
+			FILE *fp= fopen(filename, "wb");
+			if(!fp)
+			{
+				perror(filename);
+				exit(EXIT_FAILURE);
+			}
+			fwrite(f.data, 1, f.size, fp);
+			fclose(fp);
+		}
+		fprintf(msg, "image %u #%lu %lu bytes age %.1f ms\n", f.frame, f.sequence, (unsigned long) f.size, (now_us(CLOCK_MONOTONIC) - f.timestamp_us) / 1000.0);
+		n++;
+	}
+	fprintf(msg, "%ld images, %lu missed%s\n", n, ring.missed, ring.Closed() ? ", tlcam exited" : "");
+	exit(EXIT_SUCCESS);
+}
+
+/* END OF FILE */
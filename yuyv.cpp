@@ -0,0 +1,211 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * YUYV row converters: scalar reference and SSE2 (x86)
+ *
+ * NEON versions are in yuyv_neon.cpp. yuyv_kernels() picks the best set for the CPU at run time
+ **************************************************************************************************
+*/
+#include <stdio.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define YUYV_SSE2
+#endif
+#if defined(__arm__) || defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "yuyv.h"
+
+static inline uint8_t clamp255(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : (uint8_t) v;
+}
+
+//  _____________________
+// |                     |
+// |       SCALAR        |
+// |_____________________|
+//
+static void scalar_to_planes(const uint8_t *src, int pairs, uint8_t *y, uint8_t *cb, uint8_t *cr)
+{
+	for(int i=0; i<pairs; i++, src+= 4)
+	{
+		y[2*i]= src[0];
+		cb[i]= src[1];
+		y[2*i+1]= src[2];
+		cr[i]= src[3];
+	}
+}
+
+static void scalar_to_ycbcr(const uint8_t *src, int pairs, uint8_t *dst)
+{
+	for(int i=0; i<pairs; i++, src+= 4, dst+= 6)
+	{
+		dst[0]= src[0]; // Y (unique to this pixel)
+		dst[1]= src[1]; // U (shared between pixels)
+		dst[2]= src[3]; // V (shared between pixels)
+		dst[3]= src[2]; // Y (unique to this pixel)
+		dst[4]= src[1]; // U (shared between pixels)
+		dst[5]= src[3]; // V (shared between pixels)
+	}
+}
+
+// Products of the BT.601 coefficients (yuyv.h) by every sample value, rounding included in 'y'
+// No multiplication per pixel (Pi Zero). Sums are the ones of the SIMD kernels, bit for bit
+static struct BT601Tables
+{
+	int32_t y[256];
+	int32_t rcr[256];
+	int32_t gcb[256];
+	int32_t gcr[256];
+	int32_t bcb[256];
+	BT601Tables(void)
+	{
+		for(int i=0; i<256; i++)
+		{
+			y[i]= YUYV_FIX_Y * (i - 16) + (1 << (YUYV_FIX_BITS - 1));
+			rcr[i]= YUYV_FIX_RCR * (i - 128);
+			gcb[i]= -YUYV_FIX_GCB * (i - 128);
+			gcr[i]= -YUYV_FIX_GCR * (i - 128);
+			bcb[i]= YUYV_FIX_BCB * (i - 128);
+		}
+	}
+} bt601;
+
+static void scalar_to_bgrx(const uint8_t *src, int pairs, uint8_t *dst)
+{
+	for(int i=0; i<pairs; i++, src+= 4, dst+= 8)
+	{
+		int b= bt601.bcb[src[1]];
+		int g= bt601.gcb[src[1]] + bt601.gcr[src[3]];
+		int r= bt601.rcr[src[3]];
+		int p= bt601.y[src[0]];
+		dst[0]= clamp255((p + b) >> YUYV_FIX_BITS);
+		dst[1]= clamp255((p + g) >> YUYV_FIX_BITS);
+		dst[2]= clamp255((p + r) >> YUYV_FIX_BITS);
+		dst[3]= 0;
+		p= bt601.y[src[2]];
+		dst[4]= clamp255((p + b) >> YUYV_FIX_BITS);
+		dst[5]= clamp255((p + g) >> YUYV_FIX_BITS);
+		dst[6]= clamp255((p + r) >> YUYV_FIX_BITS);
+		dst[7]= 0;
+	}
+}
+
+void yuyv_bt601(int y, int cb, int cr, uint8_t *b, uint8_t *g, uint8_t *r)
+{
+	const double kr= 0.299, kb= 0.114;
+	double l= 255.0 / 219 * (y - 16);
+	double u= 255.0 / 112 * (cb - 128);
+	double v= 255.0 / 112 * (cr - 128);
+	*r= clamp255((int) lround(l + (1 - kr) * v));
+	*g= clamp255((int) lround(l - (1 - kb) * kb / (1 - kr - kb) * u - (1 - kr) * kr / (1 - kr - kb) * v));
+	*b= clamp255((int) lround(l + (1 - kb) * u));
+}
+
+const YUYVKernels yuyv_scalar= {"scalar", scalar_to_planes, scalar_to_ycbcr, scalar_to_bgrx};
+
+//  _____________________
+// |                     |
+// |        SSE2         |
+// |_____________________|
+//
+#ifdef YUYV_SSE2
+// 16 pixels (32 bytes) per iteration
+__attribute__((target("sse2")))
+static void sse2_to_planes(const uint8_t *src, int pairs, uint8_t *y, uint8_t *cb, uint8_t *cr)
+{
+	const __m128i lo= _mm_set1_epi16(0x00FF);
+	int i= 0;
+	for(; i + 8 <= pairs; i+= 8, src+= 32)
+	{
+		__m128i a= _mm_loadu_si128((const __m128i *) src);
+		__m128i b= _mm_loadu_si128((const __m128i *) (src + 16));
+		_mm_storeu_si128((__m128i *) &y[2*i], _mm_packus_epi16(_mm_and_si128(a, lo), _mm_and_si128(b, lo)));
+		__m128i c= _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)); // Cb Cr Cb Cr ...
+		__m128i zero= _mm_setzero_si128();
+		_mm_storel_epi64((__m128i *) &cb[i], _mm_packus_epi16(_mm_and_si128(c, lo), zero));
+		_mm_storel_epi64((__m128i *) &cr[i], _mm_packus_epi16(_mm_srli_epi16(c, 8), zero));
+	}
+	scalar_to_planes(src, pairs - i, &y[2*i], &cb[i], &cr[i]);
+}
+
+// 16 bit coefficient pairs for _mm_madd_epi16: 'a' in the even lanes, 'b' in the odd ones
+static inline __m128i sse2_pair(int16_t a, int16_t b)
+{
+	return _mm_set_epi16(b, a, b, a, b, a, b, a);
+}
+
+// Pixels 0 ... 3 (pairs 0, 0, 1, 1) and 4 ... 7 (pairs 2, 2, 3, 3) of luma + chroma, shifted and saturated
+// to 16 bits, low pixels first
+__attribute__((target("sse2")))
+static inline __m128i sse2_bt601(__m128i ylo, __m128i yhi, __m128i c)
+{
+	__m128i lo= _mm_add_epi32(ylo, _mm_shuffle_epi32(c, _MM_SHUFFLE(1,1,0,0)));
+	__m128i hi= _mm_add_epi32(yhi, _mm_shuffle_epi32(c, _MM_SHUFFLE(3,3,2,2)));
+	return _mm_packs_epi32(_mm_srai_epi32(lo, YUYV_FIX_BITS), _mm_srai_epi32(hi, YUYV_FIX_BITS));
+}
+
+// 8 pixels (16 bytes) per iteration. Coefficients and sums as in scalar_to_bgrx, 32 bit lanes:
+// _mm_madd_epi16 multiplies the 16 bit samples and adds the products of a pair of lanes
+__attribute__((target("sse2")))
+static void sse2_to_bgrx(const uint8_t *src, int pairs, uint8_t *dst)
+{
+	const __m128i lo= _mm_set1_epi16(0x00FF);
+	const __m128i c16= _mm_set1_epi16(16);
+	const __m128i c128= _mm_set1_epi16(128);
+	const __m128i one= _mm_set1_epi16(1);
+	const __m128i zero= _mm_setzero_si128();
+	const __m128i ky= sse2_pair(YUYV_FIX_Y, 1 << (YUYV_FIX_BITS - 1));	// (Y-16, 1): luma and rounding
+	const __m128i kr= sse2_pair(0, YUYV_FIX_RCR);							// (Cb-128, Cr-128)
+	const __m128i kg= sse2_pair(-YUYV_FIX_GCB, -YUYV_FIX_GCR);
+	const __m128i kb= sse2_pair(YUYV_FIX_BCB, 0);
+	int i= 0;
+	for(; i + 4 <= pairs; i+= 4, src+= 16, dst+= 32)
+	{
+		__m128i a= _mm_loadu_si128((const __m128i *) src);
+		__m128i y= _mm_sub_epi16(_mm_and_si128(a, lo), c16);
+		__m128i uv= _mm_sub_epi16(_mm_srli_epi16(a, 8), c128); // Cb0 Cr0 Cb1 Cr1 ...
+		__m128i ylo= _mm_madd_epi16(_mm_unpacklo_epi16(y, one), ky);
+		__m128i yhi= _mm_madd_epi16(_mm_unpackhi_epi16(y, one), ky);
+		__m128i b= sse2_bt601(ylo, yhi, _mm_madd_epi16(uv, kb));
+		__m128i g= sse2_bt601(ylo, yhi, _mm_madd_epi16(uv, kg));
+		__m128i r= sse2_bt601(ylo, yhi, _mm_madd_epi16(uv, kr));
+		__m128i bg= _mm_unpacklo_epi8(_mm_packus_epi16(b, zero), _mm_packus_epi16(g, zero));
+		__m128i rx= _mm_unpacklo_epi8(_mm_packus_epi16(r, zero), zero);
+		_mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi16(bg, rx));
+		_mm_storeu_si128((__m128i *) (dst + 16), _mm_unpackhi_epi16(bg, rx));
+	}
+	scalar_to_bgrx(src, pairs - i, dst);
+}
+
+// Y Cb Cr has 3 bytes per pixel: no SSE2 shuffle for it, the scalar loop is used
+static const YUYVKernels yuyv_sse2= {"sse2", sse2_to_planes, scalar_to_ycbcr, sse2_to_bgrx};
+#endif
+
+static const YUYVKernels *pick_kernels(void)
+{
+	const YUYVKernels *best= &yuyv_scalar;
+#ifdef YUYV_SSE2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) best= &yuyv_sse2;
+#endif
+#if defined(__aarch64__)
+	if(yuyv_neon_kernels() && (getauxval(AT_HWCAP) & HWCAP_ASIMD)) best= yuyv_neon_kernels();
+#elif defined(__arm__)
+	if(yuyv_neon_kernels() && (getauxval(AT_HWCAP) & HWCAP_NEON)) best= yuyv_neon_kernels();
+#endif
+	return best;
+}
+
+// Picked once, on the first call: a static initialized by a function is thread-safe (C++11), and the
+// first call comes from several threads at once (encoders, strip workers, ladder, display)
+const YUYVKernels *yuyv_kernels(void)
+{
+	static const YUYVKernels *best= pick_kernels();
+	return best;
+}
+
+/* END OF FILE */
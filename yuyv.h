@@ -0,0 +1,46 @@
+#ifndef YUYV_HEADER_FILLE_H
+#define YUYV_HEADER_FILLE_H
+
+#include <stdint.h>
+
+// YUYV row converters
+// A YUYV row is 'pairs' groups of 4 bytes Y0 Cb Y1 Cr (two pixels sharing Cb and Cr)
+//	to_planes:	Y0 Y1 ... -> y, Cb -> cb, Cr -> cr (4:2:2 planes for jpeg_write_raw_data)
+//	to_ycbcr:	3 bytes per pixel Y Cb Cr, chroma repeated on both pixels (jpeg_write_scanlines)
+//	to_bgrx:	4 bytes per pixel blue, green, red, 0 (framebuffer). BT.601 limited range (Y 16 ... 235,
+//				Cb Cr 16 ... 240) in fixed point, coefficients x 2^13 (YUYV_FIX_*):
+//				p= 9539 (Y-16) + 4096, R= (p + 13075 (Cr-128)) >> 13, G= (p - 3209 (Cb-128) - 6660 (Cr-128)) >> 13,
+//				B= (p + 16525 (Cb-128)) >> 13, saturated to 0 ... 255
+//				Within 1 of the exact (floating point) conversion, see yuyv_bt601
+// Every implementation gives the same bytes as the scalar one
+#define YUYV_FIX_BITS	13
+#define YUYV_FIX_Y		9539	// 255/219
+#define YUYV_FIX_RCR	13075	// 255/112 x 0.701
+#define YUYV_FIX_GCB	3209	// 255/112 x 0.886 x 0.114 / 0.587
+#define YUYV_FIX_GCR	6660	// 255/112 x 0.701 x 0.299 / 0.587
+#define YUYV_FIX_BCB	16525	// 255/112 x 0.886
+
+struct YUYVKernels
+{
+	const char *name;
+	void (*to_planes)(const uint8_t *yuyv, int pairs, uint8_t *y, uint8_t *cb, uint8_t *cr);
+	void (*to_ycbcr)(const uint8_t *yuyv, int pairs, uint8_t *ycbcr);
+	void (*to_bgrx)(const uint8_t *yuyv, int pairs, uint8_t *bgrx);
+};
+
+// Reference implementation (any CPU). to_bgrx from lookup tables
+extern const YUYVKernels yuyv_scalar;
+
+// Exact BT.601 limited range conversion of one pixel (floating point, rounded and saturated): the
+// reference the fixed point converters are checked against
+void yuyv_bt601(int y, int cb, int cr, uint8_t *b, uint8_t *g, uint8_t *r);
+
+// Best kernels for this CPU: NEON (ARM) or SSE2 (x86) when the CPU has them, scalar otherwise
+// CPU features are checked on the first call
+const YUYVKernels *yuyv_kernels(void);
+
+// NEON kernels (yuyv_neon.cpp, built with NEON enabled on ARM). 0 when not built in
+const YUYVKernels *yuyv_neon_kernels(void);
+
+#endif
+/* END OF FILE */
@@ -0,0 +1,113 @@
+/**************************************************************************************************
+ * Time Lapse Camera
+ * YUYV row converters: NEON (ARM)
+ *
+ * Built with NEON enabled (see Makefile) but only called when the CPU has NEON (yuyv_kernels)
+ * Remaining pixels of a row go through the scalar kernels
+ **************************************************************************************************
+*/
+#include "yuyv.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+// 32 pixels (64 bytes) per iteration
+static void neon_to_planes(const uint8_t *src, int pairs, uint8_t *y, uint8_t *cb, uint8_t *cr)
+{
+	int i= 0;
+	for(; i + 16 <= pairs; i+= 16, src+= 64)
+	{
+		uint8x16x4_t in= vld4q_u8(src); // Y0, Cb, Y1, Cr
+		uint8x16x2_t luma;
+		luma.val[0]= in.val[0];
+		luma.val[1]= in.val[2];
+		vst2q_u8(&y[2*i], luma);
+		vst1q_u8(&cb[i], in.val[1]);
+		vst1q_u8(&cr[i], in.val[3]);
+	}
+	yuyv_scalar.to_planes(src, pairs - i, &y[2*i], &cb[i], &cr[i]);
+}
+
+// 16 pixels (32 bytes) per iteration
+static void neon_to_ycbcr(const uint8_t *src, int pairs, uint8_t *dst)
+{
+	int i= 0;
+	for(; i + 8 <= pairs; i+= 8, src+= 32, dst+= 48)
+	{
+		uint8x8x4_t in= vld4_u8(src); // Y0, Cb, Y1, Cr
+		uint8x8x2_t luma= vzip_u8(in.val[0], in.val[2]);
+		uint8x8x2_t cb= vzip_u8(in.val[1], in.val[1]);
+		uint8x8x2_t cr= vzip_u8(in.val[3], in.val[3]);
+		uint8x16x3_t out;
+		out.val[0]= vcombine_u8(luma.val[0], luma.val[1]);
+		out.val[1]= vcombine_u8(cb.val[0], cb.val[1]);
+		out.val[2]= vcombine_u8(cr.val[0], cr.val[1]);
+		vst3q_u8(dst, out);
+	}
+	yuyv_scalar.to_ycbcr(src, pairs - i, dst);
+}
+
+// Luma + chroma of 8 pairs (low and high 4 in 32 bit lanes), shifted and saturated to 0 ... 255
+static inline uint8x8_t neon_bt601(int32x4_t ylo, int32x4_t yhi, int32x4_t clo, int32x4_t chi)
+{
+	int16x4_t lo= vqmovn_s32(vshrq_n_s32(vaddq_s32(ylo, clo), YUYV_FIX_BITS));
+	int16x4_t hi= vqmovn_s32(vshrq_n_s32(vaddq_s32(yhi, chi), YUYV_FIX_BITS));
+	return vqmovun_s16(vcombine_s16(lo, hi));
+}
+
+// 16 pixels (32 bytes) per iteration. Coefficients and sums as in scalar_to_bgrx (yuyv.cpp), 16 bit
+// samples multiplied into 32 bit lanes (vmull / vmlal)
+static void neon_to_bgrx(const uint8_t *src, int pairs, uint8_t *dst)
+{
+	const uint8x8_t c16= vdup_n_u8(16);
+	const uint8x8_t c128= vdup_n_u8(128);
+	const int32x4_t round= vdupq_n_s32(1 << (YUYV_FIX_BITS - 1));
+	int i= 0;
+	for(; i + 8 <= pairs; i+= 8, src+= 32, dst+= 64)
+	{
+		uint8x8x4_t in= vld4_u8(src); // Y0, Cb, Y1, Cr
+		int16x8_t d= vreinterpretq_s16_u16(vsubl_u8(in.val[1], c128));
+		int16x8_t e= vreinterpretq_s16_u16(vsubl_u8(in.val[3], c128));
+		int16x8_t y0= vreinterpretq_s16_u16(vsubl_u8(in.val[0], c16));
+		int16x8_t y1= vreinterpretq_s16_u16(vsubl_u8(in.val[2], c16));
+		int32x4_t b_lo= vmull_n_s16(vget_low_s16(d), YUYV_FIX_BCB);
+		int32x4_t b_hi= vmull_n_s16(vget_high_s16(d), YUYV_FIX_BCB);
+		int32x4_t g_lo= vmlal_n_s16(vmull_n_s16(vget_low_s16(d), -YUYV_FIX_GCB), vget_low_s16(e), -YUYV_FIX_GCR);
+		int32x4_t g_hi= vmlal_n_s16(vmull_n_s16(vget_high_s16(d), -YUYV_FIX_GCB), vget_high_s16(e), -YUYV_FIX_GCR);
+		int32x4_t r_lo= vmull_n_s16(vget_low_s16(e), YUYV_FIX_RCR);
+		int32x4_t r_hi= vmull_n_s16(vget_high_s16(e), YUYV_FIX_RCR);
+		int32x4_t p0_lo= vmlal_n_s16(round, vget_low_s16(y0), YUYV_FIX_Y);
+		int32x4_t p0_hi= vmlal_n_s16(round, vget_high_s16(y0), YUYV_FIX_Y);
+		int32x4_t p1_lo= vmlal_n_s16(round, vget_low_s16(y1), YUYV_FIX_Y);
+		int32x4_t p1_hi= vmlal_n_s16(round, vget_high_s16(y1), YUYV_FIX_Y);
+		// even pixels from Y0, odd pixels from Y1
+		uint8x8x2_t bb= vzip_u8(neon_bt601(p0_lo, p0_hi, b_lo, b_hi), neon_bt601(p1_lo, p1_hi, b_lo, b_hi));
+		uint8x8x2_t gg= vzip_u8(neon_bt601(p0_lo, p0_hi, g_lo, g_hi), neon_bt601(p1_lo, p1_hi, g_lo, g_hi));
+		uint8x8x2_t rr= vzip_u8(neon_bt601(p0_lo, p0_hi, r_lo, r_hi), neon_bt601(p1_lo, p1_hi, r_lo, r_hi));
+		uint8x16x4_t out;
+		out.val[0]= vcombine_u8(bb.val[0], bb.val[1]);
+		out.val[1]= vcombine_u8(gg.val[0], gg.val[1]);
+		out.val[2]= vcombine_u8(rr.val[0], rr.val[1]);
+		out.val[3]= vdupq_n_u8(0);
+		vst4q_u8(dst, out);
+	}
+	yuyv_scalar.to_bgrx(src, pairs - i, dst);
+}
+
+static const YUYVKernels yuyv_neon= {"neon", neon_to_planes, neon_to_ycbcr, neon_to_bgrx};
+
+const YUYVKernels *yuyv_neon_kernels(void)
+{
+	return &yuyv_neon;
+}
+
+#else
+
+const YUYVKernels *yuyv_neon_kernels(void)
+{
+	return 0;
+}
+
+#endif
+
+/* END OF FILE */